@@ -0,0 +1,261 @@
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#ifdef USE_IO_URING
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif  // USE_IO_URING
+
+#include <algorithm>
+#include <deque>
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+#include <vector>
+
+#include "caffe/util/async_file_reader.hpp"
+
+namespace caffe {
+
+AsyncFileReader::AsyncFileReader(const Source& source, int queue_depth,
+    size_t max_bytes, int threads)
+    : source_(source),
+      queue_depth_(queue_depth),
+      max_bytes_(max_bytes),
+      threads_(threads),
+      in_flight_(0),
+      bytes_(0),
+      requests_(std::max(queue_depth, 1)) {
+  CHECK_GT(queue_depth_, 0);
+  CHECK_GT(max_bytes_, 0);
+  CHECK_GT(threads_, 0);
+  StartInternalThread();
+}
+
+AsyncFileReader::~AsyncFileReader() {
+  StopInternalThread();
+  readers_.interrupt_all();
+  readers_.join_all();
+}
+
+AsyncFileReader::File* AsyncFileReader::Next() {
+  boost::mutex::scoped_lock lock(mutex_);
+  while (pending_.empty() || !pending_.front()->done) {
+    cond_.wait(lock);
+  }
+  File* file = pending_.front();
+  pending_.pop_front();
+  bytes_ -= file->data.size();
+  cond_.notify_all();
+  return file;
+}
+
+void AsyncFileReader::Release(File* file) {
+  boost::mutex::scoped_lock lock(mutex_);
+  pool_.push_back(file);
+}
+
+AsyncFileReader::File* AsyncFileReader::NewRequest(bool wait) {
+  boost::mutex::scoped_lock lock(mutex_);
+  while (in_flight_ >= queue_depth_ || bytes_ >= max_bytes_) {
+    if (!wait) {
+      return NULL;
+    }
+    cond_.wait(lock);
+  }
+  File* file;
+  if (pool_.empty()) {
+    files_.push_back(shared_ptr<File>(new File()));
+    file = files_.back().get();
+  } else {
+    file = pool_.back();
+    pool_.pop_back();
+  }
+  source_(&file->path, &file->tag);
+  file->ok = false;
+  file->done = false;
+  file->fd = -1;
+  file->offset = 0;
+  ++in_flight_;
+  pending_.push_back(file);
+  return file;
+}
+
+void AsyncFileReader::Complete(File* file, bool ok) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (!ok) {
+    LOG(ERROR) << "Could not read " << file->path;
+    file->data.clear();
+  }
+  file->ok = ok;
+  file->done = true;
+  --in_flight_;
+  bytes_ += file->data.size();
+  cond_.notify_all();
+}
+
+void AsyncFileReader::InternalThreadEntry() {
+#ifdef USE_IO_URING
+  if (SubmitToUring()) {
+    return;
+  }
+  LOG(INFO) << "io_uring is not available, reading with " << threads_
+      << " threads";
+#endif  // USE_IO_URING
+  SubmitToThreads();
+}
+
+void AsyncFileReader::SubmitToThreads() {
+  for (int i = 0; i < threads_; ++i) {
+    readers_.create_thread(
+        boost::bind(&AsyncFileReader::ReaderThreadEntry, this));
+  }
+  try {
+    while (!must_stop()) {
+      requests_.push(NewRequest(true));
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
+void AsyncFileReader::ReaderThreadEntry() {
+  try {
+    while (true) {
+      File* file = requests_.pop();
+      std::ifstream in(file->path.c_str(),
+          std::ios::in | std::ios::binary | std::ios::ate);
+      bool ok = in.is_open();
+      if (ok) {
+        const size_t size = in.tellg();
+        in.seekg(0, std::ios::beg);
+        file->data.resize(size);
+        if (size > 0) {
+          ok = static_cast<bool>(in.read(&file->data[0], size));
+        }
+      }
+      Complete(file, ok);
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
+#ifdef USE_IO_URING
+static void PrepareRead(struct io_uring* ring, AsyncFileReader::File* file) {
+  struct io_uring_sqe* sqe = io_uring_get_sqe(ring);
+  CHECK(sqe) << "io_uring submission queue full";
+  io_uring_prep_read(sqe, file->fd, &file->data[file->offset],
+      file->data.size() - file->offset, file->offset);
+  io_uring_sqe_set_data(sqe, file);
+}
+
+bool AsyncFileReader::SubmitToUring() {
+  struct io_uring ring;
+  int ret = io_uring_queue_init(queue_depth_, &ring, 0);
+  if (ret < 0) {
+    LOG(WARNING) << "io_uring_queue_init: " << strerror(-ret);
+    return false;
+  }
+  LOG(INFO) << "Reading with io_uring, up to " << queue_depth_
+      << " reads in flight";
+  while (!must_stop()) {
+    // Open and submit as many files as there is room for. Opening stays
+    // synchronous, the data is what takes time.
+    File* file;
+    while ((file = NewRequest(false)) != NULL) {
+      struct stat st;
+      file->fd = open(file->path.c_str(), O_RDONLY);
+      if (file->fd < 0 || fstat(file->fd, &st) < 0) {
+        if (file->fd >= 0) {
+          close(file->fd);
+        }
+        Complete(file, false);
+        continue;
+      }
+      file->data.resize(st.st_size);
+      if (file->data.empty()) {
+        close(file->fd);
+        Complete(file, true);
+        continue;
+      }
+      PrepareRead(&ring, file);
+    }
+    io_uring_submit(&ring);
+
+    // Wait a little for completions, so that must_stop() is polled and
+    // new requests are made as the consumer frees room.
+    struct io_uring_cqe* cqe;
+    struct __kernel_timespec timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_nsec = 10 * 1000 * 1000;
+    if (io_uring_wait_cqe_timeout(&ring, &cqe, &timeout) < 0) {
+      continue;
+    }
+    while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+      File* done = static_cast<File*>(io_uring_cqe_get_data(cqe));
+      const int res = cqe->res;
+      io_uring_cqe_seen(&ring, cqe);
+      if (res > 0) {
+        done->offset += res;
+        if (done->offset < done->data.size()) {
+          // Short read, ask for the rest.
+          PrepareRead(&ring, done);
+          continue;
+        }
+      }
+      close(done->fd);
+      if (res < 0) {
+        LOG(ERROR) << done->path << ": " << strerror(-res);
+      }
+      Complete(done, res >= 0 && done->offset == done->data.size());
+    }
+  }
+  // io_uring_queue_exit() does not wait for the reads still in flight, and
+  // files_ and their buffers go right after this thread. Cancel the reads
+  // and reap every one of them first. The files being read are the opened
+  // ones not completed yet, each with one read submitted or about to be.
+  vector<File*> reading;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    for (int i = 0; i < pending_.size(); ++i) {
+      if (!pending_[i]->done && pending_[i]->fd >= 0) {
+        reading.push_back(pending_[i]);
+      }
+    }
+  }
+  for (int i = 0; i < reading.size(); ++i) {
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    if (!sqe) {
+      io_uring_submit(&ring);
+      sqe = io_uring_get_sqe(&ring);
+    }
+    CHECK(sqe) << "io_uring submission queue full";
+    io_uring_prep_cancel(sqe, reading[i], 0);
+    // Completions of the cancellations carry no file.
+    io_uring_sqe_set_data(sqe, NULL);
+  }
+  io_uring_submit(&ring);
+  // A read ends cancelled, or completed if it was already running.
+  int reaped = 0;
+  while (reaped < reading.size()) {
+    struct io_uring_cqe* cqe;
+    ret = io_uring_wait_cqe(&ring, &cqe);
+    if (ret == -EINTR) {
+      continue;
+    }
+    CHECK_EQ(ret, 0) << "io_uring_wait_cqe: " << strerror(-ret);
+    reaped += io_uring_cqe_get_data(cqe) != NULL;
+    io_uring_cqe_seen(&ring, cqe);
+  }
+  io_uring_queue_exit(&ring);
+  for (int i = 0; i < reading.size(); ++i) {
+    close(reading[i]->fd);
+  }
+  return true;
+}
+#endif  // USE_IO_URING
+
+}  // namespace caffe
@@ -0,0 +1,89 @@
+#ifndef CAFFE_UTIL_ASYNC_FILE_READER_HPP_
+#define CAFFE_UTIL_ASYNC_FILE_READER_HPP_
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/util/ring_buffer.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Reads whole files ahead of their consumer, many at a time.
+ *
+ * Files come from a source callback and are handed back in the same order,
+ * while up to queue_depth reads are in flight and up to max_bytes are
+ * buffered. Reads go through io_uring when built with USE_IO_URING and the
+ * kernel supports it, through a pool of blocking reader threads otherwise.
+ * File buffers are pooled and keep their capacity from one file to the next.
+ */
+class AsyncFileReader : public InternalThread {
+ public:
+  // Gives the path of the next file to read, and a tag returned with it.
+  typedef boost::function<void(string*, int*)> Source;
+
+  struct File {
+    string path;
+    int tag;
+    // False if the file could not be read.
+    bool ok;
+    vector<char> data;
+    // Reader state.
+    bool done;
+    int fd;
+    size_t offset;
+  };
+
+  AsyncFileReader(const Source& source, int queue_depth, size_t max_bytes,
+      int threads);
+  virtual ~AsyncFileReader();
+
+  // Waits for the next file of the source. Hand it back with Release.
+  File* Next();
+  void Release(File* file);
+
+ protected:
+  virtual void InternalThreadEntry();
+  // Thread pool fallback: the submitter thread only queues the requests.
+  void SubmitToThreads();
+  void ReaderThreadEntry();
+  // Takes a file from the pool and names it, once there is room for it, or
+  // returns NULL right away if there is none and wait is false.
+  File* NewRequest(bool wait);
+  void Complete(File* file, bool ok);
+#ifdef USE_IO_URING
+  // Returns false if io_uring is not available.
+  bool SubmitToUring();
+#endif
+
+  const Source source_;
+  const int queue_depth_;
+  const size_t max_bytes_;
+  const int threads_;
+
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  // Files in source order, being read or waiting for the consumer.
+  std::deque<File*> pending_;
+  vector<File*> pool_;
+  vector<shared_ptr<File> > files_;
+  int in_flight_;
+  // Bytes read ahead: held by files read but not handed out yet.
+  size_t bytes_;
+
+  // Never holds more than the queue_depth_ files in flight.
+  RingQueue<File*> requests_;
+  boost::thread_group readers_;
+
+DISABLE_COPY_AND_ASSIGN(AsyncFileReader);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_ASYNC_FILE_READER_HPP_
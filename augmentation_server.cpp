@@ -0,0 +1,139 @@
+// This program runs the data layer of a net once for several local training
+// processes: the batches it loads and augments are published into a shared
+// memory ring, read by the Data layers with data_param.shm_name set to it.
+// Usage:
+//    augmentation_server [FLAGS] NET_PROTOTXT SHM_NAME
+
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layer_factory.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/shm_batch_ring.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using namespace caffe;  // NOLINT(build/namespaces)
+
+DEFINE_string(layer, "",
+    "Name of the Data layer to run, the first one of the phase by default.");
+DEFINE_string(phase, "TRAIN", "Phase of the layer, TRAIN or TEST.");
+DEFINE_int32(slots, 8,
+    "Batches in the ring, more than the prefetch depth of every reader: 3, "
+    "or max_prefetch_batches with auto_tune.");
+
+static volatile sig_atomic_t stop = 0;
+
+static void HandleSignal(int signal) {
+  stop = 1;
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  // Print output to stderr (while still logging)
+  FLAGS_alsologtostderr = 1;
+
+#ifndef GFLAGS_GFLAGS_H_
+  namespace gflags = google;
+#endif
+
+  gflags::SetUsageMessage("Run a data layer once for several local "
+        "processes, through shared memory\n"
+        "Usage:\n"
+        "    augmentation_server [FLAGS] NET_PROTOTXT SHM_NAME\n"
+        "The readers set data_param.shm_name to SHM_NAME, for instance "
+        "/caffe_train.\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (argc != 3) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0],
+        "tools/augmentation_server");
+    return 1;
+  }
+  CHECK(FLAGS_phase == "TRAIN" || FLAGS_phase == "TEST")
+      << "Unknown phase " << FLAGS_phase;
+  const Phase phase = FLAGS_phase == "TRAIN" ? TRAIN : TEST;
+
+  NetParameter net_param;
+  ReadNetParamsFromTextFileOrDie(argv[1], &net_param);
+  net_param.mutable_state()->set_phase(phase);
+  NetParameter filtered;
+  Net<float>::FilterNet(net_param, &filtered);
+  LayerParameter layer_param;
+  bool found = false;
+  for (int i = 0; i < filtered.layer_size() && !found; ++i) {
+    const LayerParameter& layer = filtered.layer(i);
+    if (layer.type() == "Data" &&
+        (FLAGS_layer.empty() || layer.name() == FLAGS_layer)) {
+      layer_param = layer;
+      found = true;
+    }
+  }
+  CHECK(found) << "No Data layer " << FLAGS_layer << " in " << argv[1]
+      << " for phase " << FLAGS_phase;
+  CHECK(layer_param.data_param().shm_name().empty())
+      << "The layer of the server must read its data itself";
+  // Readers map the ring with the shapes of the first batch.
+  CHECK_EQ(layer_param.data_param().bucket_aspect_ratio_size(), 0)
+      << "bucket_aspect_ratio changes the shape of the batches, it is not "
+      << "supported by augmentation_server";
+  CHECK_EQ(layer_param.transform_param().resize_schedule_size(), 0)
+      << "resize_schedule changes the shape of the batches, it is not "
+      << "supported by augmentation_server";
+  layer_param.set_phase(phase);
+
+  Caffe::set_mode(Caffe::CPU);
+  shared_ptr<Layer<float> > layer =
+      LayerRegistry<float>::CreateLayer(layer_param);
+  vector<Blob<float>*> bottom;
+  vector<shared_ptr<Blob<float> > > top_blobs;
+  vector<Blob<float>*> top;
+  for (int i = 0; i < layer_param.top_size(); ++i) {
+    top_blobs.push_back(shared_ptr<Blob<float> >(new Blob<float>()));
+    top.push_back(top_blobs.back().get());
+  }
+  layer->SetUp(bottom, top);
+  vector<vector<int> > shapes;
+  for (int i = 0; i < top.size(); ++i) {
+    shapes.push_back(top[i]->shape());
+  }
+  ShmBatchRing ring(argv[2], shapes, sizeof(float), FLAGS_slots);
+
+  signal(SIGINT, HandleSignal);
+  signal(SIGTERM, HandleSignal);
+  LOG(INFO) << "Serving " << layer_param.name() << " on " << argv[2];
+  while (!stop) {
+    layer->Forward(bottom, top);
+    // Waits for a reader to attach, and for the slowest one to be done
+    // with the slot.
+    char* slot;
+    while (!stop && (slot = ring.WriteSlot()) == NULL) {
+      usleep(100);
+    }
+    if (stop) {
+      break;
+    }
+    for (int i = 0; i < top.size(); ++i) {
+      CHECK(top[i]->shape() == shapes[i]) << "Top " << i << " of "
+          << layer_param.name() << " changed shape to "
+          << top[i]->shape_string() << ", readers need fixed shapes";
+      memcpy(slot + ring.offset(i), top[i]->cpu_data(),
+          top[i]->count() * sizeof(float));
+    }
+    ring.Publish();
+    LOG_EVERY_N(INFO, 1000) << "Published " << google::COUNTER
+        << " batches";
+  }
+  LOG(INFO) << "Stopping, removing " << argv[2];
+  return 0;
+}
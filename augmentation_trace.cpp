@@ -0,0 +1,99 @@
+#include <boost/static_assert.hpp>
+#include <boost/thread.hpp>
+#include <string.h>
+
+#include <map>
+#include <string>
+
+#include "caffe/util/augmentation_trace.hpp"
+
+namespace caffe {
+
+BOOST_STATIC_ASSERT(sizeof(AugmentationRecord) == 72);
+BOOST_STATIC_ASSERT(sizeof(AugmentationTraceHeader) == 16);
+
+using boost::weak_ptr;
+
+map<const string, weak_ptr<AugmentationTrace> > AugmentationTrace::traces_;
+static boost::mutex traces_mutex_;
+
+shared_ptr<AugmentationTrace> AugmentationTrace::Get(const string& path,
+    int buffer_size) {
+  boost::mutex::scoped_lock lock(traces_mutex_);
+  weak_ptr<AugmentationTrace>& weak = traces_[path];
+  shared_ptr<AugmentationTrace> trace = weak.lock();
+  if (!trace) {
+    trace.reset(new AugmentationTrace(path, buffer_size));
+    weak = trace;
+  }
+  return trace;
+}
+
+AugmentationTrace::AugmentationTrace(const string& path, int buffer_size)
+    : path_(path),
+      file_(fopen(path.c_str(), "wb")),
+      ring_(buffer_size),
+      written_(0) {
+  CHECK(file_) << "Failed to open augmentation trace " << path;
+  dropped_.store(0);
+  AugmentationTraceHeader header;
+  memcpy(header.magic, kAugmentationTraceMagic, sizeof(header.magic));
+  header.version = kAugmentationTraceVersion;
+  header.record_size = sizeof(AugmentationRecord);
+  CHECK_EQ(fwrite(&header, sizeof(header), 1, file_), size_t(1));
+  LOG(INFO) << "Tracing augmentation parameters to " << path;
+  StartInternalThread();
+}
+
+AugmentationTrace::~AugmentationTrace() {
+  StopInternalThread();
+  Flush();
+  fclose(file_);
+  LOG(INFO) << "Augmentation trace " << path_ << ": " << written_
+      << " records written, " << dropped_.load() << " dropped";
+  boost::mutex::scoped_lock lock(traces_mutex_);
+  if (traces_[path_].expired()) {
+    traces_.erase(path_);
+  }
+}
+
+void AugmentationTrace::Push(const AugmentationRecord& record) {
+  if (!ring_.try_push(record)) {
+    dropped_.fetch_add(1, boost::memory_order_relaxed);
+  }
+}
+
+int AugmentationTrace::Flush() {
+  const int kChunk = 256;
+  AugmentationRecord records[kChunk];
+  int total = 0;
+  int count;
+  do {
+    count = 0;
+    while (count < kChunk && ring_.try_pop(&records[count])) {
+      ++count;
+    }
+    if (count > 0) {
+      CHECK_EQ(fwrite(records, sizeof(AugmentationRecord), count, file_),
+          static_cast<size_t>(count))
+          << "Failed to write augmentation trace " << path_;
+      total += count;
+    }
+  } while (count == kChunk);
+  written_ += total;
+  return total;
+}
+
+void AugmentationTrace::InternalThreadEntry() {
+  try {
+    while (!must_stop()) {
+      if (Flush() == 0) {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+      }
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,105 @@
+#ifndef CAFFE_UTIL_AUGMENTATION_TRACE_HPP_
+#define CAFFE_UTIL_AUGMENTATION_TRACE_HPP_
+
+#include <boost/atomic.hpp>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <string>
+
+#include "caffe/common.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/util/ring_buffer.hpp"
+
+namespace caffe {
+
+// Bits of AugmentationRecord::ops, one per augmentation actually applied.
+enum AugmentationOp {
+  AUG_SMOOTH = 1 << 0,
+  AUG_ROTATION = 1 << 1,
+  AUG_BRIGHTNESS = 1 << 2,
+  AUG_COLOR_SHIFT = 1 << 3,
+  AUG_MIN_SIDE_MIN_MAX = 1 << 4,
+  AUG_MIN_SIDE = 1 << 5,
+  AUG_AFFINE = 1 << 6,
+  AUG_RANDOM_ERASING = 1 << 7,
+  AUG_MIRROR = 1 << 8,
+  AUG_HUE = 1 << 9,
+  AUG_SATURATION = 1 << 10,
+  AUG_RESIZED_CROP = 1 << 11
+};
+
+/**
+ * @brief The parameters drawn by DataTransformer for one sample, as written
+ *    to transform_param.trace_file. Fixed size and layout, so that a trace
+ *    is just a header followed by an array of records.
+ */
+struct AugmentationRecord {
+  uint64_t sample;           // index of the input, see set_trace_sample
+  uint32_t ops;              // AugmentationOp bits
+  int16_t angle;             // rotation or affine angle, in degrees
+  uint8_t smooth_type;       // 0 gaussian, 1 blur, 2 median, 3 box
+  uint8_t smooth_kernel;
+  float alpha;               // contrast
+  int16_t beta;              // brightness
+  int16_t color_shift[3];    // signed b, g, r shifts
+  float affine_scale;
+  uint16_t erase[4];         // x, y, width, height of the erased rect
+  uint16_t side_crop[3];     // x, y, side of the min_side crop
+  uint16_t crop[2];          // h_off, w_off of the crop_size crop
+  int16_t hue;               // hue rotation, in degrees
+  float saturation;          // saturation scale
+  uint16_t resized_crop[4];  // x, y, width, height of the resized crop
+  uint8_t crop_index;        // test_crops: which crop of the image this is,
+  uint8_t crops;             // out of crops (0 when there is a single one)
+  uint8_t reserved[6];
+};
+
+struct AugmentationTraceHeader {
+  char magic[8];             // kAugmentationTraceMagic
+  uint32_t version;
+  uint32_t record_size;      // sizeof(AugmentationRecord)
+};
+
+static const char kAugmentationTraceMagic[8] =
+    {'C', 'A', 'F', 'F', 'E', 'A', 'U', 'G'};
+static const uint32_t kAugmentationTraceVersion = 3;
+
+/**
+ * @brief Writes AugmentationRecords to a file from a background thread.
+ *
+ * Transform threads push records into a lock-free ring buffer and never
+ * wait: if the writer falls behind and the ring is full the record is
+ * dropped and counted, so tracing cannot stall the data pipeline. A single
+ * trace is shared by all the transformers writing to the same file.
+ */
+class AugmentationTrace : public InternalThread {
+ public:
+  static shared_ptr<AugmentationTrace> Get(const string& path,
+      int buffer_size);
+  virtual ~AugmentationTrace();
+
+  // Queues the record for writing.
+  void Push(const AugmentationRecord& record);
+
+ protected:
+  AugmentationTrace(const string& path, int buffer_size);
+  virtual void InternalThreadEntry();
+  // Writes out everything currently in the ring, returns the record count.
+  int Flush();
+
+  const string path_;
+  FILE* file_;
+  RingBuffer<AugmentationRecord> ring_;
+  boost::atomic<uint64_t> dropped_;
+  uint64_t written_;
+
+  static map<const string, boost::weak_ptr<AugmentationTrace> > traces_;
+
+DISABLE_COPY_AND_ASSIGN(AugmentationTrace);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_AUGMENTATION_TRACE_HPP_
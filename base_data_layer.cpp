@@ -0,0 +1,380 @@
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/data_transformer.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layers/base_data_layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/blocking_queue.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+BaseDataLayer<Dtype>::BaseDataLayer(const LayerParameter& param)
+    : Layer<Dtype>(param),
+      transform_param_(param.transform_param()) {
+}
+
+template <typename Dtype>
+void BaseDataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  if (top.size() == 1) {
+    output_labels_ = false;
+  } else {
+    output_labels_ = true;
+  }
+  data_transformer_.reset(
+      new DataTransformer<Dtype>(transform_param_, this->phase_));
+  data_transformer_->InitRand();
+  // The subclasses should setup the size of bottom and top
+  DataLayerSetUp(bottom, top);
+}
+
+template <typename Dtype>
+BasePrefetchingDataLayer<Dtype>::BasePrefetchingDataLayer(
+    const LayerParameter& param)
+    : BaseDataLayer<Dtype>(param),
+      prefetch_free_(), prefetch_full_(),
+      prefetch_retire_(0),
+      wait_time_(0),
+      forward_count_(0),
+      load_time_(0),
+      load_count_(0),
+      batches_loaded_(0) {
+  for (int i = 0; i < PREFETCH_COUNT; ++i) {
+    prefetch_free_.push(&prefetch_[i]);
+  }
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::LayerSetUp(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  BaseDataLayer<Dtype>::LayerSetUp(bottom, top);
+  // The blobs have been reshaped to their largest batch by DataLayerSetUp,
+  // their memory is now allocated for good.
+  if (this->layer_param_.data_param().huge_page_batches()) {
+    for (int i = 0; i < PREFETCH_COUNT; ++i) {
+      Batch<Dtype>& batch = prefetch_[i];
+      use_huge_pages(&batch.data_, batch.data_.data()->size(),
+          &batch.data_buffer_);
+      if (this->output_labels_) {
+        use_huge_pages(&batch.label_, batch.label_.data()->size(),
+            &batch.label_buffer_);
+      }
+    }
+    LOG_IF(WARNING, !prefetch_[0].data_buffer_->reserved())
+        << "Not enough reserved huge pages (vm.nr_hugepages) for the batches "
+        << "of " << this->layer_param_.name() << ", using transparent ones";
+  }
+  // Before starting the prefetch thread, we make cpu_data and gpu_data
+  // calls so that the prefetch thread does not accidentally make simultaneous
+  // cudaMalloc calls when the main thread is running. In some GPUs this
+  // seems to cause failures if we do not so.
+  for (int i = 0; i < PREFETCH_COUNT; ++i) {
+    prefetch_[i].data_.mutable_cpu_data();
+    if (this->output_labels_) {
+      prefetch_[i].label_.mutable_cpu_data();
+    }
+    for (int j = 0; j < prefetch_[i].extra_.size(); ++j) {
+      prefetch_[i].extra_[j]->mutable_cpu_data();
+    }
+  }
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    for (int i = 0; i < PREFETCH_COUNT; ++i) {
+      prefetch_[i].data_.mutable_gpu_data();
+      if (this->output_labels_) {
+        prefetch_[i].label_.mutable_gpu_data();
+      }
+      for (int j = 0; j < prefetch_[i].extra_.size(); ++j) {
+        prefetch_[i].extra_[j]->mutable_gpu_data();
+      }
+    }
+  }
+#endif
+  DLOG(INFO) << "Initializing prefetch";
+  this->data_transformer_->InitRand();
+  if (this->layer_param_.data_param().auto_tune()) {
+    LOG(INFO) << "Auto-tuning " << this->layer_param_.name()
+        << ": transform threads " << transform_threads() << " (max "
+        << this->layer_param_.data_param().max_transform_threads()
+        << "), prefetch depth " << PREFETCH_COUNT << " (max "
+        << this->layer_param_.data_param().max_prefetch_batches() << ")";
+  }
+  tune_timer_.Start();
+  stats_timer_.Start();
+  StartInternalThread();
+  DLOG(INFO) << "Prefetch initialized.";
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::InternalThreadEntry() {
+#ifndef CPU_ONLY
+  cudaStream_t stream;
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+  }
+#endif
+
+  CPUTimer timer;
+  Batch<Dtype>* batch = NULL;
+  try {
+    while (!must_stop()) {
+      batch = prefetch_free_.pop();
+      timer.Start();
+      load_batch(batch);
+      ++batches_loaded_;
+#ifndef CPU_ONLY
+      if (Caffe::mode() == Caffe::GPU) {
+        batch->data_.data().get()->async_gpu_push(stream);
+        CUDA_CHECK(cudaStreamSynchronize(stream));
+      }
+#endif
+      {
+        boost::mutex::scoped_lock lock(load_mutex_);
+        load_time_ += timer.MicroSeconds();
+        ++load_count_;
+      }
+      prefetch_full_.push(batch);
+      batch = NULL;
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown, or when the thread is
+    // stopped to be started again: the batch being loaded is free again.
+    if (batch) {
+      prefetch_free_.push(batch);
+    }
+  }
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaStreamDestroy(stream));
+  }
+#endif
+}
+
+template <typename Dtype>
+Batch<Dtype>* BasePrefetchingDataLayer<Dtype>::next_batch() {
+  const int ready = prefetch_full_.size();
+  CPUTimer timer;
+  timer.Start();
+  Batch<Dtype>* batch = prefetch_full_.pop("Data layer prefetch queue empty");
+  const double waited = timer.MicroSeconds();
+  wait_time_ += waited;
+
+  PrefetchStats* stats[2] = {&prefetch_stats_, &interval_stats_};
+  const double wall_time = stats_timer_.MicroSeconds();
+  stats_timer_.Start();
+  for (int i = 0; i < 2; ++i) {
+    ++stats[i]->forwards;
+    stats[i]->starved += ready == 0;
+    stats[i]->occupancy += ready;
+    stats[i]->wait_time += waited;
+    stats[i]->max_wait = std::max(stats[i]->max_wait, waited);
+    stats[i]->last_wait = waited;
+    stats[i]->wall_time += wall_time;
+  }
+  const int interval =
+      this->layer_param_.data_param().prefetch_stats_interval();
+  if (interval > 0 && interval_stats_.forwards >= interval) {
+    const PrefetchStats& s = interval_stats_;
+    LOG(INFO) << "Prefetch " << this->layer_param_.name() << ": starved "
+        << 100 * s.starved_fraction() << "% of " << s.wall_time / 1e6
+        << " s, " << s.starved << " of " << s.forwards
+        << " forward passes waited (mean wait "
+        << s.wait_time / std::max<int64_t>(s.starved, 1) / 1000
+        << " ms, max " << s.max_wait / 1000 << " ms), "
+        << static_cast<double>(s.occupancy) / s.forwards
+        << " batches ready on average";
+    interval_stats_ = PrefetchStats();
+  }
+  return batch;
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::recycle_batch(Batch<Dtype>* batch) {
+  const DataParameter& param = this->layer_param_.data_param();
+  if (param.auto_tune() &&
+      ++forward_count_ >= static_cast<int>(param.auto_tune_interval())) {
+    auto_tune(batch);
+  }
+  if (prefetch_retire_ > 0) {
+    for (int i = 0; i < prefetch_extra_.size(); ++i) {
+      if (prefetch_extra_[i].get() == batch) {
+        prefetch_extra_.erase(prefetch_extra_.begin() + i);
+        --prefetch_retire_;
+        return;
+      }
+    }
+  }
+  prefetch_free_.push(batch);
+  batch_recycled();
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::use_huge_pages(Blob<Dtype>* blob,
+    size_t bytes, shared_ptr<HugePageBuffer>* buffer) {
+  const vector<int> shape = blob->shape();
+  buffer->reset(new HugePageBuffer(bytes));
+  // set_cpu_data expects as many bytes as the blob has items: make it as
+  // large as the buffer, then reshaping back keeps all of the buffer.
+  blob->Reshape(vector<int>(1, (*buffer)->size() / sizeof(Dtype)));
+  blob->set_cpu_data(static_cast<Dtype*>((*buffer)->data()));
+  blob->Reshape(shape);
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::reshape_batch(Batch<Dtype>* batch,
+    const vector<int>& shape) {
+  if (batch->data_.shape() == shape) {
+    return;
+  }
+  const shared_ptr<SyncedMemory> memory = batch->data_.data();
+  batch->data_.Reshape(shape);
+  if (batch->data_buffer_ && batch->data_.data() != memory) {
+    LOG(WARNING) << "Batch of " << this->layer_param_.name()
+        << " larger than at set up, reallocating its huge pages";
+    use_huge_pages(&batch->data_, batch->data_.count() * sizeof(Dtype),
+        &batch->data_buffer_);
+  }
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::auto_tune(Batch<Dtype>* batch) {
+  const DataParameter& param = this->layer_param_.data_param();
+  const double elapsed = tune_timer_.MicroSeconds();
+  double load_time;
+  int load_count;
+  {
+    boost::mutex::scoped_lock lock(load_mutex_);
+    load_time = load_time_;
+    load_count = load_count_;
+    load_time_ = 0;
+    load_count_ = 0;
+  }
+  // Time per batch of the net and of the prefetch thread, and the share of
+  // the time the net spent waiting for data.
+  const double period = elapsed / forward_count_;
+  const double load = load_count > 0 ? load_time / load_count : 0;
+  const double waited = elapsed > 0 ? wait_time_ / elapsed : 0;
+  wait_time_ = 0;
+  forward_count_ = 0;
+
+  const int threads = transform_threads();
+  const int max_threads = param.max_transform_threads();
+  const int max_depth = param.max_prefetch_batches();
+  const int depth = PREFETCH_COUNT + prefetch_extra_.size() - prefetch_retire_;
+  std::ostringstream decision;
+  if (waited > 0.05) {
+    // The net is starved: transform faster, or buffer more when at the
+    // thread limit (loading time varies with the augmentations drawn).
+    if (threads < max_threads &&
+        set_transform_threads(threads + 1)) {
+      decision << "transform threads " << threads << " -> " << threads + 1;
+    } else if (depth < max_depth) {
+      if (prefetch_retire_ > 0) {
+        --prefetch_retire_;
+      } else {
+        shared_ptr<Batch<Dtype> > extra(new Batch<Dtype>());
+        // As large as the memory of the batch, sized for the largest crops
+        // of the resize_schedule at set up, so that it is not reallocated
+        // on the prefetch thread when the schedule grows the crops.
+        extra->data_.Reshape(
+            vector<int>(1, batch->data_.data()->size() / sizeof(Dtype)));
+        extra->data_.ReshapeLike(batch->data_);
+        if (batch->data_buffer_) {
+          use_huge_pages(&extra->data_, batch->data_buffer_->size(),
+              &extra->data_buffer_);
+        }
+        extra->data_.mutable_cpu_data();
+        if (this->output_labels_) {
+          extra->label_.ReshapeLike(batch->label_);
+          if (batch->label_buffer_) {
+            use_huge_pages(&extra->label_, batch->label_buffer_->size(),
+                &extra->label_buffer_);
+          }
+          extra->label_.mutable_cpu_data();
+        }
+        for (int i = 0; i < batch->extra_.size(); ++i) {
+          extra->extra_.push_back(shared_ptr<Blob<Dtype> >(
+              new Blob<Dtype>(batch->extra_[i]->shape())));
+          extra->extra_[i]->mutable_cpu_data();
+        }
+#ifndef CPU_ONLY
+        // Allocated from the main thread, see LayerSetUp.
+        if (Caffe::mode() == Caffe::GPU) {
+          extra->data_.mutable_gpu_data();
+          if (this->output_labels_) {
+            extra->label_.mutable_gpu_data();
+          }
+          for (int i = 0; i < extra->extra_.size(); ++i) {
+            extra->extra_[i]->mutable_gpu_data();
+          }
+        }
+#endif
+        prefetch_extra_.push_back(extra);
+        prefetch_free_.push(extra.get());
+      }
+      decision << "prefetch depth " << depth << " -> " << depth + 1;
+    }
+  } else if (waited < 0.01 && load < 0.5 * period) {
+    // Well ahead of the net: give back memory first, then threads as long
+    // as one less would still keep up.
+    if (depth > PREFETCH_COUNT) {
+      ++prefetch_retire_;
+      decision << "prefetch depth " << depth << " -> " << depth - 1;
+    } else if (threads > 1 && load * threads / (threads - 1) < 0.8 * period &&
+        set_transform_threads(threads - 1)) {
+      decision << "transform threads " << threads << " -> " << threads - 1;
+    }
+  }
+  if (decision.str().empty()) {
+    DLOG(INFO) << "Auto-tune " << this->layer_param_.name() << ": waited "
+        << 100 * waited << "%, load " << load / 1000 << " ms, forward "
+        << period / 1000 << " ms per batch, unchanged";
+  } else {
+    LOG(INFO) << "Auto-tune " << this->layer_param_.name() << ": waited "
+        << 100 * waited << "%, load " << load / 1000 << " ms, forward "
+        << period / 1000 << " ms per batch, " << decision.str();
+  }
+  tune_timer_.Start();
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::Forward_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  Batch<Dtype>* batch = next_batch();
+  // Reshape to loaded data.
+  top[0]->ReshapeLike(batch->data_);
+  // Copy the data
+  caffe_copy(batch->data_.count(), batch->data_.cpu_data(),
+             top[0]->mutable_cpu_data());
+  DLOG(INFO) << "Prefetch copied";
+  if (this->output_labels_) {
+    // Reshape to loaded labels.
+    top[1]->ReshapeLike(batch->label_);
+    // Copy the labels.
+    caffe_copy(batch->label_.count(), batch->label_.cpu_data(),
+        top[1]->mutable_cpu_data());
+  }
+  for (int i = 0; i < batch->extra_.size(); ++i) {
+    top[i + 2]->ReshapeLike(*batch->extra_[i]);
+    caffe_copy(batch->extra_[i]->count(), batch->extra_[i]->cpu_data(),
+        top[i + 2]->mutable_cpu_data());
+  }
+
+  recycle_batch(batch);
+}
+
+#ifdef CPU_ONLY
+STUB_GPU_FORWARD(BasePrefetchingDataLayer, Forward);
+#endif
+
+INSTANTIATE_CLASS(BaseDataLayer);
+INSTANTIATE_CLASS(BasePrefetchingDataLayer);
+
+}  // namespace caffe
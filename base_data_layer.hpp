@@ -0,0 +1,171 @@
+#ifndef CAFFE_DATA_LAYERS_HPP_
+#define CAFFE_DATA_LAYERS_HPP_
+
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/data_transformer.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/huge_page_buffer.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Provides base for data layers that feed blobs to the Net.
+ *
+ * TODO(dox): thorough documentation for Forward and proto params.
+ */
+template <typename Dtype>
+class BaseDataLayer : public Layer<Dtype> {
+ public:
+  explicit BaseDataLayer(const LayerParameter& param);
+  // LayerSetUp: implements common data layer setup functionality, and calls
+  // DataLayerSetUp to do special data layer setup for individual layer types.
+  // This method may not be overridden except by the BasePrefetchingDataLayer.
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  // Data layers should be shared by multiple solvers in parallel
+  virtual inline bool ShareInParallel() const { return true; }
+  virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {}
+  // Data layers have no bottoms, so reshaping is trivial.
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {}
+
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {}
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {}
+
+ protected:
+  TransformationParameter transform_param_;
+  shared_ptr<DataTransformer<Dtype> > data_transformer_;
+  bool output_labels_;
+};
+
+template <typename Dtype>
+class Batch {
+ public:
+  Blob<Dtype> data_, label_;
+  // Outputs beyond data and label, copied to top[2], top[3]... by Forward.
+  // Layers producing them add the blobs in DataLayerSetUp.
+  vector<shared_ptr<Blob<Dtype> > > extra_;
+  // Memory of data_ and label_ with data_param.huge_page_batches.
+  shared_ptr<HugePageBuffer> data_buffer_, label_buffer_;
+};
+
+/**
+ * @brief Consumer side counters of the prefetch queue: how long Forward
+ *    waited for loaded batches, and how many were ready when it came for
+ *    one. Times are in microseconds.
+ */
+struct PrefetchStats {
+  PrefetchStats()
+      : forwards(0), starved(0), occupancy(0), wait_time(0), max_wait(0),
+        last_wait(0), wall_time(0) {}
+  // Forward passes, and those which found no batch ready.
+  int64_t forwards;
+  int64_t starved;
+  // Sum over the forward passes of the batches ready.
+  int64_t occupancy;
+  // Waits for a batch: total, longest, and of the last forward pass.
+  double wait_time;
+  double max_wait;
+  double last_wait;
+  // Wall time the counters cover.
+  double wall_time;
+
+  inline double starved_fraction() const {
+    return wall_time > 0 ? wait_time / wall_time : 0;
+  }
+};
+
+template <typename Dtype>
+class BasePrefetchingDataLayer :
+    public BaseDataLayer<Dtype>, public InternalThread {
+ public:
+  explicit BasePrefetchingDataLayer(const LayerParameter& param);
+  // LayerSetUp: implements common data layer setup functionality, and calls
+  // DataLayerSetUp to do special data layer setup for individual layer types.
+  // This method may not be overridden.
+  void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  // Prefetches batches (asynchronously if to GPU memory)
+  static const int PREFETCH_COUNT = 3;
+
+  // Since the layer was set up, wall_time up to the last forward pass.
+  inline const PrefetchStats& prefetch_stats() const {
+    return prefetch_stats_;
+  }
+
+ protected:
+  virtual void InternalThreadEntry();
+  virtual void load_batch(Batch<Dtype>* batch) = 0;
+  // Number of threads used by load_batch, for layers which can change it.
+  virtual int transform_threads() const { return 1; }
+  virtual bool set_transform_threads(int threads) { return false; }
+
+  // Pops the next loaded batch, timing the wait for data_param.auto_tune.
+  Batch<Dtype>* next_batch();
+  // Hands a consumed batch back to the prefetch thread, or frees it if
+  // auto_tune is shrinking the prefetch depth.
+  void recycle_batch(Batch<Dtype>* batch);
+  // Called by recycle_batch once a batch is back in prefetch_free_, for
+  // prefetch threads which do not wait for one by popping it.
+  virtual void batch_recycled() {}
+  // Adjusts the prefetch depth and the transform threads, see auto_tune in
+  // DataParameter. Runs on the main thread, batch is the one just consumed.
+  void auto_tune(Batch<Dtype>* batch);
+  // Moves the data of blob to a new huge page buffer of at least bytes,
+  // see data_param.huge_page_batches.
+  void use_huge_pages(Blob<Dtype>* blob, size_t bytes,
+      shared_ptr<HugePageBuffer>* buffer);
+  // Reshapes the data of a batch in load_batch: nothing to do when the
+  // shape is unchanged, and a batch outgrowing its huge page buffer gets
+  // a larger one.
+  void reshape_batch(Batch<Dtype>* batch, const vector<int>& shape);
+
+  Batch<Dtype> prefetch_[PREFETCH_COUNT];
+  BlockingQueue<Batch<Dtype>*> prefetch_free_;
+  BlockingQueue<Batch<Dtype>*> prefetch_full_;
+
+  // Batches added by auto_tune on top of prefetch_, and how many of them
+  // are to be freed when they next come back from the net.
+  vector<shared_ptr<Batch<Dtype> > > prefetch_extra_;
+  int prefetch_retire_;
+  // auto_tune measurements since the last decision, in microseconds.
+  CPUTimer tune_timer_;
+  double wait_time_;
+  int forward_count_;
+  // Prefetch queue counters since set up, and since the last summary of
+  // data_param.prefetch_stats_interval forward passes.
+  PrefetchStats prefetch_stats_;
+  PrefetchStats interval_stats_;
+  CPUTimer stats_timer_;
+  // Written by the prefetch thread.
+  boost::mutex load_mutex_;
+  double load_time_;
+  int load_count_;
+  // Batches loaded since set up, only used by the prefetch thread. The
+  // resize_schedule of transform_param is indexed by it.
+  int64_t batches_loaded_;
+
+  Blob<Dtype> transformed_data_;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_DATA_LAYERS_HPP_
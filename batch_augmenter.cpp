@@ -0,0 +1,340 @@
+#ifdef USE_OPENCV
+#include <google/protobuf/text_format.h>
+#include <opencv2/core/core.hpp>
+#include <stdint.h>
+
+#include <fstream>  // NOLINT(readability/streams)
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/data_transformer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/batch_augmenter.hpp"
+
+namespace caffe {
+
+// Seed of the image at index of a batch, splitmix64 of both, so that
+// neighbouring images and seeds get unrelated sequences.
+static unsigned int image_seed(uint64_t seed, int index) {
+  uint64_t z = seed + (static_cast<uint64_t>(index) + 1) *
+      0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return static_cast<unsigned int>(z ^ (z >> 31));
+}
+
+// Copies the items of blob to dst, NCHW or NHWC, rounding to uint8.
+template <typename T>
+static void pack_items(const Blob<float>& blob, bool nhwc, T* dst) {
+  const int channels = blob.channels();
+  const int height = blob.height();
+  const int width = blob.width();
+  const float* src = blob.cpu_data();
+  for (int n = 0; n < blob.num(); ++n) {
+    T* item = dst + static_cast<size_t>(n) * channels * height * width;
+    for (int c = 0; c < channels; ++c) {
+      for (int h = 0; h < height; ++h) {
+        for (int w = 0; w < width; ++w) {
+          const int i = nhwc ? (h * width + w) * channels + c :
+              (c * height + h) * width + w;
+          item[i] = cv::saturate_cast<T>(*src++);
+        }
+      }
+    }
+  }
+}
+
+BatchAugmenter::BatchAugmenter(const TransformationParameter& param,
+    const caffe_augment_options& options)
+    : options_(options),
+      batch_(NULL),
+      count_(0),
+      seed_(0),
+      output_(NULL),
+      stop_(false),
+      next_(0),
+      remaining_(0),
+      busy_(0) {
+  string error;
+  CHECK(Validate(param, options_, &error)) << error;
+  TransformationParameter transform_param(param);
+  if (options_.uint8_output) {
+    // Left to the caller, see caffe_augment_options.
+    transform_param.set_scale(1);
+    transform_param.clear_mean_value();
+  }
+  height_ = width_ = param.crop_size();
+  const Phase phase = options_.train ? TRAIN : TEST;
+  resized_crop_ = phase == TRAIN && param.resized_crop_min_area() > 0;
+  min_side_ = phase == TRAIN ? param.min_side() : 0;
+  const bool direct =
+      options_.layout == CAFFE_AUGMENT_NCHW && !options_.uint8_output;
+  for (int i = 0; i < options_.threads; ++i) {
+    transformers_.push_back(shared_ptr<DataTransformer<float> >(
+        new DataTransformer<float>(transform_param, phase)));
+    items_ = transformers_[i]->crops_per_image();
+    blobs_.push_back(shared_ptr<Blob<float> >(
+        new Blob<float>(items_, options_.channels, height_, width_)));
+    // NCHW float items are written straight to the output.
+    if (!direct) {
+      blobs_[i]->mutable_cpu_data();
+    }
+  }
+  mean_channels_ = mean_height_ = mean_width_ = 0;
+  if (param.has_mean_file()) {
+    const Blob<float>& mean = transformers_[0]->data_mean();
+    mean_channels_ = mean.channels();
+    mean_height_ = mean.height();
+    mean_width_ = mean.width();
+  }
+  images_.resize(options_.threads);
+  for (int i = 0; i < options_.threads; ++i) {
+    workers_.create_thread(
+        boost::bind(&BatchAugmenter::WorkerEntry, this, i));
+  }
+}
+
+BatchAugmenter::~BatchAugmenter() {
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stop_ = true;
+  }
+  work_cond_.notify_all();
+  workers_.join_all();
+}
+
+bool BatchAugmenter::Validate(const TransformationParameter& param,
+    const caffe_augment_options& options, string* error) {
+  std::ostringstream reason;
+  const int means = param.mean_value_size();
+  if (param.crop_size() <= 0) {
+    reason << "BatchAugmenter needs crop_size";
+  } else if (options.channels <= 0 || options.threads <= 0) {
+    reason << "channels and threads must be positive";
+  } else if (options.layout != CAFFE_AUGMENT_NCHW &&
+      options.layout != CAFFE_AUGMENT_NHWC) {
+    reason << "Unknown layout " << options.layout;
+  } else if (param.mixup_alpha() > 0 || param.cutmix_alpha() > 0) {
+    reason << "BatchAugmenter does not support mixup_alpha nor cutmix_alpha";
+  } else if (param.has_mean_file() && options.uint8_output) {
+    reason << "uint8_output needs mean_value instead of mean_file";
+  } else if (param.has_mean_file() && means > 0) {
+    reason << "Cannot specify mean_file and mean_value at the same time";
+  } else if (param.has_mean_file() &&
+      !std::ifstream(param.mean_file().c_str()).good()) {
+    reason << "Cannot open mean_file " << param.mean_file();
+  } else if (means > 1 && means != options.channels) {
+    reason << "Specify either 1 mean_value or as many as channels: "
+        << options.channels;
+  } else if (param.test_crops() > 1 && param.test_crops() != 2 &&
+      param.test_crops() != 5 && param.test_crops() != 10) {
+    reason << "test_crops must be 1, 2, 5 or 10";
+  } else if (param.min_side() &&
+      (param.min_side_min() || param.min_side_max())) {
+    reason << "Cannot specify min_side and min_side_min & min_side_max at "
+        << "the same time";
+  } else if (param.min_side_max() < param.min_side_min()) {
+    reason << "min_side_max must be greater than (or equals to) "
+        << "min_side_min";
+  }
+  *error = reason.str();
+  return error->empty();
+}
+
+bool BatchAugmenter::ValidateBatch(const caffe_augment_image* images,
+    int count, const void* output, string* error) const {
+  std::ostringstream reason;
+  if (count < 0) {
+    reason << "Negative image count " << count;
+  } else if (count > 0 && (!images || !output)) {
+    reason << "No images or no output";
+  }
+  for (int i = 0; reason.str().empty() && i < count; ++i) {
+    const caffe_augment_image& image = images[i];
+    if (!image.data) {
+      reason << "Image " << i << " has no data";
+    } else if (image.channels != options_.channels) {
+      reason << "Image " << i << " has " << image.channels
+          << " channels instead of " << options_.channels;
+    } else if (image.height <= 0 || image.width <= 0) {
+      reason << "Image " << i << " is empty";
+    } else if (image.stride <
+        static_cast<size_t>(image.width) * image.channels) {
+      reason << "Image " << i << " has rows of " << image.stride
+          << " bytes, shorter than its width";
+    } else if (!resized_crop_ &&
+        (image.height < height_ || image.width < width_)) {
+      reason << "Image " << i << " is " << image.height << "x"
+          << image.width << ", smaller than crop_size " << height_;
+    } else if (min_side_ &&
+        (image.height < min_side_ || image.width < min_side_)) {
+      reason << "Image " << i << " is " << image.height << "x"
+          << image.width << ", smaller than min_side " << min_side_;
+    } else if (mean_channels_ &&
+        (mean_channels_ != image.channels ||
+        mean_height_ != (resized_crop_ ? height_ : image.height) ||
+        mean_width_ != (resized_crop_ ? width_ : image.width))) {
+      reason << "The mean_file is " << mean_channels_ << "x" << mean_height_
+          << "x" << mean_width_ << ", image " << i << " reaches the crop at "
+          << image.channels << "x"
+          << (resized_crop_ ? height_ : image.height) << "x"
+          << (resized_crop_ ? width_ : image.width);
+    }
+  }
+  *error = reason.str();
+  return error->empty();
+}
+
+void BatchAugmenter::Run(const caffe_augment_image* images, int count,
+    uint64_t seed, void* output) {
+  string error;
+  CHECK(ValidateBatch(images, count, output, &error)) << error;
+  boost::mutex::scoped_lock lock(mutex_);
+  batch_ = images;
+  count_ = count;
+  seed_ = seed;
+  output_ = output;
+  remaining_ = count;
+  next_ = 0;
+  work_cond_.notify_all();
+  // Also waits for the threads which found nothing left, the next batch
+  // is not set while one of them may still read this one.
+  while (remaining_ > 0 || busy_ > 0) {
+    done_cond_.wait(lock);
+  }
+}
+
+void BatchAugmenter::WorkerEntry(int worker) {
+  while (true) {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (!stop_ && next_ >= count_) {
+        work_cond_.wait(lock);
+      }
+      if (stop_) {
+        return;
+      }
+      ++busy_;
+    }
+    int done = 0;
+    for (int i = next_++; i < count_; i = next_++) {
+      Augment(worker, i);
+      ++done;
+    }
+    boost::mutex::scoped_lock lock(mutex_);
+    --busy_;
+    remaining_ -= done;
+    if (!remaining_ && !busy_) {
+      done_cond_.notify_all();
+    }
+  }
+}
+
+void BatchAugmenter::Augment(int worker, int index) {
+  const caffe_augment_image& image = batch_[index];
+  DataTransformer<float>* transformer = transformers_[worker].get();
+  Blob<float>* blob = blobs_[worker].get();
+  transformer->SeedRand(image_seed(seed_, index));
+  transformer->set_trace_sample(index);
+  cv::Mat cv_img(image.height, image.width, CV_8UC(image.channels),
+      const_cast<uint8_t*>(image.data), image.stride);
+  const int ops = transformer->DrawAugmentations();
+  if (ops) {
+    // Augmentations work in place, on a copy of the image of the caller,
+    // in a buffer kept from one image to the next.
+    cv_img.copyTo(images_[worker]);
+    cv_img = images_[worker];
+    transformer->CVMatTransform(cv_img, ops);
+  }
+  const size_t offset = index * image_count();
+  const bool nhwc = options_.layout == CAFFE_AUGMENT_NHWC;
+  const bool direct = !nhwc && !options_.uint8_output;
+  if (direct) {
+    blob->set_cpu_data(static_cast<float*>(output_) + offset);
+  }
+  if (items_ > 1) {
+    transformer->MultiCropMatToBlob(cv_img, blob);
+  } else {
+    transformer->MatToBlob(cv_img, blob);
+  }
+  if (options_.uint8_output) {
+    pack_items(*blob, nhwc, static_cast<uint8_t*>(output_) + offset);
+  } else if (!direct) {
+    pack_items(*blob, nhwc, static_cast<float*>(output_) + offset);
+  }
+}
+
+}  // namespace caffe
+
+struct caffe_augmenter {
+  caffe_augmenter(const caffe::TransformationParameter& param,
+      const caffe_augment_options& options)
+      : augmenter(param, options) {}
+  caffe::BatchAugmenter augmenter;
+};
+
+void caffe_augment_default_options(caffe_augment_options* options) {
+  options->train = 1;
+  options->channels = 3;
+  options->threads = 1;
+  options->layout = CAFFE_AUGMENT_NCHW;
+  options->uint8_output = 0;
+}
+
+caffe_augmenter* caffe_augmenter_create(const char* transform_param,
+    const caffe_augment_options* options) {
+  caffe::TransformationParameter param;
+  if (!google::protobuf::TextFormat::ParseFromString(
+      transform_param ? transform_param : "", &param)) {
+    LOG(ERROR) << "Could not parse transform_param: "
+        << (transform_param ? transform_param : "");
+    return NULL;
+  }
+  caffe_augment_options defaults;
+  if (!options) {
+    caffe_augment_default_options(&defaults);
+    options = &defaults;
+  }
+  std::string error;
+  if (!caffe::BatchAugmenter::Validate(param, *options, &error)) {
+    LOG(ERROR) << error;
+    return NULL;
+  }
+  return new caffe_augmenter(param, *options);
+}
+
+void caffe_augmenter_destroy(caffe_augmenter* augmenter) {
+  delete augmenter;
+}
+
+void caffe_augmenter_output_shape(const caffe_augmenter* augmenter,
+    int* items, int* channels, int* height, int* width) {
+  if (!augmenter) {
+    LOG(ERROR) << "No augmenter";
+    *items = *channels = *height = *width = 0;
+    return;
+  }
+  *items = augmenter->augmenter.items();
+  *channels = augmenter->augmenter.channels();
+  *height = augmenter->augmenter.height();
+  *width = augmenter->augmenter.width();
+}
+
+int caffe_augmenter_run(caffe_augmenter* augmenter,
+    const caffe_augment_image* images, int count, uint64_t seed,
+    void* output) {
+  if (!augmenter) {
+    LOG(ERROR) << "No augmenter";
+    return -1;
+  }
+  std::string error;
+  if (!augmenter->augmenter.ValidateBatch(images, count, output, &error)) {
+    LOG(ERROR) << error;
+    return -1;
+  }
+  augmenter->augmenter.Run(images, count, seed, output);
+  return 0;
+}
+#endif  // USE_OPENCV
@@ -0,0 +1,112 @@
+#ifndef CAFFE_UTIL_BATCH_AUGMENTER_HPP_
+#define CAFFE_UTIL_BATCH_AUGMENTER_HPP_
+
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <stdint.h>
+#ifdef USE_OPENCV
+#include <opencv2/core/core.hpp>
+#endif  // USE_OPENCV
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/batch_augmenter_c.h"
+
+#ifdef USE_OPENCV
+namespace caffe {
+
+template <typename Dtype> class Blob;
+template <typename Dtype> class DataTransformer;
+class TransformationParameter;
+
+/**
+ * @brief The augmentations of DataTransformer on batches of 8 bit images
+ *    in memory, into caller buffers, outside of the layers.
+ *
+ * Every thread of the pool has its transformer, configured once from the
+ * TransformationParameter, and its buffers: running a batch allocates no
+ * protobuf message nor Blob. Images are handed out to the threads one at
+ * a time, and the random generators are reseeded from the seed of the call
+ * and the index of the image before each of them, so results do not depend
+ * on the number of threads. crop_size must be set, so that every image
+ * gives the same output shape. Batch-level augmentations (mixup_alpha,
+ * cutmix_alpha) are not supported.
+ */
+class BatchAugmenter {
+ public:
+  // param and options must be valid, see Validate.
+  BatchAugmenter(const TransformationParameter& param,
+      const caffe_augment_options& options);
+  ~BatchAugmenter();
+
+  // Whether an augmenter can be made of param and options, with the reason
+  // in error if not, so that the C interface rejects them instead of
+  // aborting its caller.
+  static bool Validate(const TransformationParameter& param,
+      const caffe_augment_options& options, string* error);
+  // Whether Run can take the images and output, see Validate.
+  bool ValidateBatch(const caffe_augment_image* images, int count,
+      const void* output, string* error) const;
+
+  // Output of an image: items() items of channels() x height() x width().
+  inline int items() const { return items_; }
+  inline int channels() const { return options_.channels; }
+  inline int height() const { return height_; }
+  inline int width() const { return width_; }
+  inline size_t image_count() const {
+    return static_cast<size_t>(items_) * options_.channels * height_ *
+        width_;
+  }
+
+  // Augments count images into output, count * image_count() values of
+  // float, or uint8_t with options.uint8_output. The batch must be valid,
+  // see ValidateBatch. Not reentrant.
+  void Run(const caffe_augment_image* images, int count, uint64_t seed,
+      void* output);
+
+ protected:
+  void WorkerEntry(int worker);
+  void Augment(int worker, int index);
+
+  const caffe_augment_options options_;
+  int items_;
+  int height_;
+  int width_;
+  // What ValidateBatch holds the images to: the size they reach the crop
+  // at is theirs, unless every image gets a resized_crop, and min_side
+  // crops them in TRAIN phase. The mean_file, if any, must be that size
+  // (0 x 0 x 0 without).
+  bool resized_crop_;
+  int min_side_;
+  int mean_channels_;
+  int mean_height_;
+  int mean_width_;
+  // Per thread.
+  vector<shared_ptr<DataTransformer<float> > > transformers_;
+  vector<shared_ptr<Blob<float> > > blobs_;
+  vector<cv::Mat> images_;
+
+  boost::thread_group workers_;
+  boost::mutex mutex_;
+  boost::condition_variable work_cond_;
+  boost::condition_variable done_cond_;
+  // The batch being run, set under mutex_.
+  const caffe_augment_image* batch_;
+  int count_;
+  uint64_t seed_;
+  void* output_;
+  bool stop_;
+  // Next image to hand out, images not done, and threads working.
+  boost::atomic<int> next_;
+  int remaining_;
+  int busy_;
+
+DISABLE_COPY_AND_ASSIGN(BatchAugmenter);
+};
+
+}  // namespace caffe
+#endif  // USE_OPENCV
+
+#endif  // CAFFE_UTIL_BATCH_AUGMENTER_HPP_
@@ -0,0 +1,82 @@
+#ifndef CAFFE_UTIL_BATCH_AUGMENTER_C_H_
+#define CAFFE_UTIL_BATCH_AUGMENTER_C_H_
+
+/*
+ * C interface of BatchAugmenter (see batch_augmenter.hpp): the
+ * augmentations of transform_param, on 8 bit images in memory, for programs
+ * outside of Caffe. Nothing of Caffe nor protobuf is needed to include it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct caffe_augmenter caffe_augmenter;
+
+/* An 8 bit image, rows of width * channels interleaved (BGR) bytes, row i
+ * at data + i * stride. */
+typedef struct caffe_augment_image {
+  const uint8_t* data;
+  size_t stride;
+  int height;
+  int width;
+  int channels;
+} caffe_augment_image;
+
+enum {
+  CAFFE_AUGMENT_NCHW = 0,
+  CAFFE_AUGMENT_NHWC = 1
+};
+
+typedef struct caffe_augment_options {
+  /* TRAIN phase if non zero, where the random augmentations are drawn. */
+  int train;
+  /* Channels of the input images and of the output. */
+  int channels;
+  /* Threads of the augmenter, they are started once at creation. */
+  int threads;
+  /* CAFFE_AUGMENT_NCHW or CAFFE_AUGMENT_NHWC. */
+  int layout;
+  /* uint8 output, the augmented pixels before mean_value and scale, which
+   * are left to the caller; float otherwise. */
+  int uint8_output;
+} caffe_augment_options;
+
+/* train 1, channels 3, threads 1, NCHW float output. */
+void caffe_augment_default_options(caffe_augment_options* options);
+
+/* transform_param is a TransformationParameter in protobuf text format,
+ * e.g. "crop_size: 224 mirror: true max_rotation_angle: 10". crop_size is
+ * required. Returns NULL, with the reason logged as an error, if it cannot
+ * be parsed or is not supported with options (mixup_alpha, cutmix_alpha,
+ * mean_file with uint8_output...), or if options are invalid. */
+caffe_augmenter* caffe_augmenter_create(const char* transform_param,
+    const caffe_augment_options* options);
+void caffe_augmenter_destroy(caffe_augmenter* augmenter);
+
+/* Output of an image: items (test_crops in TEST phase, 1 otherwise) of
+ * channels x height x width values. All 0 if augmenter is NULL. */
+void caffe_augmenter_output_shape(const caffe_augmenter* augmenter,
+    int* items, int* channels, int* height, int* width);
+
+/* Augments count images into output, which holds count times the values
+ * of caffe_augmenter_output_shape, of float or uint8_t. What an image gets
+ * only depends on seed and its index, not on the threads. One call at a
+ * time per augmenter. Returns 0, or -1 without writing anything, with the
+ * reason logged as an error, if an image is invalid (no data, channels
+ * other than those of the options, empty, stride shorter than a row,
+ * smaller than crop_size without resized_crop_min_area or than min_side
+ * in TRAIN, or not the size of the mean_file) or an argument is
+ * missing. */
+int caffe_augmenter_run(caffe_augmenter* augmenter,
+    const caffe_augment_image* images, int count, uint64_t seed,
+    void* output);
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* CAFFE_UTIL_BATCH_AUGMENTER_C_H_ */
@@ -1,117 +1,1204 @@
 #ifdef USE_OPENCV
 #include <opencv2/core/core.hpp>
 #endif  // USE_OPENCV
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include <stdint.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <vector>
 
 #include "caffe/data_transformer.hpp"
 #include "caffe/layers/data_layer.hpp"
 #include "caffe/util/benchmark.hpp"
+#include "caffe/util/math_functions.hpp"
 
 namespace caffe {
 
+// data_param.resumable: seed of number index of the stream, splitmix64 of
+// both so that neighbouring items get unrelated sequences.
+static unsigned int stream_seed(uint64_t seed, int64_t index) {
+  uint64_t z = seed + (static_cast<uint64_t>(index) + 1) *
+      0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return static_cast<unsigned int>(z ^ (z >> 31));
+}
+
 template <typename Dtype>
 DataLayer<Dtype>::DataLayer(const LayerParameter& param)
   : BasePrefetchingDataLayer<Dtype>(param),
-    reader_(param) {
+    reader_(param.data_param().shm_name().empty() ?
+        new DataReader(param) : NULL),
+    output_group_index_(false),
+    transform_threads_(param.data_param().transform_threads()),
+    next_item_(0),
+    helpers_generation_(0),
+    helpers_threads_(1),
+    helpers_busy_(0),
+    helpers_batch_(NULL),
+    summary_batches_(0),
+    summary_items_(0),
+    summary_fast_items_(0),
+    restored_batches_(0),
+    restored_forwards_(0),
+    shm_forwarded_(NULL),
+    buffered_(0),
+    arrivals_(0),
+    cache_enabled_(param.phase() == TEST && param.data_param().test_cache() &&
+        param.data_param().shm_name().empty()),
+    cache_item_count_(0),
+    cache_first_position_(0),
+    cache_wrapped_(false),
+    cache_failed_(false),
+    cache_ready_(false),
+    cache_position_(0),
+    cache_start_(0),
+    cache_scale_(1) {
+  if (cache_enabled_ && param.data_param().test_cache_uint8()) {
+    // The transformers are left with pixel values, see normalize_pixels.
+    cache_scale_ = this->transform_param_.scale();
+    for (int c = 0; c < this->transform_param_.mean_value_size(); ++c) {
+      cache_mean_values_.push_back(this->transform_param_.mean_value(c));
+    }
+    this->transform_param_.set_scale(1);
+    this->transform_param_.clear_mean_value();
+  }
 }
 
 template <typename Dtype>
 DataLayer<Dtype>::~DataLayer() {
   this->StopInternalThread();
+  // The look-ahead records belong to the reader.
+  for (int i = 0; i < buckets_.size(); ++i) {
+    for (int j = 0; j < buckets_[i].size(); ++j) {
+      reader_->free().push(buckets_[i][j].second);
+    }
+  }
 }
 
 template <typename Dtype>
 void DataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+  if (!this->layer_param_.data_param().shm_name().empty()) {
+    // The batches come made from augmentation_server, in its shapes.
+    const string& name = this->layer_param_.data_param().shm_name();
+    CHECK(!resumable()) << "resumable does not support shm_name";
+    shm_ring_.reset(new ShmBatchRing(name));
+    // Every batch loaded and not yet forwarded past holds its slot, and the
+    // server needs one more slot to write the next batch.
+    const DataParameter& data_param = this->layer_param_.data_param();
+    int batches = this->PREFETCH_COUNT;
+    if (data_param.auto_tune() &&
+        static_cast<int>(data_param.max_prefetch_batches()) > batches) {
+      batches = data_param.max_prefetch_batches();
+    }
+    CHECK_GT(shm_ring_->slots(), batches) << name << " has "
+        << shm_ring_->slots() << " slots, the layer holds up to " << batches
+        << " batches: run augmentation_server with --slots=" << batches + 1
+        << " or more";
+    CHECK_EQ(shm_ring_->elem_size(), static_cast<int>(sizeof(Dtype)))
+        << name << " does not hold " << sizeof(Dtype) << " bytes elements";
+    const int num_tops = top.size();
+    CHECK_LE(num_tops, shm_ring_->num_blobs())
+        << name << " has only " << shm_ring_->num_blobs() << " blobs";
+    for (int i = 0; i < num_tops; ++i) {
+      top[i]->Reshape(shm_ring_->shape(i));
+    }
+    for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
+      this->prefetch_[i].data_.Reshape(shm_ring_->shape(0));
+      if (this->output_labels_) {
+        this->prefetch_[i].label_.Reshape(shm_ring_->shape(1));
+      }
+      for (int j = 2; j < num_tops; ++j) {
+        this->prefetch_[i].extra_.push_back(
+            shared_ptr<Blob<Dtype> >(new Blob<Dtype>(shm_ring_->shape(j))));
+      }
+    }
+    LOG(INFO) << "output data size: " << top[0]->shape_string()
+        << ", from " << name;
+    return;
+  }
   const int batch_size = this->layer_param_.data_param().batch_size();
+  // Every datum fills views_per_sample * test_crops consecutive items.
+  const int views = this->layer_param_.data_param().views_per_sample();
+  const int crops = this->data_transformer_->crops_per_image();
+  CHECK_GT(views, 0) << "views_per_sample must be positive";
+  const DataParameter& data_param = this->layer_param_.data_param();
+  CHECK_GT(data_param.transform_threads(), 0)
+      << "transform_threads must be positive";
+  if (data_param.auto_tune()) {
+    CHECK_LE(data_param.transform_threads(),
+        data_param.max_transform_threads())
+        << "transform_threads must not exceed max_transform_threads";
+  }
+  if (data_param.bucket_aspect_ratio_size()) {
+    // Buckets of the crop_size * crop_size area in every aspect ratio.
+    const TransformationParameter& transform_param =
+        this->layer_param_.transform_param();
+    const int crop_size = transform_param.crop_size();
+    CHECK_GT(crop_size, 0) << "bucket_aspect_ratio needs crop_size";
+    CHECK(!transform_param.has_mean_file())
+        << "bucket_aspect_ratio needs mean_value instead of mean_file";
+    CHECK_EQ(crops, 1) << "bucket_aspect_ratio does not support test_crops";
+    CHECK_EQ(transform_param.resize_schedule_size(), 0)
+        << "bucket_aspect_ratio does not support resize_schedule";
+    CHECK_EQ(transform_param.resized_crop_min_area(), 0)
+        << "bucket_aspect_ratio does not support resized_crop";
+    for (int i = 0; i < data_param.bucket_aspect_ratio_size(); ++i) {
+      const float ratio = data_param.bucket_aspect_ratio(i);
+      CHECK_GT(ratio, 0) << "bucket_aspect_ratio must be positive";
+      const int height = std::max<int>(1, round(crop_size / sqrt(ratio)));
+      const int width = std::max<int>(1, round(crop_size * sqrt(ratio)));
+      bucket_shapes_.push_back(std::make_pair(height, width));
+      LOG(INFO) << "Aspect ratio bucket " << i << ": " << height << "x"
+          << width;
+    }
+    buckets_.resize(bucket_shapes_.size());
+    LOG(INFO) << "Bucket look-ahead: "
+        << DataReader::bucket_lookahead(data_param) << " records";
+  }
+  if (cache_enabled_) {
+    // Passes must be identical, item for item.
+    CHECK(!this->transform_param_.mirror())
+        << "test_cache needs a deterministic transform, without mirror";
+    CHECK(!this->data_transformer_->mixes_batch())
+        << "test_cache does not support MixUp/CutMix";
+    CHECK_EQ(data_param.num_shards(), 1)
+        << "test_cache needs the whole DB read in order";
+    CHECK_EQ(data_param.shuffle_buffer(), 0)
+        << "test_cache needs the whole DB read in order";
+    CHECK(buckets_.empty())
+        << "test_cache does not support bucket_aspect_ratio";
+    CHECK(!data_param.test_cache_uint8() ||
+        !this->transform_param_.has_mean_file())
+        << "test_cache_uint8 needs mean_value instead of mean_file";
+    LOG(INFO) << "Caching the transformed items, "
+        << data_param.test_cache_mb() << " MB in memory"
+        << (data_param.test_cache_spill().empty() ? "" : ", then spilled to ")
+        << data_param.test_cache_spill();
+  }
+  if (data_param.steal_across_batches()) {
+    // Items must not depend on the batch they are loaded for.
+    CHECK(buckets_.empty())
+        << "steal_across_batches does not support bucket_aspect_ratio";
+    CHECK(!cache_enabled_)
+        << "steal_across_batches does not support test_cache";
+    LOG(INFO) << "Scheduling the items of up to " << data_param.prefetch()
+        << " batches over the transform threads";
+  }
+  if (data_param.resumable()) {
+    // Items must only depend on their place in the stream of records.
+    CHECK(buckets_.empty())
+        << "resumable does not support bucket_aspect_ratio";
+    CHECK(!cache_enabled_) << "resumable does not support test_cache";
+    CHECK(!data_param.steal_across_batches())
+        << "resumable does not support steal_across_batches";
+    CHECK_EQ(Caffe::solver_count(), 1) << "resumable needs a single solver";
+  }
+  // Start at the first step of the resize_schedule, if it starts at 0.
+  this->data_transformer_->SetResizeProgress(0, batch_size);
   // Read a data point, and use it to initialize the top blob.
-  Datum& datum = *(reader_.full().peek());
+  DatumRecord& record = *(reader_->full().peek());
+  if (!buckets_.empty()) {
+    const std::pair<int, int>& shape = bucket_shapes_[nearest_bucket(record)];
+    this->data_transformer_->set_bucket(shape.first, shape.second);
+  }
 
   // Use data_transformer to infer the expected blob shape from datum.
-  vector<int> top_shape = this->data_transformer_->InferBlobShape(datum);
+  vector<int> top_shape = this->data_transformer_->InferBlobShape(
+      record.datum(), record.data(), record.data_size());
+  top_shape[0] = crops;
   this->transformed_data_.Reshape(top_shape);
   // Reshape top[0] and prefetch_data according to the batch_size.
-  top_shape[0] = batch_size;
+  top_shape[0] = batch_size * views * crops;
   top[0]->Reshape(top_shape);
+  // Blobs keep their memory when they shrink: sized for the largest crops of
+  // the resize_schedule, the batches are not reallocated when it grows them.
+  vector<int> max_shape = top_shape;
+  const int max_crop = this->data_transformer_->max_crop_size();
+  if (max_crop * max_crop > top_shape[2] * top_shape[3]) {
+    max_shape[2] = max_crop;
+    max_shape[3] = max_crop;
+  }
   for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
+    this->prefetch_[i].data_.Reshape(max_shape);
     this->prefetch_[i].data_.Reshape(top_shape);
   }
   LOG(INFO) << "output data size: " << top[0]->num() << ","
       << top[0]->channels() << "," << top[0]->height() << ","
       << top[0]->width();
   // label
+  vector<int> label_shape(1, batch_size * views * crops);
   if (this->output_labels_) {
-    vector<int> label_shape(1, batch_size);
     top[1]->Reshape(label_shape);
     for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
       this->prefetch_[i].label_.Reshape(label_shape);
     }
   }
+  // mixed labels of MixUp/CutMix, then group index
+  const int num_tops = top.size();
+  int next_top = 2;
+  if (this->data_transformer_->mixes_batch()) {
+    CHECK(this->output_labels_) << "MixUp/CutMix need the label top";
+    CHECK_GT(num_tops, next_top) << "MixUp/CutMix need a mixed label top";
+    vector<int> mix_shape = this->data_transformer_->InferMixLabelShape(
+        batch_size * views * crops);
+    top[next_top++]->Reshape(mix_shape);
+    for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
+      this->prefetch_[i].extra_.push_back(
+          shared_ptr<Blob<Dtype> >(new Blob<Dtype>(mix_shape)));
+    }
+  }
+  output_group_index_ = num_tops > next_top;
+  if (output_group_index_) {
+    top[next_top]->Reshape(label_shape);
+    for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
+      this->prefetch_[i].extra_.push_back(
+          shared_ptr<Blob<Dtype> >(new Blob<Dtype>(label_shape)));
+    }
+  }
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::SavePipelineState(DataPipelineState* state) const {
+  CHECK(resumable()) << this->layer_param_.name() << " is not resumable";
+  // The net got a batch per forward pass.
+  const int64_t batches = restored_batches_ +
+      this->prefetch_stats_.forwards - restored_forwards_;
+  reader_->GetState(batches * this->layer_param_.data_param().batch_size(),
+      state);
+  state->set_layer(this->layer_param_.name());
+  state->set_batches(batches);
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::RestorePipelineState(const DataPipelineState& state) {
+  CHECK(resumable()) << this->layer_param_.name() << " is not resumable";
+  CHECK_EQ(state.sequence(),
+      state.batches() * this->layer_param_.data_param().batch_size())
+      << "State of " << state.layer() << " saved with another batch_size";
+  this->StopInternalThread();
+  // The batches loaded ahead are dropped, and their records were given back
+  // to the reader.
+  Batch<Dtype>* batch;
+  while (this->prefetch_full_.try_pop(&batch)) {
+    this->prefetch_free_.push(batch);
+  }
+  reader_->Restore(state);
+  this->batches_loaded_ = state.batches();
+  restored_batches_ = state.batches();
+  restored_forwards_ = this->prefetch_stats_.forwards;
+  this->StartInternalThread();
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::batch_recycled() {
+  if (this->layer_param_.data_param().steal_across_batches()) {
+    // Under the lock, so that steal_batches is either before its try_pop
+    // or already waiting.
+    boost::mutex::scoped_lock lock(steal_mutex_);
+    publish_cond_.notify_one();
+  }
+}
+
+template <typename Dtype>
+bool DataLayer<Dtype>::set_transform_threads(int threads) {
+  boost::mutex::scoped_lock lock(steal_mutex_);
+  transform_threads_ = threads;
+  // steal_across_batches: threads waiting for their turn may go.
+  work_cond_.notify_all();
+  return true;
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::InternalThreadEntry() {
+  if (shm_ring_) {
+    BasePrefetchingDataLayer<Dtype>::InternalThreadEntry();
+  } else if (this->layer_param_.data_param().steal_across_batches()) {
+    steal_batches();
+  } else {
+    start_helpers();
+    BasePrefetchingDataLayer<Dtype>::InternalThreadEntry();
+    stop_helpers();
+  }
+}
+
+template <typename Dtype>
+typename DataLayer<Dtype>::ThreadSettings
+DataLayer<Dtype>::thread_settings() {
+  ThreadSettings settings;
+  settings.device = 0;
+#ifndef CPU_ONLY
+  CUDA_CHECK(cudaGetDevice(&settings.device));
+#endif
+  settings.mode = Caffe::mode();
+  settings.rand_seed = caffe_rng_rand();
+  settings.solver_count = Caffe::solver_count();
+  settings.root_solver = Caffe::root_solver();
+  return settings;
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::apply_thread_settings(const ThreadSettings& settings) {
+  // Creates the Caffe of the thread, with its cuBLAS and cuRAND handles,
+  // once for as long as the thread runs.
+#ifndef CPU_ONLY
+  Caffe::SetDevice(settings.device);
+#endif
+  Caffe::set_mode(settings.mode);
+  Caffe::set_random_seed(settings.rand_seed);
+  Caffe::set_solver_count(settings.solver_count);
+  Caffe::set_root_solver(settings.root_solver);
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::start_helpers() {
+  const DataParameter& data_param = this->layer_param_.data_param();
+  // Threads auto_tune may add wait for the batches that need them.
+  const int threads = std::min<int>(data_param.batch_size(),
+      data_param.auto_tune() ? std::max<int>(
+      data_param.max_transform_threads(), transform_threads_) :
+      transform_threads_);
+  helpers_generation_ = 0;
+  helpers_busy_ = 0;
+  for (int i = 1; i < threads; ++i) {
+    helpers_.push_back(shared_ptr<boost::thread>(new boost::thread(
+        boost::bind(&DataLayer<Dtype>::helper_items, this, i,
+        thread_settings()))));
+  }
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::stop_helpers() {
+  // The helpers may be blocked on the reader.
+  for (int i = 0; i < helpers_.size(); ++i) {
+    helpers_[i]->interrupt();
+  }
+  for (int i = 0; i < helpers_.size(); ++i) {
+    helpers_[i]->join();
+  }
+  helpers_.clear();
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::helper_items(int worker, ThreadSettings settings) {
+  apply_thread_settings(settings);
+  int64_t generation = 0;
+  try {
+    while (true) {
+      Batch<Dtype>* batch;
+      {
+        boost::mutex::scoped_lock lock(helpers_mutex_);
+        while (helpers_generation_ == generation) {
+          helpers_cond_.wait(lock);
+        }
+        generation = helpers_generation_;
+        if (worker >= helpers_threads_) {
+          // Not needed for this batch.
+          continue;
+        }
+        batch = helpers_batch_;
+      }
+      load_items(batch, worker, &helpers_stats_[worker]);
+      boost::mutex::scoped_lock lock(helpers_mutex_);
+      if (--helpers_busy_ == 0) {
+        helpers_done_cond_.notify_one();
+      }
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
+// Items are loaded by a pool of transform_threads threads, which take them
+// one at a time from the oldest batch in flight having some left. Once all
+// the items of the newest batch are taken, the next free batch is opened so
+// that threads done early carry on with it while the slow items finish:
+// the batch is as slow as the mean of its items rather than the slowest.
+// Batches are published in the order they were opened.
+template <typename Dtype>
+void DataLayer<Dtype>::steal_batches() {
+#ifndef CPU_ONLY
+  cudaStream_t stream;
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+  }
+#endif
+  const DataParameter& data_param = this->layer_param_.data_param();
+  const int batch_size = data_param.batch_size();
+  const int crops = this->data_transformer_->crops_per_image();
+  // The reader holds records for that many batches.
+  const int max_in_flight = std::max<int>(data_param.prefetch(), 1);
+  // Threads auto_tune may add wait for their turn, see claim_item.
+  const int threads = data_param.auto_tune() ? std::max<int>(
+      data_param.max_transform_threads(), transform_threads_) :
+      transform_threads_;
+  while (static_cast<int>(transformers_.size()) < threads) {
+    transformers_.push_back(shared_ptr<DataTransformer<Dtype> >(
+        new DataTransformer<Dtype>(this->transform_param_, this->phase_)));
+    transformers_.back()->InitRand();
+    transformed_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+  }
+  vector<int> item_shape;
+  // Batch to open, once its turn comes.
+  Batch<Dtype>* next = NULL;
+  CPUTimer publish_timer;
+  publish_timer.Start();
+  // Completion of the items of the batches since the last summary: the
+  // standard deviations of their times, the spans of the batches, and the
+  // items taken while an older batch was loading.
+  int batches = 0;
+  double spread_sum = 0;
+  double spread_max = 0;
+  double span_sum = 0;
+  int stolen = 0;
+  int64_t items = 0;
+  int64_t fast_items = 0;
+  boost::thread_group workers;
+  try {
+    for (int i = 1; i <= threads; ++i) {
+      workers.create_thread(boost::bind(&DataLayer<Dtype>::steal_items, this,
+          i, thread_settings()));
+    }
+    while (!this->must_stop()) {
+      // A new step of the resize_schedule changes the shape of the items,
+      // the batches in flight are loaded first.
+      const bool reshape = item_shape.empty() ||
+          this->data_transformer_->ResizeStepAt(this->batches_loaded_,
+          batch_size) != this->data_transformer_->resize_step();
+      shared_ptr<InFlight> loaded;
+      {
+        boost::mutex::scoped_lock lock(steal_mutex_);
+        if (!in_flight_.empty() && in_flight_.front()->done == batch_size) {
+          loaded = in_flight_.front();
+          in_flight_.pop_front();
+        }
+        const bool open = in_flight_.empty() || (!reshape &&
+            static_cast<int>(in_flight_.size()) < max_in_flight &&
+            in_flight_.back()->next == batch_size);
+        if (!loaded && !(open &&
+            (next || this->prefetch_free_.try_pop(&next)))) {
+          // Woken by the last item of a batch, or by batch_recycled.
+          publish_cond_.wait(lock);
+          continue;
+        }
+      }
+      if (loaded) {
+        Batch<Dtype>* batch = loaded->batch;
+        if (this->data_transformer_->mixes_batch()) {
+          this->data_transformer_->MixBatch(&batch->data_,
+              batch->label_.cpu_data(), batch->extra_[0].get());
+        }
+        const double n = batch_size;
+        const double mean = loaded->completion_sum / n;
+        const double spread = sqrt(std::max(
+            loaded->completion_sumsq / n - mean * mean, 0.));
+        const double span = loaded->timer.MicroSeconds();
+        DLOG(INFO) << "Prefetch batch: " << span / 1000 << " ms, items done "
+            << "after " << mean / 1000 << " ms on average (std "
+            << spread / 1000 << " ms, last " << loaded->completion_max / 1000
+            << " ms), " << loaded->stolen << " taken early, read time "
+            << loaded->stats.read_time / 1000 << " ms, transform time "
+            << loaded->stats.trans_time / 1000 << " ms.";
+        ++batches;
+        spread_sum += spread;
+        spread_max = std::max(spread_max, spread);
+        span_sum += span;
+        stolen += loaded->stolen;
+        items += loaded->stats.items;
+        fast_items += loaded->stats.fast_items;
+        const int interval = data_param.prefetch_stats_interval();
+        if (interval > 0 && batches >= interval) {
+          LOG(INFO) << "Item scheduling " << this->layer_param_.name() << ": "
+              << batches << " batches loaded in " << span_sum / batches / 1000
+              << " ms on average, std of the completion times of their items "
+              << spread_sum / batches / 1000 << " ms on average (max "
+              << spread_max / 1000 << " ms), " << 100. * stolen /
+              (static_cast<double>(batches) * batch_size)
+              << "% of the items taken while an older batch was loading, "
+              << 100. * fast_items / std::max<int64_t>(items, 1)
+              << "% packed straight from the DB bytes";
+          batches = 0;
+          spread_sum = 0;
+          spread_max = 0;
+          span_sum = 0;
+          stolen = 0;
+          items = 0;
+          fast_items = 0;
+        }
+#ifndef CPU_ONLY
+        if (Caffe::mode() == Caffe::GPU) {
+          batch->data_.data().get()->async_gpu_push(stream);
+          CUDA_CHECK(cudaStreamSynchronize(stream));
+        }
+#endif
+        {
+          // For auto_tune: batches overlap, what a batch costs is at most
+          // the time since the previous one.
+          boost::mutex::scoped_lock lock(this->load_mutex_);
+          this->load_time_ += std::min(span, publish_timer.MicroSeconds());
+          ++this->load_count_;
+        }
+        publish_timer.Start();
+        this->prefetch_full_.push(batch);
+        continue;
+      }
+      if (reshape) {
+        // Nothing in flight: the transformers and their blobs can move on.
+        if (this->data_transformer_->SetResizeProgress(this->batches_loaded_,
+            batch_size)) {
+          LOG(INFO) << this->layer_param_.name() << ": resize_schedule step "
+              << this->data_transformer_->resize_step() << " from batch "
+              << this->batches_loaded_;
+        }
+        // The reader has no other consumer either.
+        DatumRecord& record = *(reader_->full().peek());
+        item_shape = this->data_transformer_->InferBlobShape(
+            record.datum(), record.data(), record.data_size());
+        item_shape[0] = crops;
+        this->transformed_data_.Reshape(item_shape);
+        for (int i = 0; i < transformers_.size(); ++i) {
+          transformers_[i]->SetResizeProgress(this->batches_loaded_,
+              batch_size);
+          transformed_[i]->Reshape(item_shape);
+        }
+      }
+      open_batch(next, item_shape);
+      next = NULL;
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+  workers.interrupt_all();
+  workers.join_all();
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaStreamDestroy(stream));
+  }
+#endif
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::open_batch(Batch<Dtype>* batch,
+    const vector<int>& item_shape) {
+  const DataParameter& data_param = this->layer_param_.data_param();
+  vector<int> top_shape = item_shape;
+  top_shape[0] =
+      data_param.batch_size() * data_param.views_per_sample() * item_shape[0];
+  this->reshape_batch(batch, top_shape);
+  // Allocate on this thread, the transform threads then only write to it.
+  batch->data_.mutable_cpu_data();
+  if (this->output_labels_) {
+    batch->label_.mutable_cpu_data();
+  }
+  if (output_group_index_) {
+    batch->extra_.back()->mutable_cpu_data();
+  }
+  shared_ptr<InFlight> flight(new InFlight());
+  flight->batch = batch;
+  flight->timer.Start();
+  ++this->batches_loaded_;
+  boost::mutex::scoped_lock lock(steal_mutex_);
+  in_flight_.push_back(flight);
+  work_cond_.notify_all();
+}
+
+template <typename Dtype>
+bool DataLayer<Dtype>::claim_item(int worker, shared_ptr<InFlight>* flight,
+    int* item_id) {
+  // Threads beyond transform_threads wait until auto_tune adds them.
+  if (worker > transform_threads_) {
+    return false;
+  }
+  const int batch_size = this->layer_param_.data_param().batch_size();
+  bool older_loading = false;
+  for (int i = 0; i < in_flight_.size(); ++i) {
+    InFlight* f = in_flight_[i].get();
+    if (f->next < batch_size) {
+      *flight = in_flight_[i];
+      *item_id = f->next++;
+      f->stolen += older_loading;
+      if (f->next == batch_size && i + 1 == in_flight_.size()) {
+        // All taken, time to open the next batch.
+        publish_cond_.notify_one();
+      }
+      return true;
+    }
+    older_loading = older_loading || f->done < batch_size;
+  }
+  return false;
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::steal_items(int worker, ThreadSettings settings) {
+  apply_thread_settings(settings);
+  const int batch_size = this->layer_param_.data_param().batch_size();
+  // Records go back to the reader when moving on to another batch or
+  // running out of items, so that it never runs out of free ones.
+  vector<DatumRecord*> done;
+  Batch<Dtype>* done_batch = NULL;
+  try {
+    while (true) {
+      shared_ptr<InFlight> flight;
+      int item_id;
+      bool claimed;
+      {
+        boost::mutex::scoped_lock lock(steal_mutex_);
+        claimed = claim_item(worker, &flight, &item_id);
+      }
+      if (!done.empty() && (!claimed || flight->batch != done_batch)) {
+        reader_->free().push(&done[0], done.size());
+        done.clear();
+      }
+      if (!claimed) {
+        boost::mutex::scoped_lock lock(steal_mutex_);
+        while (!claim_item(worker, &flight, &item_id)) {
+          work_cond_.wait(lock);
+        }
+      }
+      done_batch = flight->batch;
+      LoadStats stats;
+      load_item(flight->batch, item_id, worker, &stats, &done);
+      boost::mutex::scoped_lock lock(steal_mutex_);
+      const double completion = flight->timer.MicroSeconds();
+      flight->completion_sum += completion;
+      flight->completion_sumsq += completion * completion;
+      flight->completion_max = std::max(flight->completion_max, completion);
+      flight->stats.read_time += stats.read_time;
+      flight->stats.trans_time += stats.trans_time;
+      flight->stats.items += stats.items;
+      flight->stats.fast_items += stats.fast_items;
+      if (++flight->done == batch_size) {
+        publish_cond_.notify_one();
+      }
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+  if (!done.empty()) {
+    reader_->free().push(&done[0], done.size());
+  }
 }
 
 // This function is called on prefetch thread
 template<typename Dtype>
 void DataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
+  if (shm_ring_) {
+    load_shm_batch(batch);
+    return;
+  }
   CPUTimer batch_timer;
   batch_timer.Start();
-  double read_time = 0;
-  double trans_time = 0;
-  CPUTimer timer;
   CHECK(batch->data_.count());
   CHECK(this->transformed_data_.count());
 
   // Reshape according to the first datum of each batch
   // on single input batches allows for inputs of varying dimension.
   const int batch_size = this->layer_param_.data_param().batch_size();
-  Datum& datum = *(reader_.full().peek());
-  // Use data_transformer to infer the expected blob shape from datum.
-  vector<int> top_shape = this->data_transformer_->InferBlobShape(datum);
+  const int views = this->layer_param_.data_param().views_per_sample();
+  const int crops = this->data_transformer_->crops_per_image();
+  // Without the helpers (load_batch called off the prefetch thread), the
+  // items are all loaded on this thread.
+  const int threads = std::min<int>(std::min<int>(transform_threads_,
+      batch_size), helpers_.size() + 1);
+  // With buckets the batch takes the shape of its bucket.
+  int bucket = -1;
+  if (!buckets_.empty()) {
+    bucket = fill_bucket_batch();
+    const std::pair<int, int>& shape = bucket_shapes_[bucket];
+    this->data_transformer_->set_bucket(shape.first, shape.second);
+  }
+  // The resize_schedule moves on between batches only.
+  if (this->data_transformer_->SetResizeProgress(this->batches_loaded_,
+      batch_size)) {
+    LOG(INFO) << this->layer_param_.name() << ": resize_schedule step "
+        << this->data_transformer_->resize_step() << " from batch "
+        << this->batches_loaded_;
+  }
+  // Once cached, nothing is read any more.
+  vector<int> top_shape = cache_shape_;
+  if (!cache_ready_) {
+    DatumRecord& record = bucket < 0 ?
+        *(reader_->full().peek()) : *batch_records_[0];
+    // Use data_transformer to infer the expected blob shape from datum.
+    top_shape = this->data_transformer_->InferBlobShape(
+        record.datum(), record.data(), record.data_size());
+    top_shape[0] = crops;
+  }
   this->transformed_data_.Reshape(top_shape);
+  if (cache_enabled_ && !test_cache_ && !cache_failed_) {
+    // Entries: the label, then the items of a datum.
+    cache_shape_ = top_shape;
+    cache_item_count_ = views * this->transformed_data_.count();
+    const DataParameter& data_param = this->layer_param_.data_param();
+    const size_t value_bytes =
+        data_param.test_cache_uint8() ? sizeof(uint8_t) : sizeof(Dtype);
+    const size_t entry_bytes = (sizeof(double) +
+        cache_item_count_ * value_bytes + 7) / 8 * 8;
+    test_cache_.reset(new TransformedCache(entry_bytes,
+        static_cast<size_t>(data_param.test_cache_mb()) << 20,
+        data_param.test_cache_spill()));
+  } else if (test_cache_ && !cache_ready_ && top_shape != cache_shape_) {
+    LOG(WARNING) << "Not caching " << this->layer_param_.name()
+        << ": the shape of its items changed";
+    cache_failed_ = true;
+  }
+  cache_start_ = cache_position_;
+  while (static_cast<int>(transformers_.size()) + 1 < threads) {
+    transformers_.push_back(shared_ptr<DataTransformer<Dtype> >(
+        new DataTransformer<Dtype>(this->transform_param_, this->phase_)));
+    transformers_.back()->InitRand();
+    transformed_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+  }
+  for (int i = 0; i + 1 < threads; ++i) {
+    transformed_[i]->Reshape(top_shape);
+    transformers_[i]->SetResizeProgress(this->batches_loaded_, batch_size);
+    if (bucket >= 0) {
+      transformers_[i]->set_bucket(bucket_shapes_[bucket].first,
+          bucket_shapes_[bucket].second);
+    }
+  }
   // Reshape batch according to the batch_size.
-  top_shape[0] = batch_size;
-  batch->data_.Reshape(top_shape);
+  top_shape[0] = batch_size * views * crops;
+  this->reshape_batch(batch, top_shape);
+  // Allocate on this thread, the helpers then only write to the data.
+  batch->data_.mutable_cpu_data();
+  if (this->output_labels_) {
+    batch->label_.mutable_cpu_data();
+  }
+  if (output_group_index_) {
+    batch->extra_.back()->mutable_cpu_data();
+  }
+
+  // The helpers are all idle between batches.
+  helpers_stats_.assign(threads, LoadStats());
+  next_item_ = 0;
+  if (threads > 1) {
+    boost::mutex::scoped_lock lock(helpers_mutex_);
+    helpers_batch_ = batch;
+    helpers_threads_ = threads;
+    helpers_busy_ = threads - 1;
+    ++helpers_generation_;
+    helpers_cond_.notify_all();
+  }
+  load_items(batch, 0, &helpers_stats_[0]);
+  {
+    // When interrupted, the helpers are taken down with this thread, see
+    // InternalThreadEntry.
+    boost::mutex::scoped_lock lock(helpers_mutex_);
+    while (helpers_busy_ > 0) {
+      helpers_done_cond_.wait(lock);
+    }
+  }
+  // Batch-level augmentations, still on the prefetch thread.
+  if (this->data_transformer_->mixes_batch()) {
+    const DataParameter& data_param = this->layer_param_.data_param();
+    if (data_param.resumable()) {
+      this->data_transformer_->SeedRand(stream_seed(data_param.shuffle_seed(),
+          2 * this->batches_loaded_ + 1));
+    }
+    this->data_transformer_->MixBatch(&batch->data_,
+        batch->label_.cpu_data(), batch->extra_[0].get());
+  }
+  if (test_cache_ && !cache_ready_) {
+    if (cache_failed_) {
+      test_cache_.reset();
+    } else if (cache_wrapped_) {
+      // The first pass is over, from the next batch on nothing is read.
+      cache_ready_ = true;
+      LOG(INFO) << "Cached " << test_cache_->size() << " datums of "
+          << this->layer_param_.name() << ", "
+          << (test_cache_->memory_bytes() >> 20) << " MB in memory and "
+          << (test_cache_->spilled_bytes() >> 20) << " MB spilled";
+    }
+  } else if (cache_ready_) {
+    cache_position_ += batch_size;
+  }
+  batch_timer.Stop();
+  DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
+  int items = 0;
+  int fast_items = 0;
+  for (int i = 0; i < threads; ++i) {
+    const LoadStats& stats = helpers_stats_[i];
+    DLOG(INFO) << "Thread " << i << " read time: " << stats.read_time / 1000
+        << " ms, transform time: " << stats.trans_time / 1000 << " ms.";
+    items += stats.items;
+    fast_items += stats.fast_items;
+  }
+  // How many items load_item packs straight from the DB bytes, without a
+  // cv::Mat, also in release builds.
+  summary_items_ += items;
+  summary_fast_items_ += fast_items;
+  const int interval =
+      this->layer_param_.data_param().prefetch_stats_interval();
+  if (interval > 0 && ++summary_batches_ >= interval) {
+    LOG(INFO) << "Items of " << this->layer_param_.name() << ": "
+        << summary_fast_items_ << " of " << summary_items_
+        << " packed straight from the DB bytes ("
+        << 100. * summary_fast_items_ / std::max<int64_t>(summary_items_, 1)
+        << "%) in the last "
+        << summary_batches_ << " batches";
+    summary_batches_ = 0;
+    summary_items_ = 0;
+    summary_fast_items_ = 0;
+  }
+}
+
+template<typename Dtype>
+void DataLayer<Dtype>::load_items(Batch<Dtype>* batch, int worker,
+    LoadStats* stats) {
+  const int batch_size = this->layer_param_.data_param().batch_size();
+  // Records go back to the reader all at once, when the items are done.
+  vector<DatumRecord*> done;
+  try {
+    for (int item_id = next_item_++; item_id < batch_size;
+        item_id = next_item_++) {
+      load_item(batch, item_id, worker, stats, &done);
+    }
+  } catch (boost::thread_interrupted&) {
+    // Even when stopped half way, for the reader to be restored.
+    if (!done.empty()) {
+      reader_->free().push(&done[0], done.size());
+    }
+    throw;
+  }
+  if (!done.empty()) {
+    reader_->free().push(&done[0], done.size());
+  }
+}
+
+template<typename Dtype>
+void DataLayer<Dtype>::load_item(Batch<Dtype>* batch, int item_id,
+    int worker, LoadStats* stats, vector<DatumRecord*>* done) {
+  CPUTimer timer;
+  DataTransformer<Dtype>* transformer = worker == 0 ?
+      this->data_transformer_.get() : transformers_[worker - 1].get();
+  Blob<Dtype>* transformed_data = worker == 0 ?
+      &this->transformed_data_ : transformed_[worker - 1].get();
+  const int views = this->layer_param_.data_param().views_per_sample();
+  const int crops = transformer->crops_per_image();
+  const int items = views * crops;
 
   Dtype* top_data = batch->data_.mutable_cpu_data();
   Dtype* top_label = NULL;  // suppress warnings about uninitialized variables
+  Dtype* top_group = NULL;
 
   if (this->output_labels_) {
     top_label = batch->label_.mutable_cpu_data();
   }
-  for (int item_id = 0; item_id < batch_size; ++item_id) {
-    timer.Start();
-    // get a datum
-    Datum& datum = *(reader_.full().pop("Waiting for data"));
-    read_time += timer.MicroSeconds();
-    timer.Start();
+  if (output_group_index_) {
+    top_group = batch->extra_.back()->mutable_cpu_data();
+  }
+  if (cache_ready_) {
+    Dtype label;
+    load_cached(test_cache_->entry(
+        (cache_start_ + item_id) % test_cache_->size()),
+        top_data + batch->data_.offset(item_id * items), &label);
+    for (int k = item_id * items; k < (item_id + 1) * items; ++k) {
+      if (this->output_labels_) {
+        top_label[k] = label;
+      }
+      if (output_group_index_) {
+        top_group[k] = item_id;
+      }
+    }
+    stats->items += items;
+    return;
+  }
+  timer.Start();
+  // get a datum
+  char* entry = NULL;
+  DatumRecord& record = cache_enabled_ ? *pop_cached(&entry) :
+      buckets_.empty() ? *(reader_->full().pop("Waiting for data")) :
+      *batch_records_[item_id];
+  const Datum& datum = record.datum();
+  transformer->set_trace_sample(record.position());
+  const DataParameter& data_param = this->layer_param_.data_param();
+  if (data_param.resumable()) {
+    // Items go where their record is in the stream, whichever thread loads
+    // them, and draw their augmentations from its number.
+    item_id = record.sequence() -
+        this->batches_loaded_ * data_param.batch_size();
+    CHECK(item_id >= 0 && item_id < data_param.batch_size())
+        << "Record " << record.sequence() << " out of batch "
+        << this->batches_loaded_;
+    transformer->SeedRand(stream_seed(data_param.shuffle_seed(),
+        2 * record.sequence()));
+  }
+  stats->read_time += timer.MicroSeconds();
+  timer.Start();
 
 	/* Begin Added by garylau, for lmdb data augmentation, 2017.12.11 */
-	int imgH = datum.height();
-	int imgW = datum.width();
-	cv::Mat cv_img(imgH, imgW, CV_8UC3);
-	this->data_transformer_->DatumToMat(&datum, cv_img);
-	this->data_transformer_->CVMatTransform(cv_img);
-	this->data_transformer_->MatToDatum(cv_img, &datum);
+	// Augment straight from the image bytes in the DB value and pack the
+	// result into the batch, without going back through a Datum. The datum
+	// is decoded once whatever the number of views and crops, and not at all
+	// when it is raw and no augmentation fires for any of its views. Random
+	// resized crops of encoded datums decode just their region, per view.
+	// float_data datums come with no bytes and are augmented as CV_32F.
+	const bool raw = !datum.encoded();
+	cv::Mat cv_img;
+	for (int view = 0; view < views; ++view) {
+		// Apply data transformations (mirror, scale, crop...)
+		int offset = batch->data_.offset((item_id * views + view) * crops);
+		transformed_data->set_cpu_data(top_data + offset);
+		stats->items += crops;
+		const int ops = transformer->DrawAugmentations();
+		if (!ops && raw && crops == 1 && buckets_.empty()) {
+			stats->fast_items += crops;
+			transformer->Transform(datum, record.data(), record.data_size(),
+				transformed_data);
+			continue;
+		}
+		cv::Mat view_img;
+		if ((ops & AUG_RESIZED_CROP) && !raw) {
+			// every view decodes its own random resized crop, and only it
+			transformer->DecodeResizedCrop(datum, record.data(),
+				record.data_size(), view_img);
+		} else {
+			if (!cv_img.data) {
+				transformer->DatumToMat(datum, record.data(), record.data_size(),
+					cv_img);
+			}
+			// augmentation works in place, every view but the last gets a copy
+			view_img = ops && view + 1 < views ? cv_img.clone() : cv_img;
+		}
+		if (ops) {
+			transformer->CVMatTransform(view_img, ops);
+		}
+		if (crops > 1) {
+			transformer->MultiCropMatToBlob(view_img, transformed_data);
+		} else {
+			transformer->MatToBlob(view_img, transformed_data);
+		}
+	}
 	/* End Added by garylau, for lmdb data augmentation, 2017.12.11 */
-
-    // Apply data transformations (mirror, scale, crop...)
-    int offset = batch->data_.offset(item_id);
-    this->transformed_data_.set_cpu_data(top_data + offset);
-    this->data_transformer_->Transform(datum, &(this->transformed_data_));
-    // Copy label.
+  if (entry) {
+    store_cached(entry, top_data + batch->data_.offset(item_id * items),
+        datum.label());
+  }
+  if (!cache_mean_values_.empty() || cache_scale_ != Dtype(1)) {
+    normalize_pixels(transformed_data->shape(),
+        views * transformed_data->count(),
+        top_data + batch->data_.offset(item_id * items));
+  }
+  // Copy label.
+  for (int k = item_id * items; k < (item_id + 1) * items; ++k) {
     if (this->output_labels_) {
-      top_label[item_id] = datum.label();
+      top_label[k] = datum.label();
+    }
+    if (output_group_index_) {
+      top_group[k] = item_id;
     }
-    trans_time += timer.MicroSeconds();
+  }
+  stats->trans_time += timer.MicroSeconds();
+
+  done->push_back(&record);
+}
 
-    reader_.free().push(const_cast<Datum*>(&datum));
+template<typename Dtype>
+int DataLayer<Dtype>::nearest_bucket(const DatumRecord& record) {
+  int height, width;
+  this->data_transformer_->InferImageSize(record.datum(), record.data(),
+      record.data_size(), &height, &width);
+  const float log_ratio = log(static_cast<float>(width) / height);
+  const DataParameter& data_param = this->layer_param_.data_param();
+  int nearest = 0;
+  float nearest_distance = 0;
+  for (int i = 0; i < data_param.bucket_aspect_ratio_size(); ++i) {
+    const float distance =
+        fabs(log(data_param.bucket_aspect_ratio(i)) - log_ratio);
+    if (i == 0 || distance < nearest_distance) {
+      nearest = i;
+      nearest_distance = distance;
+    }
+  }
+  return nearest;
+}
+
+template<typename Dtype>
+int DataLayer<Dtype>::fill_bucket_batch() {
+  const DataParameter& data_param = this->layer_param_.data_param();
+  const int batch_size = data_param.batch_size();
+  const int lookahead = DataReader::bucket_lookahead(data_param);
+  vector<DatumRecord*> records(std::max(lookahead - buffered_, 0));
+  while (buffered_ < lookahead) {
+    const int popped = reader_->full().pop(&records[0],
+        lookahead - buffered_, "Waiting for data");
+    for (int i = 0; i < popped; ++i) {
+      buckets_[nearest_bucket(*records[i])].push_back(
+          std::make_pair(arrivals_++, records[i]));
+    }
+    buffered_ += popped;
+  }
+  // Of the buckets holding a batch, the one whose oldest record has waited
+  // the longest, so that rare aspect ratios are not held back for ever.
+  int bucket = -1;
+  for (int i = 0; i < buckets_.size(); ++i) {
+    if (static_cast<int>(buckets_[i].size()) >= batch_size && (bucket < 0 ||
+        buckets_[i].front().first < buckets_[bucket].front().first)) {
+      bucket = i;
+    }
+  }
+  CHECK_GE(bucket, 0);
+  batch_records_.clear();
+  for (int i = 0; i < batch_size; ++i) {
+    batch_records_.push_back(buckets_[bucket].front().second);
+    buckets_[bucket].pop_front();
+  }
+  buffered_ -= batch_size;
+  return bucket;
+}
+
+template<typename Dtype>
+DatumRecord* DataLayer<Dtype>::pop_cached(char** entry) {
+  // Entries are handed out in reading order, under the same lock.
+  boost::mutex::scoped_lock lock(cache_mutex_);
+  DatumRecord* record = reader_->full().pop("Waiting for data");
+  ++cache_position_;
+  *entry = NULL;
+  if (!test_cache_ || cache_failed_ || cache_wrapped_) {
+    return record;
+  }
+  if (test_cache_->size() == 0) {
+    cache_first_position_ = record->position();
+  } else if (record->position() == cache_first_position_) {
+    cache_wrapped_ = true;
+    return record;
+  }
+  *entry = test_cache_->Allocate();
+  if (!*entry) {
+    LOG(WARNING) << "Not caching " << this->layer_param_.name()
+        << ": it takes more than test_cache_mb and there is no "
+        << "test_cache_spill";
+    cache_failed_ = true;
+  }
+  return record;
+}
+
+template<typename Dtype>
+void DataLayer<Dtype>::store_cached(char* entry, const Dtype* items,
+    Dtype label) {
+  *reinterpret_cast<double*>(entry) = label;
+  entry += sizeof(double);
+  if (!this->layer_param_.data_param().test_cache_uint8()) {
+    memcpy(entry, items, cache_item_count_ * sizeof(Dtype));
+    return;
+  }
+  uint8_t* pixels = reinterpret_cast<uint8_t*>(entry);
+  bool exact = true;
+  for (int i = 0; i < cache_item_count_; ++i) {
+    pixels[i] = static_cast<uint8_t>(items[i]);
+    exact &= pixels[i] == items[i];
+  }
+  CHECK(exact) << "test_cache_uint8 needs 8 bit images";
+}
+
+template<typename Dtype>
+void DataLayer<Dtype>::load_cached(const char* entry, Dtype* items,
+    Dtype* label) {
+  *label = *reinterpret_cast<const double*>(entry);
+  entry += sizeof(double);
+  if (!this->layer_param_.data_param().test_cache_uint8()) {
+    memcpy(items, entry, cache_item_count_ * sizeof(Dtype));
+    return;
+  }
+  const uint8_t* pixels = reinterpret_cast<const uint8_t*>(entry);
+  for (int i = 0; i < cache_item_count_; ++i) {
+    items[i] = pixels[i];
+  }
+  normalize_pixels(cache_shape_, cache_item_count_, items);
+}
+
+template<typename Dtype>
+void DataLayer<Dtype>::normalize_pixels(const vector<int>& item_shape,
+    int count, Dtype* items) {
+  // Items are laid out as crops x channels x height x width.
+  const int channels = item_shape[1];
+  const int plane = item_shape[2] * item_shape[3];
+  CHECK(cache_mean_values_.size() <= 1 ||
+      static_cast<int>(cache_mean_values_.size()) == channels)
+      << "Specify either 1 mean_value or as many as channels: " << channels;
+  for (int i = 0; i < count; i += plane) {
+    const int c = i / plane % channels;
+    const Dtype mean = cache_mean_values_.empty() ? Dtype(0) :
+        cache_mean_values_[cache_mean_values_.size() == 1 ? 0 : c];
+    for (int j = i; j < i + plane; ++j) {
+      items[j] = (items[j] - mean) * cache_scale_;
+    }
+  }
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  if (shm_ring_) {
+    forward_shm(top);
+  } else {
+    BasePrefetchingDataLayer<Dtype>::Forward_cpu(bottom, top);
+  }
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  // The batch was pushed to the GPU by the prefetch thread, the tops share
+  // that copy too.
+  if (shm_ring_) {
+    forward_shm(top);
+  } else {
+    BasePrefetchingDataLayer<Dtype>::Forward_gpu(bottom, top);
+  }
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::forward_shm(const vector<Blob<Dtype>*>& top) {
+  Batch<Dtype>* batch = this->next_batch();
+  top[0]->ReshapeLike(batch->data_);
+  top[0]->ShareData(batch->data_);
+  if (this->output_labels_) {
+    top[1]->ReshapeLike(batch->label_);
+    top[1]->ShareData(batch->label_);
+  }
+  for (int i = 0; i < batch->extra_.size(); ++i) {
+    top[i + 2]->ReshapeLike(*batch->extra_[i]);
+    top[i + 2]->ShareData(*batch->extra_[i]);
+  }
+  // The tops no longer use the previous batch: its slot of the ring goes
+  // back to the server before the batch does to the prefetch thread, which
+  // may keep it unloaded for a while, or retire it with auto_tune.
+  if (shm_forwarded_) {
+    typename std::map<Batch<Dtype>*, uint64_t>::iterator held =
+        shm_held_.find(shm_forwarded_);
+    CHECK(held != shm_held_.end());
+    shm_ring_->Release(held->second);
+    shm_held_.erase(held);
+    this->recycle_batch(shm_forwarded_);
+  }
+  shm_forwarded_ = batch;
+}
+
+template<typename Dtype>
+void DataLayer<Dtype>::load_shm_batch(Batch<Dtype>* batch) {
+  // The slot is held until forward_shm is done with the batch. Batches are
+  // forwarded in the order they were loaded, so releasing a slot releases
+  // no slot still in use.
+  uint64_t index;
+  char* slot = const_cast<char*>(shm_ring_->ReadSlot(&index));
+  shm_held_[batch] = index;
+  // No copy: the blobs use the ring memory, mapped read only.
+  batch->data_.set_cpu_data(
+      reinterpret_cast<Dtype*>(slot + shm_ring_->offset(0)));
+  if (this->output_labels_) {
+    batch->label_.set_cpu_data(
+        reinterpret_cast<Dtype*>(slot + shm_ring_->offset(1)));
+  }
+  for (int i = 0; i < batch->extra_.size(); ++i) {
+    batch->extra_[i]->set_cpu_data(
+        reinterpret_cast<Dtype*>(slot + shm_ring_->offset(i + 2)));
   }
-  timer.Stop();
-  batch_timer.Stop();
-  DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
-  DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
-  DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
 }
 
 INSTANTIATE_CLASS(DataLayer);
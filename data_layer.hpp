@@ -0,0 +1,262 @@
+#ifndef CAFFE_DATA_LAYER_HPP_
+#define CAFFE_DATA_LAYER_HPP_
+
+#include <boost/atomic.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/data_reader.hpp"
+#include "caffe/data_transformer.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layers/base_data_layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db.hpp"
+#include "caffe/util/shm_batch_ring.hpp"
+#include "caffe/util/transformed_cache.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Reads Datums from a LevelDB or LMDB and augments them.
+ *
+ * Tops: data, label (optional), then the mixed labels when MixUp/CutMix
+ * are enabled (see TransformationParameter::mixup_alpha) and, as the last
+ * top, the group index of every item: the position in the batch of the
+ * datum it was made from, so that the views_per_sample views and test_crops
+ * crops of the same datum can be matched downstream.
+ *
+ * The items of a batch are spread over data_param.transform_threads threads,
+ * the prefetch thread included, each with its own DataTransformer. The
+ * other threads are started with the prefetch thread and kept until it
+ * stops, see InternalThreadEntry.
+ *
+ * With data_param.bucket_aspect_ratio every batch takes the shape of the
+ * aspect ratio bucket its images were grouped in, so its shape changes from
+ * one batch to the next.
+ *
+ * With data_param.steal_across_batches the transform threads are kept
+ * across batches and take items from the next batch as soon as all those
+ * of the current one are taken, see InternalThreadEntry.
+ *
+ * With data_param.test_cache the TEST items of the first pass over the DB
+ * are kept, and the following passes served from them without reading nor
+ * transforming anything.
+ *
+ * With data_param.resumable the items are seeded from their number in the
+ * stream of records, and the state of the stream can be saved to and
+ * restored from solver snapshots, see SavePipelineState.
+ *
+ * With data_param.shm_name the batches are instead made by an
+ * augmentation_server shared by several local processes, and used in place
+ * in its shared memory ring: the tops point into the ring, which is mapped
+ * read only, so that layers must not work in place on them.
+ */
+template <typename Dtype>
+class DataLayer : public BasePrefetchingDataLayer<Dtype> {
+ public:
+  explicit DataLayer(const LayerParameter& param);
+  virtual ~DataLayer();
+  virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  // DataLayer uses DataReader instead for sharing for parallelism
+  virtual inline bool ShareInParallel() const { return false; }
+  virtual inline const char* type() const { return "Data"; }
+  virtual inline int ExactNumBottomBlobs() const { return 0; }
+  virtual inline int MinTopBlobs() const { return 1; }
+  virtual inline int MaxTopBlobs() const { return 4; }
+
+  // data_param.resumable: the state of the stream of samples and
+  // augmentations after the batches the net got so far, and taking the
+  // layer back to such a state (see SolverState::data_pipeline).
+  inline bool resumable() const {
+    return this->layer_param_.data_param().resumable();
+  }
+  void SavePipelineState(DataPipelineState* state) const;
+  void RestorePipelineState(const DataPipelineState& state);
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void InternalThreadEntry();
+  virtual void load_batch(Batch<Dtype>* batch);
+  // Per transform thread statistics of a batch.
+  struct LoadStats {
+    LoadStats() : read_time(0), trans_time(0), items(0), fast_items(0) {}
+    double read_time;
+    double trans_time;
+    // Items transformed, and those packed straight from the bytes of their
+    // raw datum, with no augmentation, crop or bucket to go through a cv::Mat.
+    int items;
+    int fast_items;
+  };
+  // Loads items of batch until there are none left, on transform thread
+  // worker (0 being the prefetch thread).
+  void load_items(Batch<Dtype>* batch, int worker, LoadStats* stats);
+  // The Caffe settings of the prefetch thread, for the transform threads
+  // to set up their own Caffe the way InternalThread does.
+  struct ThreadSettings {
+    int device;
+    Caffe::Brew mode;
+    unsigned int rand_seed;
+    int solver_count;
+    bool root_solver;
+  };
+  // On the prefetch thread, draws a random seed for the new thread.
+  static ThreadSettings thread_settings();
+  static void apply_thread_settings(const ThreadSettings& settings);
+  // Starts the threads of load_batch, workers 1 to the most transform
+  // threads auto_tune may set, and takes them down.
+  void start_helpers();
+  void stop_helpers();
+  // Transform thread worker (from 1) of load_batch, loading the items of
+  // every batch it takes part in.
+  void helper_items(int worker, ThreadSettings settings);
+  // Loads item item_id of batch on transform thread worker, adding the
+  // record to give back to the reader to done.
+  void load_item(Batch<Dtype>* batch, int item_id, int worker,
+      LoadStats* stats, vector<DatumRecord*>* done);
+  // steal_across_batches: a batch whose items are being loaded.
+  struct InFlight {
+    InFlight()
+        : batch(NULL), next(0), done(0), stolen(0), completion_sum(0),
+          completion_sumsq(0), completion_max(0) {}
+    Batch<Dtype>* batch;
+    // Items handed out, done, and handed out while an older batch was
+    // not done.
+    int next;
+    int done;
+    int stolen;
+    // Since the batch was opened, and the completion times of its items
+    // in microseconds.
+    CPUTimer timer;
+    double completion_sum;
+    double completion_sumsq;
+    double completion_max;
+    LoadStats stats;
+  };
+  // steal_across_batches: opens the free batches for the transform
+  // threads, and publishes them once loaded, on the prefetch thread.
+  void steal_batches();
+  // Reshapes batch and hands its items out, with the resize_schedule
+  // step and the shape of the items of the batches in flight.
+  void open_batch(Batch<Dtype>* batch, const vector<int>& item_shape);
+  // Transform thread worker (from 1) of steal_batches.
+  void steal_items(int worker, ThreadSettings settings);
+  // Next item for worker, from the oldest batch with items left. Under
+  // steal_mutex_.
+  bool claim_item(int worker, shared_ptr<InFlight>* flight, int* item_id);
+  virtual int transform_threads() const { return transform_threads_; }
+  virtual bool set_transform_threads(int threads);
+  // steal_across_batches: wakes steal_batches, which may wait for a free
+  // batch.
+  virtual void batch_recycled();
+  // shm_name: points batch at the next batch of the ring.
+  void load_shm_batch(Batch<Dtype>* batch);
+  // shm_name: makes the tops share the blobs of the next batch, pointing
+  // into the ring, instead of copying them, and recycles the batch of the
+  // previous forward, which the net is done with.
+  void forward_shm(const vector<Blob<Dtype>*>& top);
+  // bucket_aspect_ratio: the bucket nearest to the aspect ratio of a record.
+  int nearest_bucket(const DatumRecord& record);
+  // bucket_aspect_ratio: tops up the look-ahead and moves the records of
+  // the next batch to batch_records_, returns their bucket.
+  int fill_bucket_batch();
+  // test_cache: pops the next record, and gives it an entry of the cache
+  // while the first pass is not over (NULL otherwise).
+  DatumRecord* pop_cached(char** entry);
+  // test_cache: stores the items of a datum and its label to entry, and
+  // loads them back.
+  void store_cached(char* entry, const Dtype* items, Dtype label);
+  void load_cached(const char* entry, Dtype* items, Dtype* label);
+  // test_cache_uint8: applies the mean_value and scale held back from the
+  // transformers to the count pixel values of the items of a datum, of
+  // item_shape each. The shape is that of the batch being loaded, which
+  // differs from cache_shape_ once caching failed.
+  void normalize_pixels(const vector<int>& item_shape, int count,
+      Dtype* items);
+
+  // NULL with shm_name.
+  shared_ptr<DataReader> reader_;
+  bool output_group_index_;
+  // Transformers are not thread safe, the helper threads of the prefetch
+  // thread get their own, created as needed.
+  vector<shared_ptr<DataTransformer<Dtype> > > transformers_;
+  vector<shared_ptr<Blob<Dtype> > > transformed_;
+  boost::atomic<int> transform_threads_;
+  // Next item of the batch being loaded.
+  boost::atomic<int> next_item_;
+  // The threads of load_batch. Each batch bumps helpers_generation_, the
+  // helpers below helpers_threads_ then load its items and the last one
+  // done wakes the prefetch thread up. The statistics of the threads are
+  // kept here, a helper may still be at work when the prefetch thread is
+  // interrupted.
+  vector<shared_ptr<boost::thread> > helpers_;
+  boost::mutex helpers_mutex_;
+  boost::condition_variable helpers_cond_;
+  boost::condition_variable helpers_done_cond_;
+  int64_t helpers_generation_;
+  int helpers_threads_;
+  int helpers_busy_;
+  Batch<Dtype>* helpers_batch_;
+  vector<LoadStats> helpers_stats_;
+  // steal_across_batches: the batches in flight, oldest first.
+  std::deque<shared_ptr<InFlight> > in_flight_;
+  boost::mutex steal_mutex_;
+  // Items to hand out, and batches done or free.
+  boost::condition_variable work_cond_;
+  boost::condition_variable publish_cond_;
+  // Batches loaded, items loaded and those packed straight from the DB bytes
+  // since the last summary, logged every prefetch_stats_interval batches.
+  int summary_batches_;
+  int64_t summary_items_;
+  int64_t summary_fast_items_;
+  // resumable: the batches of the last restored state, and the forward
+  // passes done at the time.
+  int64_t restored_batches_;
+  int64_t restored_forwards_;
+  // shm_name: the ring, the batch of the ring each Batch points at, and
+  // the Batch the tops share.
+  shared_ptr<ShmBatchRing> shm_ring_;
+  std::map<Batch<Dtype>*, uint64_t> shm_held_;
+  Batch<Dtype>* shm_forwarded_;
+  // bucket_aspect_ratio: height and width of every bucket, the records
+  // waiting in each with their arrival number, and the records of the
+  // batch being loaded.
+  vector<std::pair<int, int> > bucket_shapes_;
+  vector<std::deque<std::pair<uint64_t, DatumRecord*> > > buckets_;
+  int buffered_;
+  uint64_t arrivals_;
+  vector<DatumRecord*> batch_records_;
+  // test_cache: the items of the datums of the first pass, in reading order,
+  // created with the first batch. cache_position_ counts the datums read or
+  // served, cache_start_ is its value at the start of the batch.
+  bool cache_enabled_;
+  shared_ptr<TransformedCache> test_cache_;
+  vector<int> cache_shape_;
+  int cache_item_count_;
+  boost::mutex cache_mutex_;
+  int cache_first_position_;
+  bool cache_wrapped_;
+  bool cache_failed_;
+  bool cache_ready_;
+  int64_t cache_position_;
+  int64_t cache_start_;
+  // test_cache_uint8: the transformers output pixel values, normalized with
+  // these.
+  Dtype cache_scale_;
+  vector<Dtype> cache_mean_values_;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_DATA_LAYER_HPP_
@@ -0,0 +1,446 @@
+// This program measures how many images per second the Data layer delivers
+// for given transform_params, against the number of transform threads. It
+// can first write a synthetic DB to read from, so it runs on its own.
+// Usage:
+//    data_pipeline_benchmark [FLAGS] DB_PATH [CONFIG...]
+// Every CONFIG is a text file holding a transform_param block, like
+// transform_param.txt (with only the fields caffe.proto knows). The results
+// are printed as JSON on stdout, one object per config and thread count.
+// With --verify_resume it checks instead that a resumable Data layer goes on
+// with the same batches once restored from a saved state. With
+// --shuffle_buffer and --num_shards, and a DB small enough for the batches
+// checked to cross the end of an epoch of the shard, this also checks the
+// restored shuffle buffer and the reseeding of the next epoch, e.g.:
+//    data_pipeline_benchmark --generate=500 --batch_size=32 --verify_resume=10
+//        --batches=20 --shuffle_buffer=64 --num_shards=2 --shard_range=64
+//        /tmp/resume_lmdb
+
+#include <stdint.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "boost/scoped_ptr.hpp"
+#include "boost/thread.hpp"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "google/protobuf/text_format.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layer_factory.hpp"
+#include "caffe/layers/data_layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/db.hpp"
+#include "caffe/util/format.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/rng.hpp"
+
+using namespace caffe;  // NOLINT(build/namespaces)
+using boost::scoped_ptr;
+using std::string;
+using std::vector;
+
+DEFINE_int32(generate, 0,
+    "Write a synthetic DB of this many images to DB_PATH first, "
+    "0 to read an existing one.");
+DEFINE_int32(height, 256, "Height of the synthetic images.");
+DEFINE_int32(width, 256, "Width of the synthetic images.");
+DEFINE_double(size_jitter, 0,
+    "Draw the size of every synthetic image within this fraction of "
+    "height and width.");
+DEFINE_int32(channels, 3, "Channels of the synthetic images, 1 or 3.");
+DEFINE_bool(encoded, true,
+    "JPEG encode the synthetic images, raw uint8 datums otherwise.");
+DEFINE_int32(quality, 90, "JPEG quality of the synthetic images.");
+DEFINE_string(backend, "lmdb", "The backend {lmdb, leveldb} of the DB.");
+DEFINE_string(threads, "1,2,4,8",
+    "Comma separated transform_threads to run every config with.");
+DEFINE_int32(batch_size, 64, "Batch size.");
+DEFINE_int32(prefetch, 4, "data_param.prefetch.");
+DEFINE_int32(shuffle_buffer, 0, "data_param.shuffle_buffer.");
+DEFINE_int32(num_shards, 1, "data_param.num_shards.");
+DEFINE_int32(shard_id, 0, "data_param.shard_id.");
+DEFINE_int32(shard_range, 1024, "data_param.shard_range.");
+DEFINE_int32(warmup, 10, "Batches run before measuring.");
+DEFINE_int32(batches, 100, "Batches measured per run.");
+DEFINE_int32(verify_resume, 0,
+    "Instead of measuring, save the state of a resumable Data layer after "
+    "this many batches, and check that a new layer restored from it gives "
+    "the same --batches next batches, with the first and the last thread "
+    "count. Exits with 1 when they differ.");
+
+// Used when no CONFIG is given: crop and mirror only, then the sample of
+// transform_param.txt with mean values instead of the mean file.
+static const char* kBuiltinConfigs[][2] = {
+  {"crop_mirror", "crop_size: 224 mirror: true scale: 0.00390625"},
+  {"sample",
+   "crop_size: 224 mirror: true scale: 0.00390625 "
+   "mean_value: 104 mean_value: 117 mean_value: 123 "
+   "apply_probability: 0.5 smooth_filtering: true max_smooth: 6 "
+   "max_rotation_angle: 30 contrast_brightness_adjustment: true "
+   "min_contrast: 0.8 max_contrast: 1.2 max_brightness_shift: 20 "
+   "max_color_shift: 20 min_side_min: 224 min_side_max: 288 "
+   "affine_min_scale: 0.8 affine_max_scale: 1.2"},
+};
+
+// Smooth random colors with some noise, compressing about like a photo.
+static cv::Mat SyntheticImage(int height, int width, int channels) {
+  cv::Mat coarse(4, 4, CV_8UC(channels));
+  cv::randu(coarse, cv::Scalar::all(0), cv::Scalar::all(256));
+  cv::Mat image;
+  cv::resize(coarse, image, cv::Size(width, height));
+  cv::Mat noise(height, width, CV_8UC(channels));
+  cv::randu(noise, cv::Scalar::all(0), cv::Scalar::all(16));
+  image += noise;
+  return image;
+}
+
+static void Generate(const string& path) {
+  scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
+  db->Open(path, db::NEW);
+  scoped_ptr<db::Transaction> txn(db->NewTransaction());
+  caffe::rng_t rng(1701);
+  vector<int> params;
+  params.push_back(CV_IMWRITE_JPEG_QUALITY);
+  params.push_back(FLAGS_quality);
+  size_t bytes = 0;
+  for (int i = 0; i < FLAGS_generate; ++i) {
+    int height = FLAGS_height;
+    int width = FLAGS_width;
+    if (FLAGS_size_jitter > 0) {
+      const double jitter_h = (static_cast<int>(rng() % 2001) - 1000) / 1000.
+          * FLAGS_size_jitter;
+      const double jitter_w = (static_cast<int>(rng() % 2001) - 1000) / 1000.
+          * FLAGS_size_jitter;
+      height = std::max(1, static_cast<int>(height * (1 + jitter_h)));
+      width = std::max(1, static_cast<int>(width * (1 + jitter_w)));
+    }
+    const cv::Mat image = SyntheticImage(height, width, FLAGS_channels);
+    Datum datum;
+    if (FLAGS_encoded) {
+      vector<uchar> buffer;
+      CHECK(cv::imencode(".jpg", image, buffer, params));
+      datum.set_data(string(buffer.begin(), buffer.end()));
+      datum.set_encoded(true);
+    } else {
+      CVMatToDatum(image, &datum);
+    }
+    datum.set_label(rng() % 1000);
+    string value;
+    CHECK(datum.SerializeToString(&value));
+    bytes += value.size();
+    txn->Put(caffe::format_int(i, 8), value);
+    if ((i + 1) % 1000 == 0) {
+      txn->Commit();
+      txn.reset(db->NewTransaction());
+      LOG(INFO) << "Generated " << i + 1 << " images";
+    }
+  }
+  txn->Commit();
+  db->Close();
+  LOG(INFO) << "Generated " << FLAGS_generate << " images, "
+      << bytes / FLAGS_generate << " bytes each on average";
+}
+
+// Quotes s for JSON.
+static string Quote(const string& s) {
+  string quoted = "\"";
+  for (int i = 0; i < s.size(); ++i) {
+    if (s[i] == '"' || s[i] == '\\') {
+      quoted += '\\';
+    }
+    quoted += s[i];
+  }
+  return quoted + "\"";
+}
+
+static double Percentile(const vector<double>& sorted, double p) {
+  const int i = std::min<int>(sorted.size() - 1, p * sorted.size());
+  return sorted[i];
+}
+
+static double CpuSeconds() {
+  struct rusage usage;
+  CHECK_EQ(getrusage(RUSAGE_SELF, &usage), 0);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+      usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static LayerParameter DataLayerParam(const string& source,
+    const TransformationParameter& transform_param, int threads) {
+  LayerParameter param;
+  param.set_name("data");
+  param.set_type("Data");
+  param.add_top("data");
+  param.add_top("label");
+  param.set_phase(TRAIN);
+  *param.mutable_transform_param() = transform_param;
+  DataParameter* data_param = param.mutable_data_param();
+  data_param->set_source(source);
+  data_param->set_backend(FLAGS_backend == "leveldb" ?
+      DataParameter_DB_LEVELDB : DataParameter_DB_LMDB);
+  data_param->set_batch_size(FLAGS_batch_size);
+  data_param->set_prefetch(FLAGS_prefetch);
+  data_param->set_shuffle_buffer(FLAGS_shuffle_buffer);
+  data_param->set_num_shards(FLAGS_num_shards);
+  data_param->set_shard_id(FLAGS_shard_id);
+  data_param->set_shard_range(FLAGS_shard_range);
+  data_param->set_transform_threads(threads);
+  return param;
+}
+
+// Runs the Data layer with threads transform threads and a consumer doing
+// nothing with the batches, returns the JSON object of the run. The speedup
+// is against baseline images per second, the run sets it when it is 0.
+static string Run(const string& source, const string& name,
+    const TransformationParameter& transform_param, int threads,
+    double* baseline) {
+  const LayerParameter param =
+      DataLayerParam(source, transform_param, threads);
+  shared_ptr<Layer<float> > layer = LayerRegistry<float>::CreateLayer(param);
+  Blob<float> data;
+  Blob<float> label;
+  vector<Blob<float>*> bottom;
+  vector<Blob<float>*> top;
+  top.push_back(&data);
+  top.push_back(&label);
+  layer->SetUp(bottom, top);
+  for (int i = 0; i < FLAGS_warmup; ++i) {
+    layer->Forward(bottom, top);
+  }
+
+  vector<double> batch_ms;
+  int images = 0;
+  CPUTimer timer;
+  CPUTimer batch_timer;
+  const double cpu_start = CpuSeconds();
+  timer.Start();
+  for (int i = 0; i < FLAGS_batches; ++i) {
+    batch_timer.Start();
+    layer->Forward(bottom, top);
+    batch_ms.push_back(batch_timer.MilliSeconds());
+    images += data.num();
+  }
+  const double seconds = timer.Seconds();
+  const double cpu_cores = (CpuSeconds() - cpu_start) / seconds;
+  layer.reset();
+  if (*baseline == 0) {
+    *baseline = images / seconds;
+  }
+
+  std::sort(batch_ms.begin(), batch_ms.end());
+  const int hardware_threads =
+      std::max<int>(1, boost::thread::hardware_concurrency());
+  LOG(INFO) << name << ", " << threads << " threads: "
+      << images / seconds << " images/s, " << cpu_cores << " cores busy";
+  std::ostringstream json;
+  json << "{\"config\": " << Quote(name)
+      << ", \"transform_threads\": " << threads
+      << ", \"images\": " << images
+      << ", \"seconds\": " << seconds
+      << ", \"images_per_second\": " << images / seconds
+      << ", \"speedup\": " << images / seconds / *baseline
+      << ", \"batch_ms\": {\"mean\": " << seconds * 1000 / FLAGS_batches
+      << ", \"p50\": " << Percentile(batch_ms, 0.5)
+      << ", \"p90\": " << Percentile(batch_ms, 0.9)
+      << ", \"p99\": " << Percentile(batch_ms, 0.99)
+      << ", \"max\": " << batch_ms.back() << "}"
+      << ", \"cpu_cores\": " << cpu_cores
+      << ", \"cpu_utilization\": " << cpu_cores / hardware_threads << "}";
+  return json.str();
+}
+
+// FNV-1a hashes of the tops of the next batches of layer.
+static vector<uint64_t> HashBatches(Layer<float>* layer,
+    const vector<Blob<float>*>& top, int batches) {
+  vector<Blob<float>*> bottom;
+  vector<uint64_t> hashes;
+  for (int i = 0; i < batches; ++i) {
+    layer->Forward(bottom, top);
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int j = 0; j < top.size(); ++j) {
+      const unsigned char* bytes =
+          reinterpret_cast<const unsigned char*>(top[j]->cpu_data());
+      for (size_t k = 0; k < top[j]->count() * sizeof(float); ++k) {
+        hash = (hash ^ bytes[k]) * 0x100000001b3ULL;
+      }
+    }
+    hashes.push_back(hash);
+  }
+  return hashes;
+}
+
+// Saves the state of a resumable layer with saved_threads transform threads
+// after --verify_resume batches, restores it in a new layer with
+// resumed_threads, and compares the next --batches batches of both. Returns
+// the JSON object of the check.
+static string VerifyResume(const string& source, const string& name,
+    const TransformationParameter& transform_param, int saved_threads,
+    int resumed_threads, bool* match) {
+  Blob<float> data;
+  Blob<float> label;
+  vector<Blob<float>*> bottom;
+  vector<Blob<float>*> top;
+  top.push_back(&data);
+  top.push_back(&label);
+  DataPipelineState state;
+  // Where the uninterrupted layer is after the batches checked.
+  DataPipelineState end_state;
+  vector<uint64_t> expected;
+  {
+    // A source is read by one layer at a time.
+    LayerParameter param =
+        DataLayerParam(source, transform_param, saved_threads);
+    param.mutable_data_param()->set_resumable(true);
+    shared_ptr<Layer<float> > layer =
+        LayerRegistry<float>::CreateLayer(param);
+    layer->SetUp(bottom, top);
+    DataLayer<float>* data_layer = dynamic_cast<DataLayer<float>*>(
+        layer.get());
+    HashBatches(layer.get(), top, FLAGS_verify_resume);
+    data_layer->SavePipelineState(&state);
+    expected = HashBatches(layer.get(), top, FLAGS_batches);
+    data_layer->SavePipelineState(&end_state);
+  }
+  if (end_state.epoch() == state.epoch()) {
+    LOG(WARNING) << name << ": the batches checked do not cross the end of "
+        << "an epoch, use a smaller DB or more --batches to check the next "
+        << "epoch too";
+  }
+  LayerParameter param =
+      DataLayerParam(source, transform_param, resumed_threads);
+  param.mutable_data_param()->set_resumable(true);
+  shared_ptr<Layer<float> > layer = LayerRegistry<float>::CreateLayer(param);
+  layer->SetUp(bottom, top);
+  CPUTimer timer;
+  timer.Start();
+  dynamic_cast<DataLayer<float>*>(layer.get())->RestorePipelineState(state);
+  const double restore_ms = timer.MilliSeconds();
+  const vector<uint64_t> actual = HashBatches(layer.get(), top, FLAGS_batches);
+  int mismatches = 0;
+  int first_mismatch = -1;
+  for (int i = 0; i < FLAGS_batches; ++i) {
+    if (actual[i] != expected[i]) {
+      first_mismatch = first_mismatch < 0 ? i : first_mismatch;
+      ++mismatches;
+    }
+  }
+  *match = mismatches == 0;
+  LOG(INFO) << name << ", resumed after " << FLAGS_verify_resume
+      << " batches: " << mismatches << " of " << FLAGS_batches
+      << " batches differ, restored in " << restore_ms << " ms";
+  std::ostringstream json;
+  json << "{\"config\": " << Quote(name)
+      << ", \"saved_threads\": " << saved_threads
+      << ", \"resumed_threads\": " << resumed_threads
+      << ", \"resumed_after\": " << FLAGS_verify_resume
+      << ", \"epoch\": " << state.epoch()
+      << ", \"position\": " << state.position()
+      << ", \"end_epoch\": " << end_state.epoch()
+      << ", \"batches\": " << FLAGS_batches
+      << ", \"mismatches\": " << mismatches
+      << ", \"first_mismatch\": " << first_mismatch
+      << ", \"restore_ms\": " << restore_ms << "}";
+  return json.str();
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  // Print output to stderr (while still logging), stdout gets the JSON
+  FLAGS_alsologtostderr = 1;
+
+#ifndef GFLAGS_GFLAGS_H_
+  namespace gflags = google;
+#endif
+
+  gflags::SetUsageMessage("Measure the throughput of the Data layer\n"
+        "Usage:\n"
+        "    data_pipeline_benchmark [FLAGS] DB_PATH [CONFIG...]\n"
+        "Every CONFIG is a text file holding a transform_param block, like "
+        "transform_param.txt.\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (argc < 2) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0],
+        "tools/data_pipeline_benchmark");
+    return 1;
+  }
+  const string source = argv[1];
+  if (FLAGS_generate > 0) {
+    CHECK(FLAGS_channels == 1 || FLAGS_channels == 3)
+        << "channels must be 1 or 3";
+    Generate(source);
+  }
+
+  vector<string> names;
+  vector<TransformationParameter> configs;
+  for (int i = 2; i < argc; ++i) {
+    LayerParameter layer_param;
+    CHECK(ReadProtoFromTextFile(argv[i], &layer_param))
+        << "Could not read a transform_param block from " << argv[i];
+    names.push_back(argv[i]);
+    configs.push_back(layer_param.transform_param());
+  }
+  if (configs.empty()) {
+    const int builtin_configs =
+        sizeof(kBuiltinConfigs) / sizeof(kBuiltinConfigs[0]);
+    for (int i = 0; i < builtin_configs; ++i) {
+      TransformationParameter transform_param;
+      CHECK(google::protobuf::TextFormat::ParseFromString(
+          kBuiltinConfigs[i][1], &transform_param));
+      names.push_back(kBuiltinConfigs[i][0]);
+      configs.push_back(transform_param);
+    }
+  }
+  vector<int> threads;
+  std::istringstream threads_list(FLAGS_threads);
+  string item;
+  while (std::getline(threads_list, item, ',')) {
+    threads.push_back(atoi(item.c_str()));
+    CHECK_GT(threads.back(), 0) << "Bad thread count in " << FLAGS_threads;
+  }
+
+  Caffe::set_mode(Caffe::CPU);
+  std::ostringstream json;
+  json << "{\"source\": " << Quote(source)
+      << ", \"batch_size\": " << FLAGS_batch_size
+      << ", \"shuffle_buffer\": " << FLAGS_shuffle_buffer
+      << ", \"num_shards\": " << FLAGS_num_shards
+      << ", \"shard_id\": " << FLAGS_shard_id
+      << ", \"hardware_threads\": " << boost::thread::hardware_concurrency()
+      << ", \"runs\": [";
+  if (FLAGS_verify_resume > 0) {
+    bool all_match = true;
+    for (int i = 0; i < configs.size(); ++i) {
+      bool match;
+      json << (i ? ",\n  " : "\n  ") << VerifyResume(source, names[i],
+          configs[i], threads.front(), threads.back(), &match);
+      all_match = all_match && match;
+    }
+    json << "\n]}\n";
+    printf("%s", json.str().c_str());
+    return all_match ? 0 : 1;
+  }
+  for (int i = 0; i < configs.size(); ++i) {
+    // The speedups of a config are against its first thread count.
+    double baseline = 0;
+    for (int j = 0; j < threads.size(); ++j) {
+      json << (i || j ? ",\n  " : "\n  ")
+          << Run(source, names[i], configs[i], threads[j], &baseline);
+    }
+  }
+  json << "\n]}\n";
+  printf("%s", json.str().c_str());
+  return 0;
+}
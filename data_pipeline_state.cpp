@@ -0,0 +1,44 @@
+#include <string>
+
+#include "caffe/layers/data_layer.hpp"
+#include "caffe/util/data_pipeline_state.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void SaveDataPipelineStates(const Net<Dtype>& net, SolverState* state) {
+  state->clear_data_pipeline();
+  const vector<shared_ptr<Layer<Dtype> > >& layers = net.layers();
+  for (int i = 0; i < layers.size(); ++i) {
+    const DataLayer<Dtype>* layer =
+        dynamic_cast<const DataLayer<Dtype>*>(layers[i].get());
+    if (layer && layer->resumable()) {
+      layer->SavePipelineState(state->add_data_pipeline());
+    }
+  }
+}
+
+template <typename Dtype>
+void RestoreDataPipelineStates(const SolverState& state, Net<Dtype>* net) {
+  for (int i = 0; i < state.data_pipeline_size(); ++i) {
+    const DataPipelineState& pipeline = state.data_pipeline(i);
+    const string& name = pipeline.layer();
+    CHECK(net->has_layer(name)) << "No layer " << name << " to resume";
+    DataLayer<Dtype>* layer =
+        dynamic_cast<DataLayer<Dtype>*>(net->layer_by_name(name).get());
+    CHECK(layer && layer->resumable())
+        << name << " is not a resumable Data layer";
+    layer->RestorePipelineState(pipeline);
+  }
+}
+
+template void SaveDataPipelineStates(const Net<float>& net,
+    SolverState* state);
+template void SaveDataPipelineStates(const Net<double>& net,
+    SolverState* state);
+template void RestoreDataPipelineStates(const SolverState& state,
+    Net<float>* net);
+template void RestoreDataPipelineStates(const SolverState& state,
+    Net<double>* net);
+
+}  // namespace caffe
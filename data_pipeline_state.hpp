@@ -0,0 +1,27 @@
+#ifndef CAFFE_UTIL_DATA_PIPELINE_STATE_HPP_
+#define CAFFE_UTIL_DATA_PIPELINE_STATE_HPP_
+
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+/**
+ * @brief Saves the state of the resumable data layers of a net
+ * (data_param.resumable) to SolverState::data_pipeline, and restores it.
+ *
+ * Meant for the solver snapshots: SaveDataPipelineStates when writing the
+ * SolverState, RestoreDataPipelineStates once the net is set up and the
+ * SolverState read. The restored layers then go on with the samples and
+ * augmentations the saved ones would have produced, without going through
+ * the records seen since the start of the epoch.
+ */
+template <typename Dtype>
+void SaveDataPipelineStates(const Net<Dtype>& net, SolverState* state);
+
+template <typename Dtype>
+void RestoreDataPipelineStates(const SolverState& state, Net<Dtype>* net);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_DATA_PIPELINE_STATE_HPP_
@@ -0,0 +1,429 @@
+#include <boost/thread.hpp>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/data_reader.hpp"
+#include "caffe/layers/data_layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/rng.hpp"
+
+namespace caffe {
+
+using boost::weak_ptr;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::internal::WireFormatLite;
+
+map<const string, weak_ptr<DataReader::Body> > DataReader::bodies_;
+static boost::mutex bodies_mutex_;
+
+DatumRecord::DatumRecord()
+    : datum_(google::protobuf::Arena::CreateMessage<Datum>(&arena_)),
+      data_(NULL),
+      data_size_(0),
+      position_(0),
+      sequence_(0) {
+}
+
+void DatumRecord::Parse(string* value) {
+  value_.swap(*value);
+  arena_.Reset();
+  datum_ = google::protobuf::Arena::CreateMessage<Datum>(&arena_);
+  data_ = NULL;
+  data_size_ = 0;
+
+  // Locate the data field on the wire, the rest of the message is tiny.
+  const uint8_t* buffer = reinterpret_cast<const uint8_t*>(value_.data());
+  const int size = value_.size();
+  int data_begin = size;
+  int data_end = size;
+  int data_count = 0;
+  CodedInputStream input(buffer, size);
+  while (true) {
+    const int tag_begin = input.CurrentPosition();
+    const uint32_t tag = input.ReadTag();
+    if (tag == 0) {
+      break;
+    }
+    if (WireFormatLite::GetTagFieldNumber(tag) == Datum::kDataFieldNumber &&
+        WireFormatLite::GetTagWireType(tag) ==
+        WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+      uint32_t length;
+      CHECK(input.ReadVarint32(&length)) << "Corrupted datum";
+      data_begin = tag_begin;
+      data_ = value_.data() + input.CurrentPosition();
+      data_size_ = length;
+      CHECK(input.Skip(length)) << "Corrupted datum";
+      data_end = input.CurrentPosition();
+      ++data_count;
+    } else {
+      CHECK(WireFormatLite::SkipField(&input, tag)) << "Corrupted datum";
+    }
+  }
+  if (data_count > 1) {
+    // Repeated data fields are legal protobuf but never written by caffe,
+    // just parse them the regular way.
+    CHECK(datum_->ParseFromString(value_));
+    data_ = datum_->data().data();
+    data_size_ = datum_->data().size();
+    return;
+  }
+  // Parse the header around the image bytes.
+  CodedInputStream head(buffer, data_begin);
+  CHECK(datum_->MergeFromCodedStream(&head)) << "Corrupted datum";
+  CodedInputStream tail(buffer + data_end, size - data_end);
+  CHECK(datum_->MergeFromCodedStream(&tail)) << "Corrupted datum";
+}
+
+DataReader::DataReader(const LayerParameter& param)
+    : queue_pair_(new QueuePair(  //
+        param.data_param().prefetch() * param.data_param().batch_size() +
+        bucket_lookahead(param.data_param()) +
+        param.data_param().shuffle_buffer())) {
+  // Get or create a body
+  boost::mutex::scoped_lock lock(bodies_mutex_);
+  string key = source_key(param);
+  weak_ptr<Body>& weak = bodies_[key];
+  body_ = weak.lock();
+  if (!body_) {
+    body_.reset(new Body(param));
+    bodies_[key] = weak_ptr<Body>(body_);
+  }
+  body_->new_queue_pairs_.push(queue_pair_);
+}
+
+int DataReader::bucket_lookahead(const DataParameter& param) {
+  const int buckets = param.bucket_aspect_ratio_size();
+  if (!buckets) {
+    return 0;
+  }
+  // With fewer, every bucket could be short of a batch.
+  return std::max<int>(param.bucket_lookahead(),
+      buckets * (param.batch_size() - 1) + 1);
+}
+
+void DataReader::GetState(int64_t sequence,
+    DataPipelineState* state) const {
+  QueuePair* qp = queue_pair_.get();
+  boost::mutex::scoped_lock lock(qp->checkpoints_mutex_);
+  // The body may not have got to the record yet.
+  while (qp->checkpoints_.empty() ||
+      qp->checkpoints_.back().sequence() < sequence) {
+    qp->checkpoints_cond_.wait(lock);
+  }
+  for (int i = 0; i < qp->checkpoints_.size(); ++i) {
+    if (qp->checkpoints_[i].sequence() == sequence) {
+      *state = qp->checkpoints_[i];
+      return;
+    }
+  }
+  LOG(FATAL) << "No state of " << body_->param_.data_param().source()
+      << " at record " << sequence << ", kept from record "
+      << qp->checkpoints_.front().sequence();
+}
+
+void DataReader::Restore(const DataPipelineState& state) {
+  // The body is the only one to read into the pair, with a single solver.
+  body_->StopInternalThread();
+  QueuePair* qp = queue_pair_.get();
+  DatumRecord* record;
+  while (qp->full_.try_pop(&record)) {
+    qp->free_.push(record);
+  }
+  for (int i = 0; i < qp->shuffle_.size(); ++i) {
+    qp->free_.push(qp->shuffle_[i]);
+  }
+  qp->shuffle_.clear();
+  qp->shuffle_bytes_ = 0;
+  CHECK_EQ(static_cast<int>(qp->free_.size()), qp->size_)
+      << "Records of " << body_->param_.data_param().source()
+      << " are still in use";
+  {
+    boost::mutex::scoped_lock lock(qp->checkpoints_mutex_);
+    qp->checkpoints_.clear();
+  }
+  qp->handed_out_ = state.sequence();
+  body_->restore_.reset(new DataPipelineState(state));
+  body_->new_queue_pairs_.push(queue_pair_);
+  body_->StartInternalThread();
+}
+
+DataReader::~DataReader() {
+  string key = source_key(body_->param_);
+  body_.reset();
+  boost::mutex::scoped_lock lock(bodies_mutex_);
+  if (bodies_[key].expired()) {
+    bodies_.erase(key);
+  }
+}
+
+//
+
+DataReader::QueuePair::QueuePair(int size)
+    : free_(size), full_(size), shuffle_bytes_(0), size_(size),
+      handed_out_(0) {
+  // Initialize the free queue with requested number of datums
+  for (int i = 0; i < size; ++i) {
+    free_.push(new DatumRecord());
+  }
+}
+
+DataReader::QueuePair::~QueuePair() {
+  DatumRecord* record;
+  while (free_.try_pop(&record)) {
+    delete record;
+  }
+  while (full_.try_pop(&record)) {
+    delete record;
+  }
+  for (int i = 0; i < shuffle_.size(); ++i) {
+    delete shuffle_[i];
+  }
+}
+
+//
+
+DataReader::Body::Body(const LayerParameter& param)
+    : param_(param),
+      new_queue_pairs_(),
+      entries_(0),
+      position_(0),
+      epoch_(0),
+      shuffle_rng_(param.data_param().shuffle_seed()) {
+  const DataParameter& data_param = param_.data_param();
+  CHECK_GT(data_param.num_shards(), 0) << "num_shards must be positive";
+  CHECK_LT(data_param.shard_id(), data_param.num_shards())
+      << "shard_id must be less than num_shards";
+  CHECK_GT(data_param.shard_range(), 0) << "shard_range must be positive";
+  if (data_param.shuffle_buffer()) {
+    LOG(INFO) << "Shuffling " << data_param.source() << " through "
+        << data_param.shuffle_buffer() << " records, at most "
+        << data_param.shuffle_buffer_mb() << " MB";
+  }
+  StartInternalThread();
+}
+
+DataReader::Body::~Body() {
+  StopInternalThread();
+}
+
+void DataReader::Body::InternalThreadEntry() {
+  shared_ptr<db::DB> db(db::GetDB(param_.data_param().backend()));
+  db->Open(param_.data_param().source(), db::READ);
+  shared_ptr<db::Cursor> cursor(db->NewCursor());
+  vector<shared_ptr<QueuePair> > qps;
+  if (param_.data_param().num_shards() > 1) {
+    // Only keys are walked here, LMDB values are not even paged in.
+    entries_ = 0;
+    for (cursor->SeekToFirst(); cursor->valid(); cursor->Next()) {
+      ++entries_;
+    }
+    cursor->SeekToFirst();
+    if (!restore_) {
+      deal_ranges();
+      while (!owned()) {
+        step(cursor.get());
+      }
+    }
+  }
+  try {
+    int solver_count = param_.phase() == TRAIN ? Caffe::solver_count() : 1;
+
+    // To ensure deterministic runs, only start running once all solvers
+    // are ready. But solvers need to peek on one item during initialization,
+    // so read one item, then wait for the next solver.
+    for (int i = 0; i < solver_count; ++i) {
+      shared_ptr<QueuePair> qp(new_queue_pairs_.pop());
+      if (restore_) {
+        restore(db.get(), cursor.get(), qp.get());
+      }
+      read_one(cursor.get(), qp.get());
+      qps.push_back(qp);
+    }
+    // Main loop
+    while (!must_stop()) {
+      for (int i = 0; i < solver_count; ++i) {
+        read_one(cursor.get(), qps[i].get());
+      }
+      // Check no additional readers have been created. This can happen if
+      // more than one net is trained at a time per process, whether single
+      // or multi solver. It might also happen if two data layers have same
+      // name and same source.
+      CHECK_EQ(new_queue_pairs_.size(), 0);
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
+void DataReader::Body::read_one(db::Cursor* cursor, QueuePair* qp) {
+  const DataParameter& data_param = param_.data_param();
+  if (data_param.resumable() &&
+      qp->handed_out_ % data_param.batch_size() == 0) {
+    checkpoint(qp);
+  }
+  if (!data_param.shuffle_buffer()) {
+    DatumRecord* record = read_next(cursor, qp);
+    record->set_sequence(qp->handed_out_++);
+    qp->full_.push(record);
+    return;
+  }
+  // Fill the buffer up, in DB order, then hand out a random record of it.
+  const size_t max_bytes =
+      static_cast<size_t>(data_param.shuffle_buffer_mb()) << 20;
+  do {
+    DatumRecord* record = read_next(cursor, qp);
+    qp->shuffle_.push_back(record);
+    qp->shuffle_bytes_ += record->size();
+  } while (qp->shuffle_.size() < data_param.shuffle_buffer() &&
+      qp->shuffle_bytes_ < max_bytes);
+  const int i = shuffle_rng_() % qp->shuffle_.size();
+  DatumRecord* record = qp->shuffle_[i];
+  qp->shuffle_[i] = qp->shuffle_.back();
+  qp->shuffle_.pop_back();
+  qp->shuffle_bytes_ -= record->size();
+  record->set_sequence(qp->handed_out_++);
+  qp->full_.push(record);
+}
+
+void DataReader::Body::checkpoint(QueuePair* qp) {
+  DataPipelineState state;
+  state.set_sequence(qp->handed_out_);
+  state.set_epoch(epoch_);
+  state.set_position(position_);
+  for (int i = 0; i < qp->shuffle_.size(); ++i) {
+    state.add_shuffle_position(qp->shuffle_[i]->position());
+  }
+  std::ostringstream rng;
+  rng << shuffle_rng_;
+  state.set_shuffle_rng(rng.str());
+  // More than the batches between the body and the net: in the queue,
+  // being loaded and prefetched.
+  const DataParameter& data_param = param_.data_param();
+  const int kept =
+      data_param.prefetch() + data_param.max_prefetch_batches() + 4;
+  boost::mutex::scoped_lock lock(qp->checkpoints_mutex_);
+  qp->checkpoints_.push_back(state);
+  while (static_cast<int>(qp->checkpoints_.size()) > kept) {
+    qp->checkpoints_.pop_front();
+  }
+  qp->checkpoints_cond_.notify_all();
+}
+
+void DataReader::Body::restore(db::DB* db, db::Cursor* cursor,
+    QueuePair* qp) {
+  const DataPipelineState& state = *restore_;
+  epoch_ = state.epoch();
+  std::istringstream rng(state.shuffle_rng());
+  rng >> shuffle_rng_;
+  if (param_.data_param().num_shards() > 1) {
+    deal_ranges();
+  }
+  // The records of the shuffle buffer are read back in one walk over the
+  // keys, values are only read at their positions.
+  std::multimap<int, int> buffer;
+  for (int i = 0; i < state.shuffle_position_size(); ++i) {
+    buffer.insert(std::make_pair(state.shuffle_position(i), i));
+  }
+  qp->shuffle_.assign(state.shuffle_position_size(), NULL);
+  std::multimap<int, int>::const_iterator it = buffer.begin();
+  shared_ptr<db::Cursor> walk(db->NewCursor());
+  walk->SeekToFirst();
+  for (int position = 0; walk->valid() && it != buffer.end();
+      walk->Next(), ++position) {
+    for (; it != buffer.end() && it->first == position; ++it) {
+      DatumRecord* record = qp->free_.pop();
+      string value = walk->value();
+      record->Parse(&value);
+      record->set_position(position);
+      qp->shuffle_[it->second] = record;
+      qp->shuffle_bytes_ += record->size();
+    }
+  }
+  CHECK(it == buffer.end()) << "Shuffle buffer position " << it->first
+      << " past the end of " << param_.data_param().source();
+  cursor->SeekToFirst();
+  for (position_ = 0; position_ < state.position(); ++position_) {
+    cursor->Next();
+  }
+  CHECK(cursor->valid()) << "Position " << state.position()
+      << " past the end of " << param_.data_param().source();
+  LOG(INFO) << "Resuming " << param_.data_param().source() << " at record "
+      << state.sequence() << ": epoch " << epoch_ << ", position "
+      << position_ << ", " << qp->shuffle_.size() << " records shuffled";
+  restore_.reset();
+}
+
+DatumRecord* DataReader::Body::read_next(db::Cursor* cursor,
+    QueuePair* qp) {
+  DatumRecord* record = qp->free_.pop();
+  // The value is handed over to the record, which parses it in place: the
+  // image bytes are not copied again on their way to the transformer.
+  string value = cursor->value();
+  record->Parse(&value);
+  record->set_position(position_);
+
+  // go to the next iter, skipping the ranges of the other shards
+  do {
+    step(cursor);
+  } while (!owned());
+  return record;
+}
+
+void DataReader::Body::step(db::Cursor* cursor) {
+  cursor->Next();
+  ++position_;
+  if (!cursor->valid()) {
+    DLOG(INFO) << "Restarting data prefetching from start.";
+    cursor->SeekToFirst();
+    position_ = 0;
+    ++epoch_;
+    shuffle_rng_.seed(param_.data_param().shuffle_seed() + epoch_);
+    if (!owned_.empty()) {
+      deal_ranges();
+    }
+  }
+}
+
+void DataReader::Body::deal_ranges() {
+  const DataParameter& data_param = param_.data_param();
+  const int entries = DealRanges(data_param, entries_, epoch_, &owned_);
+  LOG(INFO) << "Shard " << data_param.shard_id() << "/"
+      << data_param.num_shards() << " of " << data_param.source()
+      << ", epoch " << epoch_ << ": " << entries << " of " << entries_
+      << " entries";
+}
+
+int DataReader::DealRanges(const DataParameter& param, int entries,
+    int epoch, vector<bool>* owned) {
+  const int range = param.shard_range();
+  const int num_shards = param.num_shards();
+  const int ranges = (entries + range - 1) / range;
+  CHECK_GE(ranges, num_shards) << "Not enough entries in "
+      << param.source() << " for " << num_shards << " shards of "
+      << range << " entries ranges, lower shard_range";
+  // Every process draws the same permutation for the epoch.
+  vector<int> order(ranges);
+  for (int i = 0; i < ranges; ++i) {
+    order[i] = i;
+  }
+  caffe::rng_t rng(param.shard_seed() + epoch);
+  shuffle(order.begin(), order.end(), &rng);
+  owned->assign(ranges, false);
+  int count = 0;
+  for (int i = param.shard_id(); i < ranges; i += num_shards) {
+    (*owned)[order[i]] = true;
+    count += std::min(range, entries - order[i] * range);
+  }
+  return count;
+}
+
+}  // namespace caffe
@@ -0,0 +1,187 @@
+#ifndef CAFFE_DATA_READER_HPP_
+#define CAFFE_DATA_READER_HPP_
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <google/protobuf/arena.h>
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/db.hpp"
+#include "caffe/util/ring_buffer.hpp"
+#include "caffe/util/rng.hpp"
+
+namespace caffe {
+
+/**
+ * @brief A Datum as handed out by DataReader.
+ *
+ * The serialized DB value is kept as is, the Datum header (shape, label,
+ * encoded flag, float_data) is parsed on a protobuf Arena owned by the record,
+ * and the image bytes are not copied into Datum::data but left in place:
+ * data() points into the DB value. Records are recycled through the reader's
+ * free queue, so the arena is reset rather than freed between two values.
+ */
+class DatumRecord {
+ public:
+  DatumRecord();
+
+  /**
+   * @brief Takes ownership of a serialized Datum (the string is swapped out)
+   *    and parses it, aliasing the image bytes instead of copying them.
+   */
+  void Parse(string* value);
+
+  inline const Datum& datum() const { return *datum_; }
+  // Image bytes (raw uint8 or encoded), empty for float_data datums.
+  inline const char* data() const { return data_; }
+  inline size_t data_size() const { return data_size_; }
+  // Bytes of the serialized Datum.
+  inline size_t size() const { return value_.size(); }
+  // Position of the record in the DB.
+  inline int position() const { return position_; }
+  inline void set_position(int position) { position_ = position; }
+  // Number of the record in the stream handed out by the reader.
+  inline int64_t sequence() const { return sequence_; }
+  inline void set_sequence(int64_t sequence) { sequence_ = sequence; }
+
+ protected:
+  google::protobuf::Arena arena_;
+  Datum* datum_;
+  string value_;
+  const char* data_;
+  size_t data_size_;
+  int position_;
+  int64_t sequence_;
+
+DISABLE_COPY_AND_ASSIGN(DatumRecord);
+};
+
+/**
+ * @brief Reads data from a source to queues available to data layers.
+ * A single reading thread is created per source, even if multiple solvers
+ * are running in parallel, e.g. for multi-GPU training. This makes sure
+ * databases are read sequentially, and that each solver accesses a different
+ * subset of the database. Data is distributed to solvers in a round-robin
+ * way to keep parallel training deterministic.
+ */
+class DataReader {
+ public:
+  explicit DataReader(const LayerParameter& param);
+  ~DataReader();
+
+  inline RingQueue<DatumRecord*>& free() const {
+    return queue_pair_->free_;
+  }
+  inline RingQueue<DatumRecord*>& full() const {
+    return queue_pair_->full_;
+  }
+  // Records a data layer holds back to group them in aspect ratio buckets
+  // (data_param.bucket_aspect_ratio), on top of the prefetched ones.
+  static int bucket_lookahead(const DataParameter& param);
+  // Sharded reading (see DataParameter::num_shards): flags the ranges of
+  // shard param.shard_id() in a DB of entries entries for epoch, the same
+  // in every process, and returns how many entries they hold.
+  static int DealRanges(const DataParameter& param, int entries, int epoch,
+      vector<bool>* owned);
+
+  // data_param.resumable: the state of the reader when it was about to
+  // hand out record sequence, the first of a batch, and taking the reader
+  // back to such a state. Records handed out must all have been given
+  // back to the free queue before Restore.
+  void GetState(int64_t sequence, DataPipelineState* state) const;
+  void Restore(const DataPipelineState& state);
+
+ protected:
+  // Queue pairs are shared between a body and its readers
+  class QueuePair {
+   public:
+    explicit QueuePair(int size);
+    ~QueuePair();
+
+    // Lock-free rings sized for every record, so pushes never wait.
+    RingQueue<DatumRecord*> free_;
+    RingQueue<DatumRecord*> full_;
+    // Records of the shuffle buffer (data_param.shuffle_buffer), only used
+    // by the body, and their bytes.
+    vector<DatumRecord*> shuffle_;
+    size_t shuffle_bytes_;
+    // Records of the pair, and handed out so far.
+    const int size_;
+    int64_t handed_out_;
+    // data_param.resumable: states at the first records of the last
+    // batches, oldest first.
+    boost::mutex checkpoints_mutex_;
+    boost::condition_variable checkpoints_cond_;
+    std::deque<DataPipelineState> checkpoints_;
+
+  DISABLE_COPY_AND_ASSIGN(QueuePair);
+  };
+
+  // A single body is created per source
+  class Body : public InternalThread {
+   public:
+    explicit Body(const LayerParameter& param);
+    virtual ~Body();
+
+   protected:
+    void InternalThreadEntry();
+    void read_one(db::Cursor* cursor, QueuePair* qp);
+    // data_param.resumable: records the state before handing out the
+    // next record, and takes the cursor and the shuffle buffer back to
+    // restore_.
+    void checkpoint(QueuePair* qp);
+    void restore(db::DB* db, db::Cursor* cursor, QueuePair* qp);
+    // Reads the record at the cursor and moves on to the next one.
+    DatumRecord* read_next(db::Cursor* cursor, QueuePair* qp);
+    // Moves to the next entry, wrapping around at the end of the DB.
+    void step(db::Cursor* cursor);
+    // Deals the ranges of the DB out to the shards for epoch_.
+    void deal_ranges();
+    inline bool owned() const {
+      return owned_.empty() ||
+          owned_[position_ / param_.data_param().shard_range()];
+    }
+
+    const LayerParameter param_;
+    BlockingQueue<shared_ptr<QueuePair> > new_queue_pairs_;
+    // Sharded reading, see DataParameter::num_shards. owned_ flags the
+    // ranges of this shard, it is empty when there is a single shard.
+    int entries_;
+    int position_;
+    int epoch_;
+    vector<bool> owned_;
+    // Draws of the shuffle buffer, reseeded every epoch.
+    caffe::rng_t shuffle_rng_;
+    // State to start from, set by DataReader::Restore.
+    shared_ptr<DataPipelineState> restore_;
+
+    friend class DataReader;
+
+  DISABLE_COPY_AND_ASSIGN(Body);
+  };
+
+  // A source is uniquely identified by its layer name + path, in case
+  // the same database is read from two different locations in the net.
+  static inline string source_key(const LayerParameter& param) {
+    return param.name() + ":" + param.data_param().source();
+  }
+
+  const shared_ptr<QueuePair> queue_pair_;
+  shared_ptr<Body> body_;
+
+  static map<const string, boost::weak_ptr<DataReader::Body> > bodies_;
+
+DISABLE_COPY_AND_ASSIGN(DataReader);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_DATA_READER_HPP_
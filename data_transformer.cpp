@@ -9,11 +9,21 @@
 /* End Added by garylau, for data augmentation, 2017.11.22 */
 #endif  // USE_OPENCV
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif  // __SSE2__
+
+#include <boost/random/gamma_distribution.hpp>
+#include <boost/random/uniform_real.hpp>
+
+#include <algorithm>
+#include <cstring>
 #include <string>
 #include <vector>
 
 #include "caffe/data_transformer.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/jpeg_roi.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "caffe/util/rng.hpp"
 /* Begin Added by garylau, for data augmentation, 2017.11.22 */
@@ -26,7 +36,8 @@ namespace caffe {
 template<typename Dtype>
 DataTransformer<Dtype>::DataTransformer(const TransformationParameter& param,
     Phase phase)
-    : param_(param), phase_(phase) {
+    : param_(param), phase_(phase), trace_sample_(0), bucket_height_(0),
+      bucket_width_(0), resize_step_(-1), resized_crop_(0, 0, 0, 0) {
   // check if we want to use mean_file
   if (param_.has_mean_file()) {
     CHECK_EQ(param_.mean_value_size(), 0) <<
@@ -60,6 +71,69 @@ DataTransformer<Dtype>::DataTransformer(const TransformationParameter& param,
 			CHECK_EQ(param_.min_side(), 0) << "Cannot specify min_side_min & min_side_max and min_side at the same time";
 			CHECK_GE(param_.min_side_max(), param_.min_side_min()) << "min_side_max must be greater than (or equals to) min_side_min";
 		}
+		// check if we want to do multi-crop testing
+		if (param_.test_crops() > 1)
+		{
+			CHECK(param_.test_crops() == 2 || param_.test_crops() == 5 || param_.test_crops() == 10)
+				<< "test_crops must be 1, 2, 5 or 10";
+			CHECK_GT(param_.crop_size(), 0) << "test_crops requires crop_size";
+		}
+		// check if we want to trace the augmentation parameters
+		if (param_.has_trace_file())
+		{
+			trace_ = AugmentationTrace::Get(param_.trace_file(), param_.trace_buffer_size());
+		}
+		// check if we want to mix the batch
+		if (param_.mixup_alpha() > 0 || param_.cutmix_alpha() > 0)
+		{
+			CHECK_GE(param_.mix_probability(), 0) << "mix_probability must be in [0, 1]";
+			CHECK_LE(param_.mix_probability(), 1) << "mix_probability must be in [0, 1]";
+		}
+		// check if we want to cache the rotation/affine remap maps
+		if (param_.remap_cache_mb() > 0)
+		{
+			remap_cache_.reset(new RemapCache(static_cast<size_t>(param_.remap_cache_mb()) << 20));
+		}
+		// check if we want to do random resized crops
+		if (param_.resized_crop_min_area() > 0)
+		{
+			CHECK_GT(param_.crop_size(), 0) << "resized_crop requires crop_size";
+			CHECK(!param_.has_mean_file()) << "resized_crop needs mean_value instead of mean_file";
+			CHECK_LE(param_.resized_crop_min_area(), param_.resized_crop_max_area())
+				<< "resized_crop_max_area must be greater than (or equals to) resized_crop_min_area";
+			CHECK_LE(param_.resized_crop_max_area(), 1) << "resized_crop_max_area must not exceed 1";
+			CHECK_GT(param_.resized_crop_min_ratio(), 0) << "resized_crop_min_ratio must be positive";
+			CHECK_LE(param_.resized_crop_min_ratio(), param_.resized_crop_max_ratio())
+				<< "resized_crop_max_ratio must be greater than (or equals to) resized_crop_min_ratio";
+			CHECK(!param_.min_side() && !param_.min_side_min() && !param_.min_side_max())
+				<< "Cannot specify resized_crop and min_side at the same time";
+			for (int i = 0; i < param_.resize_schedule_size(); ++i)
+			{
+				const TransformationParameter::ResizeStep& step = param_.resize_schedule(i);
+				CHECK(!step.has_min_side() && !step.has_min_side_min())
+					<< "Cannot specify resized_crop and min_side at the same time";
+			}
+		}
+		// check if we want to resize progressively
+		for (int i = 0; i < param_.resize_schedule_size(); ++i)
+		{
+			const TransformationParameter::ResizeStep& step = param_.resize_schedule(i);
+			CHECK(i == 0 || step.start() >= param_.resize_schedule(i - 1).start()) << "resize_schedule steps must be in start order";
+			CHECK(!step.has_min_side() || !(step.has_min_side_min() || step.has_min_side_max()))
+				<< "Cannot specify min_side and min_side_min & min_side_max in the same resize_schedule step";
+			CHECK_EQ(step.has_min_side_min(), step.has_min_side_max()) << "resize_schedule steps set min_side_min and min_side_max together";
+			CHECK_GE(step.min_side_max(), step.min_side_min()) << "min_side_max must be greater than (or equals to) min_side_min";
+		}
+		resize_base_.set_crop_size(param_.crop_size());
+		if (param_.min_side())
+		{
+			resize_base_.set_min_side(param_.min_side());
+		}
+		else
+		{
+			resize_base_.set_min_side_min(param_.min_side_min());
+			resize_base_.set_min_side_max(param_.min_side_max());
+		}
 		/* End Added by garylau, for data augmentation, 2017.11.30 */
 	}
 
@@ -67,7 +141,13 @@ DataTransformer<Dtype>::DataTransformer(const TransformationParameter& param,
 template<typename Dtype>
 void DataTransformer<Dtype>::Transform(const Datum& datum,
                                        Dtype* transformed_data) {
-  const string& data = datum.data();
+  Transform(datum, datum.data().data(), datum.data().size(), transformed_data);
+}
+
+template<typename Dtype>
+void DataTransformer<Dtype>::Transform(const Datum& datum, const char* data,
+                                       size_t data_size,
+                                       Dtype* transformed_data) {
   const int datum_channels = datum.channels();
   const int datum_height = datum.height();
   const int datum_width = datum.width();
@@ -76,7 +156,7 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
   const Dtype scale = param_.scale();
   const bool do_mirror = param_.mirror() && Rand(2);
   const bool has_mean_file = param_.has_mean_file();
-  const bool has_uint8 = data.size() > 0;
+  const bool has_uint8 = data_size > 0;
   const bool has_mean_values = mean_values_.size() > 0;
 
   CHECK_GT(datum_channels, 0);
@@ -118,7 +198,16 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
       w_off = (datum_width - crop_size) / 2;
     }
   }
+  if (trace_) {
+    trace_record_ = AugmentationRecord();
+    trace_record_.ops = do_mirror ? AUG_MIRROR : 0;
+    trace_record_.crop[0] = h_off;
+    trace_record_.crop[1] = w_off;
+    push_trace();
+  }
 
+  // float_data is read through its contiguous storage
+  const float* float_data = has_uint8 ? NULL : datum.float_data().data();
   Dtype datum_element;
   int top_index, data_index;
   for (int c = 0; c < datum_channels; ++c) {
@@ -134,7 +223,7 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
           datum_element =
             static_cast<Dtype>(static_cast<uint8_t>(data[data_index]));
         } else {
-          datum_element = datum.float_data(data_index);
+          datum_element = float_data[data_index];
         }
         if (has_mean_file) {
           transformed_data[top_index] =
@@ -207,6 +296,28 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
   Transform(datum, transformed_data);
 }
 
+template<typename Dtype>
+void DataTransformer<Dtype>::Transform(const Datum& datum, const char* data,
+                                       size_t data_size,
+                                       Blob<Dtype>* transformed_blob) {
+  CHECK(!datum.encoded()) << "Encoded datums need DatumToMat";
+  const int crop_size = param_.crop_size();
+  const int height = crop_size ? crop_size : datum.height();
+  const int width = crop_size ? crop_size : datum.width();
+  CHECK_EQ(transformed_blob->channels(), datum.channels());
+  CHECK_EQ(transformed_blob->height(), height);
+  CHECK_EQ(transformed_blob->width(), width);
+  const int datum_size = datum.channels() * datum.height() * datum.width();
+  if (data_size > 0) {
+    CHECK_EQ(data_size, static_cast<size_t>(datum_size))
+        << "Datum size does not match its shape";
+  } else {
+    CHECK_EQ(datum.float_data_size(), datum_size)
+        << "Datum size does not match its shape";
+  }
+  Transform(datum, data, data_size, transformed_blob->mutable_cpu_data());
+}
+
 template<typename Dtype>
 void DataTransformer<Dtype>::Transform(const vector<Datum> & datum_vector,
                                        Blob<Dtype>* transformed_blob) {
@@ -249,31 +360,162 @@ void DataTransformer<Dtype>::Transform(const vector<cv::Mat> & mat_vector,
 }
 
     /* Begin Added by garylau, for data augmentation, 2017.11.22 */
-	void rotate(cv::Mat& src, int angle)
+	cv::Mat rotation_matrix(const cv::Size& size, int angle, cv::Size& dsize)
 	{
 		// get rotation matrix for rotating the image around its center
-		cv::Point2f center(src.cols / 2.0, src.rows / 2.0);
+		cv::Point2f center(size.width / 2.0, size.height / 2.0);
 		cv::Mat rot = cv::getRotationMatrix2D(center, angle, 1.0);
 		// determine bounding rectangle
-		cv::Rect bbox = cv::RotatedRect(center, src.size(), angle).boundingRect();
+		cv::Rect bbox = cv::RotatedRect(center, size, angle).boundingRect();
 		// adjust transformation matrix
 		rot.at<double>(0, 2) += bbox.width / 2.0 - center.x;
 		rot.at<double>(1, 2) += bbox.height / 2.0 - center.y;
-		cv::warpAffine(src, src, rot, bbox.size());
+		dsize = bbox.size();
+		return rot;
+	}
+
+	void rotate(cv::Mat& src, int angle)
+	{
+		cv::Size dsize;
+		cv::Mat rot = rotation_matrix(src.size(), angle, dsize);
+		cv::warpAffine(src, src, rot, dsize);
 	}
 
+	/* 旋转角度只取整数, 输入尺寸相同时变换反复出现, 开启remap_cache_mb时直接用缓存的映射做remap */
 	template <typename Dtype>
-	void DataTransformer<Dtype>::random_crop(cv::Mat& cv_img, int crop_size)
+	void DataTransformer<Dtype>::warp_rotate(cv::Mat& cv_img, int angle)
+	{
+		if (!remap_cache_)
+		{
+			rotate(cv_img, angle);
+			return;
+		}
+		RemapCache::Key key(cv_img.rows, cv_img.cols, angle);
+		const RemapCache::Maps* maps = remap_cache_->Find(key);
+		if (!maps)
+		{
+			cv::Size dsize;
+			cv::Mat rot = rotation_matrix(cv_img.size(), angle, dsize);
+			maps = remap_cache_->Insert(key, rot, dsize);
+		}
+		RemapCache::Remap(*maps, cv_img);
+	}
+
+	/* 仿射变换, 角度与缩放都按0.1的步长离散取值, 同样可以缓存映射 */
+	template <typename Dtype>
+	void DataTransformer<Dtype>::random_affine(cv::Mat& cv_img, int rotation_angle, float& affine_angle, float& affine_scale)
+	{
+		const float affine_min_scale = param_.affine_min_scale();
+		// 缩放范围小于0.1时只取affine_min_scale, Rand(0)会CHECK失败
+		const int scale_steps = std::max(static_cast<int>((param_.affine_max_scale() - affine_min_scale) * 10), 1);
+		const int angle = Rand(rotation_angle * 2 + 1) - rotation_angle;
+		const int scale_step = Rand(scale_steps);
+		const int width_step = Rand(scale_steps);
+		const int height_step = Rand(scale_steps);
+		affine_angle = angle;
+		affine_scale = affine_min_scale + scale_step / 10.f;
+
+		RemapCache::Key key(cv_img.rows, cv_img.cols, angle, scale_step, width_step, height_step);
+		const RemapCache::Maps* maps = remap_cache_ ? remap_cache_->Find(key) : NULL;
+		if (!maps)
+		{
+			// 中心为(x, y), 输出大小为(宽, 高)
+			cv::Point2f affine_center = cv::Point2f(cv_img.cols / 2, cv_img.rows / 2);
+			cv::Mat affine_matrix = cv::getRotationMatrix2D(affine_center, affine_angle, affine_scale);
+			cv::Size dize = cv::Size(cv_img.cols * (affine_min_scale + width_step / 10.f),
+				cv_img.rows * (affine_min_scale + height_step / 10.f));
+			if (!remap_cache_)
+			{
+				cv::warpAffine(cv_img, cv_img, affine_matrix, dize);
+				return;
+			}
+			maps = remap_cache_->Insert(key, affine_matrix, dize);
+		}
+		RemapCache::Remap(*maps, cv_img);
+	}
+
+	template <typename Dtype>
+	cv::Rect DataTransformer<Dtype>::random_crop(cv::Mat& cv_img, int crop_size)
 	{
 		int h_off = 0;
 		int w_off = 0;
 		const int img_height = cv_img.rows;
 		const int img_width = cv_img.cols;
+		/* 按长宽比分桶时裁剪成桶的长宽比, crop_size为短边 */
+		int crop_height = crop_size;
+		int crop_width = crop_size;
+		if (bucket_width_ > bucket_height_)
+		{
+			crop_width = std::min(img_width, crop_size * bucket_width_ / bucket_height_);
+		}
+		else if (bucket_height_ > bucket_width_)
+		{
+			crop_height = std::min(img_height, crop_size * bucket_height_ / bucket_width_);
+		}
 
-		h_off = Rand(img_height - crop_size + 1);
-		w_off = Rand(img_width - crop_size + 1);
-		cv::Rect roi(w_off, h_off, crop_size, crop_size);
+		h_off = Rand(img_height - crop_height + 1);
+		w_off = Rand(img_width - crop_width + 1);
+		cv::Rect roi(w_off, h_off, crop_width, crop_height);
 		cv_img = cv_img(roi);
+		return roi;
+	}
+
+	/* Inception式随机缩放裁剪, 在原图坐标中按面积比例与长宽比抽取区域 */
+	template <typename Dtype>
+	cv::Rect DataTransformer<Dtype>::draw_resized_crop(int img_height, int img_width)
+	{
+		const float area = static_cast<float>(img_height) * img_width;
+		const float min_ratio = param_.resized_crop_min_ratio();
+		const float max_ratio = param_.resized_crop_max_ratio();
+		for (int attempt = 0; attempt < 10; ++attempt)
+		{
+			float scale = 0.f;
+			float log_ratio = 0.f;
+			caffe_rng_uniform(1, param_.resized_crop_min_area(), param_.resized_crop_max_area(), &scale);
+			caffe_rng_uniform(1, static_cast<float>(log(min_ratio)), static_cast<float>(log(max_ratio)), &log_ratio);
+			const float ratio = exp(log_ratio);
+			const int width = static_cast<int>(round(sqrt(area * scale * ratio)));
+			const int height = static_cast<int>(round(sqrt(area * scale / ratio)));
+			if (width > 0 && width <= img_width && height > 0 && height <= img_height)
+			{
+				const int y = Rand(img_height - height + 1);
+				const int x = Rand(img_width - width + 1);
+				return cv::Rect(x, y, width, height);
+			}
+		}
+		// fall back to the whole image, its aspect ratio clamped to the range, in the center
+		int width = img_width;
+		int height = img_height;
+		if (static_cast<float>(img_width) / img_height < min_ratio)
+		{
+			height = std::max(1, static_cast<int>(round(img_width / min_ratio)));
+		}
+		else if (static_cast<float>(img_width) / img_height > max_ratio)
+		{
+			width = std::max(1, static_cast<int>(round(img_height * max_ratio)));
+		}
+		return cv::Rect((img_width - width) / 2, (img_height - height) / 2, width, height);
+	}
+
+	// resamples region to size x size, averaging the pixels when shrinking
+	cv::Mat resize_region(const cv::Mat& region, int size)
+	{
+		cv::Mat resized;
+		const bool shrink = region.cols > size && region.rows > size;
+		cv::resize(region, resized, cv::Size(size, size), 0, 0, shrink ? cv::INTER_AREA : cv::INTER_LINEAR);
+		return resized;
+	}
+
+	template <typename Dtype>
+	void DataTransformer<Dtype>::resized_crop(cv::Mat& cv_img)
+	{
+		// already cropped while decoding, see DecodeResizedCrop
+		if (resized_crop_.area() > 0)
+		{
+			return;
+		}
+		resized_crop_ = draw_resized_crop(cv_img.rows, cv_img.cols);
+		cv_img = resize_region(cv_img(resized_crop_), param_.crop_size());
 	}
 
 	void crop_center(cv::Mat& cv_img, int w, int h)
@@ -307,324 +549,240 @@ void DataTransformer<Dtype>::Transform(const vector<cv::Mat> & mat_vector,
 		}
 		cv::resize(cv_img, cv_img, dsize);
 	}
-    /* End Added by garylau, for data augmentation, 2017.11.22 */
 
-	/* 读取原始图片所用到的Transform, garylau */
-	template<typename Dtype>
-	void DataTransformer<Dtype>::Transform(const cv::Mat& img, Blob<Dtype>* transformed_blob)
+	// scales cv_img, preserving its aspect ratio, to the smallest size covering height x width
+	void resize_to_cover(cv::Mat& cv_img, int height, int width)
 	{
-		const int crop_size = param_.crop_size();
-		// Check dimensions.
-		const int channels = transformed_blob->channels();
-		const int height = transformed_blob->height();
-		const int width = transformed_blob->width();
-		const int num = transformed_blob->num();
-		const Dtype scale = param_.scale();
-		const bool has_mean_file = param_.has_mean_file();
-		const bool has_mean_values = mean_values_.size() > 0;
-		/* Begin Added by garylau, for data augmentation, 2017.11.22 */
-		const float apply_prob = 1.f - param_.apply_probability();
-		const float max_smooth = param_.max_smooth();
-		const int rotation_angle = param_.max_rotation_angle();
-		const float min_contrast = param_.min_contrast();
-		const float max_contrast = param_.max_contrast();
-		const int max_brightness_shift = param_.max_brightness_shift();
-		const int max_color_shift = param_.max_color_shift();
-		const int min_side_min = param_.min_side_min();
-		const int min_side_max = param_.min_side_max();
-		const int min_side = param_.min_side();
-		const float affine_min_scale = param_.affine_min_scale();
-		const float affine_max_scale = param_.affine_max_scale();
-		const float random_erasing_low = param_.random_erasing_low();
-		const float random_erasing_high = param_.random_erasing_high();
-		const float random_erasing_ratio = param_.random_erasing_ratio();
-		const bool debug_params = param_.debug_params();
-
-		const bool do_mirror = param_.mirror() && phase_ == TRAIN && Rand(2);
-		float current_prob = 0.f;
-		caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
-		const bool do_smooth = param_.smooth_filtering() && phase_ == TRAIN && max_smooth > 1 && current_prob > apply_prob;
-		caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
-		const bool do_rotation = rotation_angle > 0 && current_prob > apply_prob && phase_ == TRAIN;
-		caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
-		const bool do_brightness = param_.contrast_brightness_adjustment() && min_contrast > 0 && max_contrast >= min_contrast
-			                       && max_brightness_shift >= 0 && phase_ == TRAIN && current_prob > apply_prob;
-		caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
-		const bool do_color_shift = max_color_shift > 0 && phase_ == TRAIN && current_prob > apply_prob;
-		caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
-		const bool do_resize_to_min_side_min_max = min_side_min > 0 && min_side_max > min_side_min && phase_ == TRAIN && current_prob > apply_prob;
-		const bool do_resize_to_min_side = min_side > 0 && phase_ == TRAIN && current_prob > apply_prob;
-		caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
-		const bool do_affine = affine_min_scale > 0 && affine_max_scale > affine_min_scale && phase_ == TRAIN && current_prob > apply_prob;
-		caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
-		const bool do_random_erasing = param_.random_erasing_ratio() > 0 && param_.random_erasing_high() > param_.random_erasing_low()
-			                           && param_.random_erasing_low() > 0 && phase_ == TRAIN && current_prob > apply_prob;
+		const double k = std::max(static_cast<double>(height) / cv_img.rows,
+			static_cast<double>(width) / cv_img.cols);
+		const cv::Size dsize(std::max(width, static_cast<int>(round(cv_img.cols * k))),
+			std::max(height, static_cast<int>(round(cv_img.rows * k))));
+		if (dsize != cv_img.size())
+		{
+			cv::resize(cv_img, cv_img, dsize);
+		}
+	}
 
-		cv::Mat cv_img = img;
-		/* 随机擦除Random-Erasing */
-		cv::Scalar erase_mean = cv::mean(cv_img);
-		cv::Rect erase_rect;
-		if (do_random_erasing)
+	/* 色调旋转、饱和度缩放在YIQ空间中是对I、Q两个分量的旋转与缩放, 与颜色偏移、亮度对比度合成一个3x3矩阵加偏置,
+	   用定点整数一遍算完, 不需要转到HSV再转回来 */
+	static const int kColorBits = 12;     // coefficients in Q12
+	static const int kColorOne = 256;     // the offset is weighted by this constant input
+
+	// out = alpha * M * (in + shift) + beta for BGR pixels, M rotating the hue by hue degrees and scaling the saturation;
+	// shift and beta are in pixel values of the image depth
+	cv::Matx34d color_matrix(const cv::Scalar& shift, double alpha, double beta, int hue, float saturation)
+	{
+		const cv::Matx33d to_yiq(0.299, 0.587, 0.114, 0.596, -0.274, -0.322, 0.211, -0.523, 0.312);
+		const double c = saturation * cos(hue * PI / 180);
+		const double s = saturation * sin(hue * PI / 180);
+		const cv::Matx33d iq(1, 0, 0, 0, c, -s, 0, s, c);
+		const cv::Matx33d rgb = to_yiq.inv() * iq * to_yiq;
+		cv::Matx34d coef;
+		// BGR channel i is RGB channel 2 - i
+		for (int i = 0; i < 3; ++i)
 		{
-			int area = cv_img.cols * cv_img.rows;
-			caffe_rng_uniform(1, random_erasing_low, random_erasing_high, &current_prob);
-			float target_area = current_prob * area;
-			caffe_rng_uniform(1, random_erasing_ratio, 1.f / random_erasing_ratio, &current_prob);
-			float aspect_ratio = current_prob;
-			int erase_height = int(round(sqrt(target_area * aspect_ratio)));   /* 待erase的矩形区域的高 */
-			int erase_weight = int(round(sqrt(target_area / aspect_ratio)));   /* 待erase的矩形区域的宽 */
-			if (erase_weight <= cv_img.cols && erase_height <= cv_img.rows)
+			double offset = 0;
+			for (int j = 0; j < 3; ++j)
 			{
-				float erase_x = 0;                                             /* 待erase的矩形区域的左上角x坐标 */
-				float erase_y = 0;                                             /* 待erase的矩形区域的左上角y坐标 */
-				caffe_rng_uniform(1, 0.f, 1.f * (cv_img.cols - erase_weight), &erase_x);
-				caffe_rng_uniform(1, 0.f, 1.f * (cv_img.rows - erase_height), &erase_y);
-				erase_rect = cv::Rect(erase_x, erase_y, erase_weight, erase_height);
-				if (3 == cv_img.channels())
-				{
-					cv::Mat_<cv::Vec3b> img_test = cv_img;
-					for (size_t i = erase_x; i < erase_x + erase_weight; i++)
-					{
-						for (size_t j = erase_y; j < erase_y + erase_height; j++)
-						{
-							img_test(i, j) = cv::Vec3b(erase_mean.val[0], erase_mean.val[1], erase_mean.val[2]);
-						}
-					}
-				}
-				else
+				const double m = rgb(2 - i, 2 - j);
+				coef(i, j) = alpha * m;
+				offset += m * (alpha * shift[j] + beta);
+			}
+			coef(i, 3) = offset;
+		}
+		return coef;
+	}
+
+	// applies a color_matrix to a 3 channel image, in place; CV_8UC3 in fixed point
+	void color_transform(cv::Mat& cv_img, const cv::Matx34d& coef)
+	{
+		if (cv_img.depth() != CV_8U)
+		{
+			// saturates to the range of 16 bit images, float ones are not clamped
+			cv::Mat out;
+			cv::transform(cv_img, out, coef);
+			cv_img = out;
+			return;
+		}
+		CHECK_EQ(cv_img.type(), CV_8UC3);
+		// Every byte of a row is an output, computed from the bytes 2 before
+		// to 2 after it (its pixel) and the constant offset input, with
+		// weights depending on its channel.
+		short weights[3][6];
+		for (int c = 0; c < 3; ++c)
+		{
+			for (int j = -2; j <= 2; ++j)
+			{
+				weights[c][j + 2] = c + j >= 0 && c + j < 3 ?
+					cv::saturate_cast<short>(coef(c, c + j) * (1 << kColorBits)) : 0;
+			}
+			weights[c][5] = cv::saturate_cast<short>(coef(c, 3) * (1 << kColorBits) / kColorOne);
+		}
+#ifdef __SSE2__
+		// weight pairs of the 8 outputs from a byte of channel q: bytes -2 -1,
+		// 0 +1 and +2 offset, for the low then the high 4 outputs
+		__m128i pairs[3][6];
+		for (int q = 0; q < 3; ++q)
+		{
+			short w[6][8];
+			for (int l = 0; l < 8; ++l)
+			{
+				const short* lane = weights[(q + l) % 3];
+				for (int k = 0; k < 3; ++k)
 				{
-					cv_img(erase_rect) = erase_mean.val[0];
+					w[(l / 4) * 3 + k][(l % 4) * 2] = lane[k * 2];
+					w[(l / 4) * 3 + k][(l % 4) * 2 + 1] = lane[k * 2 + 1];
 				}
 			}
+			for (int k = 0; k < 6; ++k)
+			{
+				pairs[q][k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w[k]));
+			}
 		}
-
-		// apply color shift
-		if (do_color_shift)
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i one = _mm_set1_epi16(kColorOne);
+		const __m128i half = _mm_set1_epi32(1 << (kColorBits - 1));
+#endif  // __SSE2__
+		const int row_bytes = cv_img.cols * 3;
+		// rows are read from a padded copy and written in place
+		vector<uchar> row(row_bytes + 16, 0);
+		const uchar* src = &row[8];
+		for (int y = 0; y < cv_img.rows; ++y)
 		{
-			int b = Rand(max_color_shift + 1);
-			int g = Rand(max_color_shift + 1);
-			int r = Rand(max_color_shift + 1);
-			int sign = Rand(2);
-			cv::Mat shiftArr = cv_img.clone();
-			shiftArr.setTo(cv::Scalar(b, g, r));
-			if (sign == 1)
+			uchar* dst = cv_img.ptr<uchar>(y);
+			memcpy(&row[8], dst, row_bytes);
+			int i = 0;
+#ifdef __SSE2__
+			for (; i + 8 <= row_bytes; i += 8)
 			{
-				cv_img -= shiftArr;
+				const __m128i* p = pairs[i % 3];
+				__m128i x[5];
+				for (int j = 0; j < 5; ++j)
+				{
+					x[j] = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i + j - 2)), zero);
+				}
+				__m128i lo = _mm_add_epi32(_mm_add_epi32(
+					_mm_madd_epi16(_mm_unpacklo_epi16(x[0], x[1]), p[0]),
+					_mm_madd_epi16(_mm_unpacklo_epi16(x[2], x[3]), p[1])),
+					_mm_madd_epi16(_mm_unpacklo_epi16(x[4], one), p[2]));
+				__m128i hi = _mm_add_epi32(_mm_add_epi32(
+					_mm_madd_epi16(_mm_unpackhi_epi16(x[0], x[1]), p[3]),
+					_mm_madd_epi16(_mm_unpackhi_epi16(x[2], x[3]), p[4])),
+					_mm_madd_epi16(_mm_unpackhi_epi16(x[4], one), p[5]));
+				lo = _mm_srai_epi32(_mm_add_epi32(lo, half), kColorBits);
+				hi = _mm_srai_epi32(_mm_add_epi32(hi, half), kColorBits);
+				const __m128i out = _mm_packs_epi32(lo, hi);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(out, out));
 			}
-			else
+#endif  // __SSE2__
+			for (; i < row_bytes; ++i)
 			{
-				cv_img += shiftArr;
+				const short* w = weights[i % 3];
+				int sum = w[5] * kColorOne + (1 << (kColorBits - 1));
+				for (int j = 0; j < 5; ++j)
+				{
+					sum += w[j] * src[i + j - 2];
+				}
+				dst[i] = cv::saturate_cast<uchar>(sum >> kColorBits);
 			}
 		}
+	}
 
-		// set contrast and brightness
-		float alpha;
-		int beta;
-		if (do_brightness)
+	/* 颜色偏移、亮度这些按[0,255]给出的参数, 按图像像素类型换算成像素值: 16位图像乘257, float图像按float_range */
+	double pixel_range_scale(int depth, float float_range)
+	{
+		switch (depth)
 		{
-			caffe_rng_uniform(1, min_contrast, max_contrast, &alpha);
-			beta = Rand(max_brightness_shift * 2 + 1) - max_brightness_shift;
-			cv_img.convertTo(cv_img, -1, alpha, beta);
+		case CV_8U:
+			return 1;
+		case CV_16U:
+			return 65535. / 255;
+		case CV_32F:
+			return float_range / 255.;
+		default:
+			LOG(FATAL) << "Image data type must be 8 or 16 bit unsigned, or float";
+			return 0;
 		}
+	}
 
-		// set smoothness
-		int smooth_param = 0;
-		int smooth_type = 0;
-		if (do_smooth)
+	/* 减均值、乘scale并转成planar排列, 按像素类型T实例化; 每行每个通道是一个连续写入的简单循环, 编译器可以向量化 */
+	template <typename Dtype, typename T>
+	void normalize_planar(const cv::Mat& cv_img, int h_off, int w_off, int height, int width,
+		const Dtype* mean, const vector<Dtype>& mean_values, Dtype scale, bool mirror, Dtype* out)
+	{
+		const int channels = cv_img.channels();
+		for (int h = 0; h < height; ++h)
 		{
-			smooth_type = Rand(4);
-			smooth_param = 1 + 2 * Rand(max_smooth / 2);
-			switch (smooth_type)
+			const T* ptr = cv_img.ptr<T>(h_off + h) + w_off * channels;
+			for (int c = 0; c < channels; ++c)
 			{
-			case 0:
-				cv::GaussianBlur(cv_img, cv_img, cv::Size(smooth_param, smooth_param), 0);
-				break;
-			case 1:
-				cv::blur(cv_img, cv_img, cv::Size(smooth_param, smooth_param));
-				break;
-			case 2:
-				cv::medianBlur(cv_img, cv_img, smooth_param);
-				break;
-			case 3:
-				cv::boxFilter(cv_img, cv_img, -1, cv::Size(smooth_param * 2, smooth_param * 2));
-				break;
-			default:
-				break;
+				const T* src = ptr + c;
+				Dtype* row = out + (c * height + h) * width;
+				if (mirror)
+				{
+					row += width - 1;
+				}
+				const int step = mirror ? -1 : 1;
+				if (mean)
+				{
+					const Dtype* mean_row = mean + (c * cv_img.rows + h_off + h) * cv_img.cols + w_off;
+					for (int w = 0; w < width; ++w)
+					{
+						row[w * step] = (static_cast<Dtype>(src[w * channels]) - mean_row[w]) * scale;
+					}
+				}
+				else
+				{
+					const Dtype mean_value = mean_values.empty() ? Dtype(0) : mean_values[c];
+					for (int w = 0; w < width; ++w)
+					{
+						row[w * step] = (static_cast<Dtype>(src[w * channels]) - mean_value) * scale;
+					}
+				}
 			}
 		}
-		/* End Added by garylau, for data augmentation, 2017.11.22 */
-
-		const int img_channels = cv_img.channels();
-		const int img_height = cv_img.rows;
-		const int img_width = cv_img.cols;
-
-		CHECK_GT(img_channels, 0);
-		CHECK_GE(img_height, crop_size);
-		CHECK_GE(img_width, crop_size);
-		CHECK_EQ(channels, img_channels);
-		CHECK_LE(height, img_height);
-		CHECK_LE(width, img_width);
-		CHECK_GE(num, 1);
-		CHECK(cv_img.depth() == CV_8U) << "Image data type must be unsigned byte";
-
-  Dtype* mean = NULL;
-  if (has_mean_file) {
-    CHECK_EQ(img_channels, data_mean_.channels());
-    CHECK_EQ(img_height, data_mean_.height());
-    CHECK_EQ(img_width, data_mean_.width());
-    mean = data_mean_.mutable_cpu_data();
-  }
-  if (has_mean_values) {
-    CHECK(mean_values_.size() == 1 || mean_values_.size() == img_channels) <<
-     "Specify either 1 mean_value or as many as channels: " << img_channels;
-    if (img_channels > 1 && mean_values_.size() == 1) {
-      // Replicate the mean_value for simplicity
-      for (int c = 1; c < img_channels; ++c) {
-        mean_values_.push_back(mean_values_[0]);
-      }
-    }
-  }
-
-  /* Begin Added by garylau, for data augmentation, 2017.11.22 */
-  // resizing and crop according to min side, preserving aspect ratio
-  if (do_resize_to_min_side)
-  {
-	  random_crop(cv_img, min_side);
-  }
-  if (do_resize_to_min_side_min_max)
-  {
-	  int min_side_length = min_side_min + Rand(min_side_max - min_side_min + 1);
-	  resize(cv_img, min_side_max);
-	  random_crop(cv_img, min_side_length);
-  }
-  /* 仿射变换 */
-  float affine_angle = 0.f;
-  float affine_scale = 0.f;
-  if (do_affine)
-  {
-	  cv::Point2f affine_center = cv::Point2f(cv_img.rows / 2, cv_img.cols / 2);
-	  affine_angle = 1.0 * Rand(rotation_angle * 2 + 1) - rotation_angle;
-	  affine_scale = affine_min_scale + Rand((affine_max_scale - affine_min_scale) * 10) / 10.f;
-	  cv::Mat affine_matrix = cv::getRotationMatrix2D(affine_center, affine_angle, affine_scale);
-	  cv::Size dize = cv::Size(cv_img.rows * (affine_min_scale + Rand((affine_max_scale - affine_min_scale) * 10) / 10.f),
-		  cv_img.cols * (affine_min_scale + Rand((affine_max_scale - affine_min_scale) * 10) / 10.f));
-	  cv::warpAffine(cv_img, cv_img, affine_matrix, dize);
-  }
-  /* 旋转操作 */
-  int current_angle = 0;
-  if (do_rotation && !do_affine)
-  {
-	  current_angle = Rand(rotation_angle * 2 + 1) - rotation_angle;
-	  if (current_angle)
-	  {
-		  rotate(cv_img, current_angle);
-	  }
-  }
-
-  if (debug_params && phase_ == TRAIN) {
-	  LOG(INFO) << "----------------------------------------";
-	  if (do_smooth)
-	  {
-		  LOG(INFO) << "* parameter for smooth filtering: ";
-		  LOG(INFO) << "  smooth type: " << smooth_type << ", smooth param: " << smooth_param;
-	  }
-	  if (do_rotation)
-	  {
-		  LOG(INFO) << "* parameter for rotation: ";
-		  LOG(INFO) << "  current rotation angle: " << current_angle;
-	  }
-	  if (do_brightness)
-	  {
-		  LOG(INFO) << "* parameter for contrast adjustment: ";
-		  LOG(INFO) << "  alpha: " << alpha << ", beta: " << beta;
-	  }
-	  if (do_color_shift)
-	  {
-		  LOG(INFO) << "* parameter for color shift: ";
-		  LOG(INFO) << "max_color_shift: " << max_color_shift;
-	  }
-	  if (do_resize_to_min_side_min_max)
-	  {
-		  LOG(INFO) << "* parameter for min_side_min_max crop: ";
-		  LOG(INFO) << "min_side_min: " << min_side_min << ", min_side_max: " << min_side_max;
-	  }
-	  if (do_resize_to_min_side)
-	  {
-		  LOG(INFO) << "* parameter for min_side crop: ";
-		  LOG(INFO) << "min_side: " << min_side;
-	  }
-	  if (do_affine)
-	  {
-		  LOG(INFO) << "* parameter for affine transformation: ";
-		  LOG(INFO) << "affine_angle: " << affine_angle << ", affine_scale: " << affine_scale;
-	  }
-	  if (do_random_erasing)
-	  {
-		  LOG(INFO) << "* parameter for random erasing: ";
-		  LOG(INFO) << "erase_rect: " << "x:" << erase_rect.x << ", y:" << erase_rect.y << ", width:" << erase_rect.width << ", height:" << erase_rect.height;
-	  }
-  }
-  /* End Added by garylau, for data augmentation, 2017.11.22 */
-
-  int h_off = 0;
-  int w_off = 0;
-  cv::Mat cv_cropped_img = cv_img;
-  /* Begin Added by garylau, for data augmentation, 2017.11.22 */
-  if (img_width != cv_cropped_img.cols || img_height != cv_cropped_img.rows)
-  {
-	  cv::resize(cv_cropped_img, cv_cropped_img, cv::Size(img_width, img_height));
-  }
-  /* End Added by garylau, for data augmentation, 2017.11.22 */
-  if (crop_size) {
-    CHECK_EQ(crop_size, height);
-    CHECK_EQ(crop_size, width);
-    // We only do random crop when we do training.
-    if (phase_ == TRAIN) {
-      h_off = Rand(img_height - crop_size + 1);
-      w_off = Rand(img_width - crop_size + 1);
-    } else {
-      h_off = (img_height - crop_size) / 2;
-      w_off = (img_width - crop_size) / 2;
-    }
-    cv::Rect roi(w_off, h_off, crop_size, crop_size);
-	cv_cropped_img = cv_cropped_img(roi);
-  } else {
-    CHECK_EQ(img_height, height);
-    CHECK_EQ(img_width, width);
-  }
+	}
 
-  CHECK(cv_cropped_img.data);
+	// height x width from (h_off, w_off) of cv_img into planar out, mean being
+	// the full image size mean file or NULL
+	template <typename Dtype>
+	void normalize_image(const cv::Mat& cv_img, int h_off, int w_off, int height, int width,
+		const Dtype* mean, const vector<Dtype>& mean_values, Dtype scale, bool mirror, Dtype* out)
+	{
+		switch (cv_img.depth())
+		{
+		case CV_8U:
+			normalize_planar<Dtype, uchar>(cv_img, h_off, w_off, height, width, mean, mean_values, scale, mirror, out);
+			break;
+		case CV_16U:
+			normalize_planar<Dtype, ushort>(cv_img, h_off, w_off, height, width, mean, mean_values, scale, mirror, out);
+			break;
+		case CV_32F:
+			normalize_planar<Dtype, float>(cv_img, h_off, w_off, height, width, mean, mean_values, scale, mirror, out);
+			break;
+		default:
+			LOG(FATAL) << "Image data type must be 8 or 16 bit unsigned, or float";
+		}
+	}
+    /* End Added by garylau, for data augmentation, 2017.11.22 */
 
-  Dtype* transformed_data = transformed_blob->mutable_cpu_data();
-  int top_index;
-  for (int h = 0; h < height; ++h) {
-    const uchar* ptr = cv_cropped_img.ptr<uchar>(h);
-    int img_index = 0;
-    for (int w = 0; w < width; ++w) {
-      for (int c = 0; c < img_channels; ++c) {
-        if (do_mirror) {
-          top_index = (c * height + h) * width + (width - 1 - w);
-        } else {
-          top_index = (c * height + h) * width + w;
-        }
-        // int top_index = (c * height + h) * width + w;
-        Dtype pixel = static_cast<Dtype>(ptr[img_index++]);
-        if (has_mean_file) {
-          int mean_index = (c * img_height + h_off + h) * img_width + w_off + w;
-          transformed_data[top_index] =
-            (pixel - mean[mean_index]) * scale;
-        } else {
-          if (has_mean_values) {
-            transformed_data[top_index] =
-              (pixel - mean_values_[c]) * scale;
-          } else {
-            transformed_data[top_index] = pixel * scale;
-          }
-        }
-      }
-    }
-  }
-}
+	/* 读取原始图片所用到的Transform, garylau */
+	// 与lmdb的路径相同: 抽取增强, CVMatTransform做增强并缩放回增强前的大小, 再由MatToBlob裁剪、镜像、减均值
+	template<typename Dtype>
+	void DataTransformer<Dtype>::Transform(const cv::Mat& img, Blob<Dtype>* transformed_blob)
+	{
+		CHECK_GE(transformed_blob->num(), 1);
+		const int ops = DrawAugmentations();
+		if (!ops)
+		{
+			MatToBlob(img, transformed_blob);
+			return;
+		}
+		// the augmentations work in place, img belongs to the caller
+		cv::Mat cv_img = img.clone();
+		CVMatTransform(cv_img, ops);
+		MatToBlob(cv_img, transformed_blob);
+	}
 #endif  // USE_OPENCV
 
 template<typename Dtype>
@@ -765,12 +923,18 @@ vector<int> DataTransformer<Dtype>::InferBlobShape(const Datum& datum) {
   const int datum_width = datum.width();
   // Check dimensions.
   CHECK_GT(datum_channels, 0);
-  CHECK_GE(datum_height, crop_size);
-  CHECK_GE(datum_width, crop_size);
   // Build BlobShape.
   vector<int> shape(4);
   shape[0] = 1;
   shape[1] = datum_channels;
+  if (bucket_height_) {
+    // The image is scaled to the bucket.
+    shape[2] = bucket_height_;
+    shape[3] = bucket_width_;
+    return shape;
+  }
+  CHECK_GE(datum_height, crop_size);
+  CHECK_GE(datum_width, crop_size);
   shape[2] = (crop_size)? crop_size: datum_height;
   shape[3] = (crop_size)? crop_size: datum_width;
   return shape;
@@ -797,12 +961,17 @@ vector<int> DataTransformer<Dtype>::InferBlobShape(const cv::Mat& cv_img) {
   const int img_width = cv_img.cols;
   // Check dimensions.
   CHECK_GT(img_channels, 0);
-  CHECK_GE(img_height, crop_size);
-  CHECK_GE(img_width, crop_size);
   // Build BlobShape.
   vector<int> shape(4);
   shape[0] = 1;
   shape[1] = img_channels;
+  if (bucket_height_) {
+    shape[2] = bucket_height_;
+    shape[3] = bucket_width_;
+    return shape;
+  }
+  CHECK_GE(img_height, crop_size);
+  CHECK_GE(img_width, crop_size);
   shape[2] = (crop_size)? crop_size: img_height;
   shape[3] = (crop_size)? crop_size: img_width;
   return shape;
@@ -824,7 +993,8 @@ vector<int> DataTransformer<Dtype>::InferBlobShape(
 template <typename Dtype>
 void DataTransformer<Dtype>::InitRand() {
   const bool needs_rand = param_.mirror() ||
-      (phase_ == TRAIN && param_.crop_size());
+      (phase_ == TRAIN && (param_.crop_size() || mixes_batch() ||
+      param_.max_hue_rotation()));
   if (needs_rand) {
     const unsigned int rng_seed = caffe_rng_rand();
     rng_.reset(new Caffe::RNG(rng_seed));
@@ -833,6 +1003,23 @@ void DataTransformer<Dtype>::InitRand() {
   }
 }
 
+template <typename Dtype>
+void DataTransformer<Dtype>::SeedRand(unsigned int seed) {
+  if (rng_) {
+    static_cast<caffe::rng_t*>(rng_->generator())->seed(seed);
+  } else {
+    rng_.reset(new Caffe::RNG(seed));
+  }
+  // A different seed, the two sequences must not be the same.
+  caffe_rng()->seed(seed ^ 0x9e3779b9u);
+}
+
+template <typename Dtype>
+void DataTransformer<Dtype>::push_trace() {
+  trace_record_.sample = trace_sample_;
+  trace_->Push(trace_record_);
+}
+
 template <typename Dtype>
 int DataTransformer<Dtype>::Rand(int n) {
   CHECK(rng_);
@@ -848,21 +1035,55 @@ INSTANTIATE_CLASS(DataTransformer);
 template<typename Dtype>
 void DataTransformer<Dtype>::DatumToMat(const Datum* datum, cv::Mat& cv_img)
 {
-	int datum_channels = datum->channels();
-	int datum_height = datum->height();
-	int datum_width = datum->width();
+	DatumToMat(*datum, datum->data().data(), datum->data().size(), cv_img);
+}
+template<typename Dtype>
+void DataTransformer<Dtype>::DatumToMat(const Datum& datum, const char* data,
+	size_t size, cv::Mat& cv_img)
+{
+	if (datum.encoded())
+	{
+		CHECK(!(param_.force_color() && param_.force_gray()))
+			<< "cannot set both force_color and force_gray";
+		// imdecode only reads its input, wrap the bytes instead of copying them
+		cv::Mat encoded(1, static_cast<int>(size), CV_8UC1, const_cast<char*>(data));
+		int cv_read_flag = -1;
+		if (param_.force_color() || param_.force_gray())
+		{
+			cv_read_flag = param_.force_color() ? CV_LOAD_IMAGE_COLOR : CV_LOAD_IMAGE_GRAYSCALE;
+		}
+		cv_img = cv::imdecode(encoded, cv_read_flag);
+		CHECK(cv_img.data) << "Could not decode datum";
+		return;
+	}
+	int datum_channels = datum.channels();
+	int datum_height = datum.height();
+	int datum_width = datum.width();
 	int datum_size = datum_channels * datum_height * datum_width;
+	if (size == 0)
+	{
+		// float_data, the channels are wrapped in place and merged into a CV_32F image
+		CHECK_EQ(datum.float_data_size(), datum_size) << "Datum size does not match its shape";
+		float* float_data = const_cast<float*>(datum.float_data().data());
+		vector<cv::Mat> planes;
+		for (int c = 0; c < datum_channels; ++c)
+		{
+			planes.push_back(cv::Mat(datum_height, datum_width, CV_32FC1,
+				float_data + c * datum_height * datum_width));
+		}
+		cv::merge(planes, cv_img);
+		return;
+	}
+	CHECK_EQ(static_cast<int>(size), datum_size) << "Datum size does not match its shape";
 
-	std::string buffer(datum_size, ' ');
-	buffer = datum->data();
-
+	cv_img.create(datum_height, datum_width, CV_8UC(datum_channels));
 	for (int h = 0; h < datum_height; ++h) {
 		uchar* ptr = cv_img.ptr<uchar>(h);
 		int img_index = 0;
 		for (int w = 0; w < datum_width; ++w) {
 			for (int c = 0; c < datum_channels; ++c) {
 				int datum_index = (c * datum_height + h) * datum_width + w;
-				ptr[img_index++] = static_cast<uchar>(buffer[datum_index]);
+				ptr[img_index++] = static_cast<uchar>(data[datum_index]);
 			}
 		}
 	}
@@ -874,27 +1095,484 @@ void DataTransformer<Dtype>::MatToDatum(const cv::Mat& cv_img, Datum* datum)
 	datum->set_channels(cv_img.channels());
 	datum->set_height(cv_img.rows);
 	datum->set_width(cv_img.cols);
-	datum->clear_data();
 	datum->set_encoded(false);
 	int datum_channels = datum->channels();
 	int datum_height = datum->height();
 	int datum_width = datum->width();
 	int datum_size = datum_channels * datum_height * datum_width;
-	std::string buffer(datum_size, ' ');
+	// write straight into the datum, every byte is overwritten below
+	string* buffer = datum->mutable_data();
+	buffer->resize(datum_size);
+	char* datum_data = &(*buffer)[0];
 	for (int h = 0; h < datum_height; ++h) {
 		const uchar* ptr = cv_img.ptr<uchar>(h);
 		int img_index = 0;
 		for (int w = 0; w < datum_width; ++w) {
 			for (int c = 0; c < datum_channels; ++c) {
 				int datum_index = (c * datum_height + h) * datum_width + w;
-				buffer[datum_index] = static_cast<char>(ptr[img_index++]);
+				datum_data[datum_index] = static_cast<char>(ptr[img_index++]);
+			}
+		}
+	}
+}
+template<typename Dtype>
+void DataTransformer<Dtype>::MatToBlob(const cv::Mat& in_cv_img,
+	Blob<Dtype>* transformed_blob)
+{
+	// with aspect ratio buckets the image is first scaled to just cover the bucket
+	cv::Mat cv_img = in_cv_img;
+	if (bucket_height_)
+	{
+		resize_to_cover(cv_img, bucket_height_, bucket_width_);
+	}
+	const int crop_size = param_.crop_size();
+	const int crop_height = bucket_height_ ? bucket_height_ : crop_size;
+	const int crop_width = bucket_height_ ? bucket_width_ : crop_size;
+	const int img_channels = cv_img.channels();
+	const int img_height = cv_img.rows;
+	const int img_width = cv_img.cols;
+	const int channels = transformed_blob->channels();
+	const int height = transformed_blob->height();
+	const int width = transformed_blob->width();
+	const Dtype scale = param_.scale();
+	const bool do_mirror = param_.mirror() && Rand(2);
+	const bool has_mean_file = param_.has_mean_file();
+	const bool has_mean_values = mean_values_.size() > 0;
+
+	CHECK(cv_img.depth() == CV_8U || cv_img.depth() == CV_16U || cv_img.depth() == CV_32F)
+		<< "Image data type must be 8 or 16 bit unsigned, or float";
+	CHECK_EQ(channels, img_channels);
+	CHECK_GE(img_height, crop_height);
+	CHECK_GE(img_width, crop_width);
+
+	Dtype* mean = NULL;
+	if (has_mean_file) {
+		CHECK_EQ(img_channels, data_mean_.channels());
+		CHECK_EQ(img_height, data_mean_.height());
+		CHECK_EQ(img_width, data_mean_.width());
+		mean = data_mean_.mutable_cpu_data();
+	}
+	if (has_mean_values) {
+		CHECK(mean_values_.size() == 1 || mean_values_.size() == img_channels) <<
+			"Specify either 1 mean_value or as many as channels: " << img_channels;
+		if (img_channels > 1 && mean_values_.size() == 1) {
+			// Replicate the mean_value for simplicity
+			for (int c = 1; c < img_channels; ++c) {
+				mean_values_.push_back(mean_values_[0]);
+			}
+		}
+	}
+
+	int h_off = 0;
+	int w_off = 0;
+	if (crop_height) {
+		CHECK_EQ(crop_height, height);
+		CHECK_EQ(crop_width, width);
+		// We only do random crop when we do training.
+		if (phase_ == TRAIN) {
+			h_off = Rand(img_height - crop_height + 1);
+			w_off = Rand(img_width - crop_width + 1);
+		} else {
+			h_off = (img_height - crop_height) / 2;
+			w_off = (img_width - crop_width) / 2;
+		}
+	} else {
+		CHECK_EQ(img_height, height);
+		CHECK_EQ(img_width, width);
+	}
+	if (trace_)
+	{
+		trace_record_.ops |= do_mirror ? AUG_MIRROR : 0;
+		trace_record_.crop[0] = h_off;
+		trace_record_.crop[1] = w_off;
+		push_trace();
+	}
+
+	normalize_image(cv_img, h_off, w_off, height, width, mean, mean_values_,
+		scale, do_mirror, transformed_blob->mutable_cpu_data());
+}
+template<typename Dtype>
+vector<int> DataTransformer<Dtype>::InferBlobShape(const Datum& datum,
+	const char* data, size_t size)
+{
+	if (datum.encoded())
+	{
+		cv::Mat cv_img;
+		DatumToMat(datum, data, size, cv_img);
+		return InferBlobShape(cv_img);
+	}
+	return InferBlobShape(datum);
+}
+// Size of a JPEG (from its SOF marker) or PNG (from IHDR) image, without
+// decoding it. False for other formats and broken headers. The EXIF
+// orientation of JPEGs is not looked at.
+static bool EncodedImageSize(const uchar* p, size_t size, int* height, int* width)
+{
+	if (size >= 24 && memcmp(p, "\x89PNG\r\n\x1a\n", 8) == 0 && memcmp(p + 12, "IHDR", 4) == 0)
+	{
+		*width = (p[16] << 24) | (p[17] << 16) | (p[18] << 8) | p[19];
+		*height = (p[20] << 24) | (p[21] << 16) | (p[22] << 8) | p[23];
+		return *height > 0 && *width > 0;
+	}
+	if (size < 4 || p[0] != 0xFF || p[1] != 0xD8)
+	{
+		return false;
+	}
+	size_t i = 2;
+	while (i + 4 <= size && p[i] == 0xFF)
+	{
+		const uchar marker = p[i + 1];
+		if (marker == 0xFF)
+		{
+			// fill byte
+			++i;
+			continue;
+		}
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+		{
+			// no length
+			i += 2;
+			continue;
+		}
+		// SOF0 to SOF15, but for DHT, JPG and DAC in the same range
+		if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+		{
+			if (i + 9 > size)
+			{
+				return false;
+			}
+			*height = (p[i + 5] << 8) | p[i + 6];
+			*width = (p[i + 7] << 8) | p[i + 8];
+			return *height > 0 && *width > 0;
+		}
+		if (marker == 0xD9 || marker == 0xDA)
+		{
+			// image data before any frame header
+			return false;
+		}
+		i += 2 + ((p[i + 2] << 8) | p[i + 3]);
+	}
+	return false;
+}
+template<typename Dtype>
+void DataTransformer<Dtype>::InferImageSize(const Datum& datum,
+	const char* data, size_t size, int* height, int* width)
+{
+	if (!datum.encoded())
+	{
+		*height = datum.height();
+		*width = datum.width();
+		return;
+	}
+	if (EncodedImageSize(reinterpret_cast<const uchar*>(data), size, height, width))
+	{
+		return;
+	}
+	cv::Mat cv_img;
+	DatumToMat(datum, data, size, cv_img);
+	*height = cv_img.rows;
+	*width = cv_img.cols;
+}
+template<typename Dtype>
+void DataTransformer<Dtype>::DecodeResizedCrop(const Datum& datum,
+	const char* data, size_t size, cv::Mat& cv_img)
+{
+	int height = 0;
+	int width = 0;
+	cv::Mat region;
+	if (datum.encoded() && EncodedImageSize(reinterpret_cast<const uchar*>(data), size, &height, &width))
+	{
+		// the crop is drawn from the header, before anything is decoded
+		resized_crop_ = draw_resized_crop(height, width);
+		const int channels = param_.force_color() ? 3 : param_.force_gray() ? 1 : 0;
+		const int crop_size = param_.crop_size();
+		DecodeJpegRegion(data, size, resized_crop_, cv::Size(crop_size, crop_size), channels, &region);
+	}
+	if (!region.data)
+	{
+		// not a JPEG libjpeg-turbo can crop: the whole image, then its region
+		DatumToMat(datum, data, size, cv_img);
+		if (cv_img.rows != height || cv_img.cols != width)
+		{
+			resized_crop_ = draw_resized_crop(cv_img.rows, cv_img.cols);
+		}
+		region = cv_img(resized_crop_);
+	}
+	cv_img = resize_region(region, param_.crop_size());
+}
+template<typename Dtype>
+void DataTransformer<Dtype>::MultiCropMatToBlob(const cv::Mat& cv_img,
+	Blob<Dtype>* transformed_blob)
+{
+	const int crops = crops_per_image();
+	const int crop_size = param_.crop_size();
+	const int img_channels = cv_img.channels();
+	const int img_height = cv_img.rows;
+	const int img_width = cv_img.cols;
+	const Dtype scale = param_.scale();
+	const bool has_mean_file = param_.has_mean_file();
+	const bool has_mean_values = mean_values_.size() > 0;
+
+	CHECK(cv_img.depth() == CV_8U || cv_img.depth() == CV_16U || cv_img.depth() == CV_32F)
+		<< "Image data type must be 8 or 16 bit unsigned, or float";
+	CHECK_EQ(transformed_blob->num(), crops);
+	CHECK_EQ(transformed_blob->channels(), img_channels);
+	CHECK_EQ(transformed_blob->height(), crop_size);
+	CHECK_EQ(transformed_blob->width(), crop_size);
+	CHECK_GE(img_height, crop_size);
+	CHECK_GE(img_width, crop_size);
+
+	Dtype* mean = NULL;
+	if (has_mean_file) {
+		CHECK_EQ(img_channels, data_mean_.channels());
+		CHECK_EQ(img_height, data_mean_.height());
+		CHECK_EQ(img_width, data_mean_.width());
+		mean = data_mean_.mutable_cpu_data();
+	}
+	if (has_mean_values) {
+		CHECK(mean_values_.size() == 1 || mean_values_.size() == img_channels) <<
+			"Specify either 1 mean_value or as many as channels: " << img_channels;
+		if (img_channels > 1 && mean_values_.size() == 1) {
+			// Replicate the mean_value for simplicity
+			for (int c = 1; c < img_channels; ++c) {
+				mean_values_.push_back(mean_values_[0]);
+			}
+		}
+	}
+
+	// Normalize the whole image once into planar layout, the crops below
+	// are then plain row copies out of it.
+	crop_buffer_.resize(img_channels * img_height * img_width);
+	Dtype* planar = &crop_buffer_[0];
+	normalize_image(cv_img, 0, 0, img_height, img_width, mean, mean_values_,
+		scale, false, planar);
+
+	// center, top-left, top-right, bottom-left, bottom-right, then the same
+	// five mirrored; 2 crops are the center and its mirror
+	const int bottom = img_height - crop_size;
+	const int right = img_width - crop_size;
+	const int h_offs[5] = {bottom / 2, 0, 0, bottom, bottom};
+	const int w_offs[5] = {right / 2, 0, right, 0, right};
+	const int unmirrored = crops == 2 ? 1 : std::min(crops, 5);
+	Dtype* transformed_data = transformed_blob->mutable_cpu_data();
+	for (int k = 0; k < crops; ++k) {
+		const int h_off = h_offs[k % unmirrored];
+		const int w_off = w_offs[k % unmirrored];
+		const bool do_mirror = k >= unmirrored;
+		for (int c = 0; c < img_channels; ++c) {
+			for (int h = 0; h < crop_size; ++h) {
+				const Dtype* src = planar + (c * img_height + h_off + h) * img_width + w_off;
+				Dtype* dst = transformed_data + ((k * img_channels + c) * crop_size + h) * crop_size;
+				if (do_mirror) {
+					std::reverse_copy(src, src + crop_size, dst);
+				} else {
+					std::copy(src, src + crop_size, dst);
+				}
+			}
+		}
+		// 每个crop一条记录: 偏移、是否镜像及其序号
+		if (trace_)
+		{
+			trace_record_.ops = (trace_record_.ops & ~AUG_MIRROR) | (do_mirror ? AUG_MIRROR : 0);
+			trace_record_.crop[0] = h_off;
+			trace_record_.crop[1] = w_off;
+			trace_record_.crop_index = k;
+			trace_record_.crops = crops;
+			push_trace();
+		}
+	}
+}
+template<typename Dtype>
+int DataTransformer<Dtype>::ResizeStepAt(int64_t batches, int batch_size) const
+{
+	if (phase_ != TRAIN)
+	{
+		return -1;
+	}
+	// epochs over the images read by all the solvers
+	const double progress = param_.resize_epoch_size() ?
+		static_cast<double>(batches) * batch_size * Caffe::solver_count() / param_.resize_epoch_size() : batches;
+	int step = -1;
+	while (step + 1 < param_.resize_schedule_size() && param_.resize_schedule(step + 1).start() <= progress)
+	{
+		++step;
+	}
+	return step;
+}
+
+template<typename Dtype>
+bool DataTransformer<Dtype>::SetResizeProgress(int64_t batches, int batch_size)
+{
+	if (phase_ != TRAIN || param_.resize_schedule_size() == 0)
+	{
+		return false;
+	}
+	const int step = ResizeStepAt(batches, batch_size);
+	if (step == resize_step_)
+	{
+		return false;
+	}
+	// the steps up to this one, on top of the configured values
+	resize_step_ = step;
+	apply_resize_step(resize_base_);
+	for (int i = 0; i <= step; ++i)
+	{
+		apply_resize_step(param_.resize_schedule(i));
+	}
+	return true;
+}
+
+template<typename Dtype>
+void DataTransformer<Dtype>::apply_resize_step(const TransformationParameter::ResizeStep& step)
+{
+	if (step.has_crop_size())
+	{
+		param_.set_crop_size(step.crop_size());
+	}
+	if (step.has_min_side())
+	{
+		param_.set_min_side(step.min_side());
+		param_.set_min_side_min(0);
+		param_.set_min_side_max(0);
+	}
+	if (step.has_min_side_min())
+	{
+		param_.set_min_side(0);
+		param_.set_min_side_min(step.min_side_min());
+		param_.set_min_side_max(step.min_side_max());
+	}
+}
+
+template<typename Dtype>
+int DataTransformer<Dtype>::max_crop_size() const
+{
+	int crop_size = resize_base_.crop_size();
+	for (int i = 0; phase_ == TRAIN && i < param_.resize_schedule_size(); ++i)
+	{
+		crop_size = std::max<int>(crop_size, param_.resize_schedule(i).crop_size());
+	}
+	return crop_size;
+}
+
+template<typename Dtype>
+vector<int> DataTransformer<Dtype>::InferMixLabelShape(int num) const
+{
+	vector<int> shape(2, num);
+	shape[1] = param_.mix_num_classes() > 0 ? param_.mix_num_classes() : 2;
+	return shape;
+}
+/* 整个batch做MixUp/CutMix: 随机两两配对, 每对样本一次遍历同时完成混合, 不需要额外拷贝batch */
+template<typename Dtype>
+void DataTransformer<Dtype>::MixBatch(Blob<Dtype>* batch, const Dtype* labels,
+	Blob<Dtype>* mix_label)
+{
+	const int num = batch->num();
+	const int channels = batch->channels();
+	const int height = batch->height();
+	const int width = batch->width();
+	const int dim = batch->count(1);
+	const float mixup_alpha = param_.mixup_alpha();
+	const float cutmix_alpha = param_.cutmix_alpha();
+	const int num_classes = param_.mix_num_classes();
+	CHECK_EQ(mix_label->num(), num);
+
+	Dtype* data = batch->mutable_cpu_data();
+	Dtype* mix = mix_label->mutable_cpu_data();
+	caffe_set(mix_label->count(), Dtype(0), mix);
+	// Unpaired and unmixed items keep their own label.
+	vector<float> lambda(num, 1.f);
+	vector<int> partner(num);
+	for (int i = 0; i < num; ++i)
+	{
+		partner[i] = i;
+	}
+
+	vector<int> order(partner);
+	caffe::rng_t* rng = phase_ == TRAIN ? static_cast<caffe::rng_t*>(rng_->generator()) : NULL;
+	if (rng)
+	{
+		shuffle(order.begin(), order.end(), rng);
+	}
+	boost::uniform_real<float> uniform(0.f, 1.f);
+	// MixUp: copy of the first item of the pair, overwritten first
+	vector<Dtype> saved;
+	for (int i = 0; rng && i + 1 < num; i += 2)
+	{
+		const int a = order[i];
+		const int b = order[i + 1];
+		if (uniform(*rng) >= param_.mix_probability())
+		{
+			continue;
+		}
+		partner[a] = b;
+		partner[b] = a;
+		Dtype* pa = data + a * dim;
+		Dtype* pb = data + b * dim;
+		const bool cutmix = cutmix_alpha > 0 && (mixup_alpha <= 0 || Rand(2));
+		if (cutmix)
+		{
+			// swap the same box between a and b, lambda is the area kept
+			const float cut = sqrt(1.f - RandBeta(cutmix_alpha));
+			const int cy = Rand(height);
+			const int cx = Rand(width);
+			const int y0 = std::max(cy - int(height * cut / 2), 0);
+			const int y1 = std::min(cy + int(height * cut / 2), height);
+			const int x0 = std::max(cx - int(width * cut / 2), 0);
+			const int x1 = std::min(cx + int(width * cut / 2), width);
+			for (int c = 0; c < channels; ++c)
+			{
+				for (int y = y0; y < y1; ++y)
+				{
+					const int offset = (c * height + y) * width;
+					std::swap_ranges(pa + offset + x0, pa + offset + x1, pb + offset + x0);
+				}
 			}
+			lambda[a] = lambda[b] = 1.f - float((y1 - y0) * (x1 - x0)) / (height * width);
+		}
+		else
+		{
+			// every item of the pair draws its own lambda
+			lambda[a] = RandBeta(mixup_alpha);
+			lambda[b] = RandBeta(mixup_alpha);
+			const Dtype la = lambda[a];
+			const Dtype lb = lambda[b];
+			// a = la * a + (1 - la) * b, b = lb * b + (1 - lb) * a, 用BLAS的axpby
+			saved.assign(pa, pa + dim);
+			caffe_cpu_axpby(dim, Dtype(1 - la), pb, la, pa);
+			caffe_cpu_axpby(dim, Dtype(1 - lb), &saved[0], lb, pb);
+		}
+	}
+
+	for (int i = 0; i < num; ++i)
+	{
+		if (num_classes > 0)
+		{
+			const int own = static_cast<int>(labels[i]);
+			const int other = static_cast<int>(labels[partner[i]]);
+			CHECK_LT(own, num_classes) << "label exceeds mix_num_classes";
+			CHECK_LT(other, num_classes) << "label exceeds mix_num_classes";
+			mix[i * num_classes + own] += lambda[i];
+			mix[i * num_classes + other] += 1.f - lambda[i];
+		}
+		else
+		{
+			mix[i * 2] = labels[partner[i]];
+			mix[i * 2 + 1] = lambda[i];
 		}
 	}
-	datum->set_data(buffer);
 }
 template<typename Dtype>
-void DataTransformer<Dtype>::CVMatTransform(cv::Mat& in_out_cv_img)
+float DataTransformer<Dtype>::RandBeta(float alpha)
+{
+	caffe::rng_t* rng = static_cast<caffe::rng_t*>(rng_->generator());
+	boost::random::gamma_distribution<float> gamma(alpha);
+	const float x = gamma(*rng);
+	const float y = gamma(*rng);
+	return x + y > 0 ? x / (x + y) : 1.f;
+}
+/* 预先抽取本样本要做的增强(按apply_probability), 返回AugmentationOp的组合, 为0时可以跳过CVMatTransform */
+template<typename Dtype>
+int DataTransformer<Dtype>::DrawAugmentations()
 {
 	const float apply_prob = 1.f - param_.apply_probability();
 	const float max_smooth = param_.max_smooth();
@@ -903,41 +1581,116 @@ void DataTransformer<Dtype>::CVMatTransform(cv::Mat& in_out_cv_img)
 	const float max_contrast = param_.max_contrast();
 	const int max_brightness_shift = param_.max_brightness_shift();
 	const int max_color_shift = param_.max_color_shift();
+	const int max_hue_rotation = param_.max_hue_rotation();
+	const float min_saturation = param_.min_saturation();
+	const float max_saturation = param_.max_saturation();
 	const int min_side_min = param_.min_side_min();
 	const int min_side_max = param_.min_side_max();
 	const int min_side = param_.min_side();
 	const float affine_min_scale = param_.affine_min_scale();
 	const float affine_max_scale = param_.affine_max_scale();
-	const float random_erasing_low = param_.random_erasing_low();
-	const float random_erasing_high = param_.random_erasing_high();
-	const float random_erasing_ratio = param_.random_erasing_ratio();
-	const bool debug_params = param_.debug_params();
 
+	int ops = 0;
 	float current_prob = 0.f;
 	caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
-	const bool do_smooth = param_.smooth_filtering() && phase_ == TRAIN && max_smooth > 1 && current_prob > apply_prob;
+	if (param_.smooth_filtering() && phase_ == TRAIN && max_smooth > 1 && current_prob > apply_prob)
+		ops |= AUG_SMOOTH;
 	caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
-	const bool do_rotation = rotation_angle > 0 && current_prob > apply_prob && phase_ == TRAIN;
+	if (rotation_angle > 0 && current_prob > apply_prob && phase_ == TRAIN)
+		ops |= AUG_ROTATION;
 	caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
-	const bool do_brightness = param_.contrast_brightness_adjustment() && min_contrast > 0 && max_contrast >= min_contrast
-		&& max_brightness_shift >= 0 && phase_ == TRAIN && current_prob > apply_prob;
+	if (param_.contrast_brightness_adjustment() && min_contrast > 0 && max_contrast >= min_contrast
+		&& max_brightness_shift >= 0 && phase_ == TRAIN && current_prob > apply_prob)
+		ops |= AUG_BRIGHTNESS;
 	caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
-	const bool do_color_shift = max_color_shift > 0 && phase_ == TRAIN && current_prob > apply_prob;
+	if (max_color_shift > 0 && phase_ == TRAIN && current_prob > apply_prob)
+		ops |= AUG_COLOR_SHIFT;
 	caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
-	const bool do_resize_to_min_side_min_max = min_side_min > 0 && min_side_max > min_side_min && phase_ == TRAIN && current_prob > apply_prob;
-	const bool do_resize_to_min_side = min_side > 0 && phase_ == TRAIN && current_prob > apply_prob;
+	if (min_side_min > 0 && min_side_max > min_side_min && phase_ == TRAIN && current_prob > apply_prob)
+		ops |= AUG_MIN_SIDE_MIN_MAX;
+	if (min_side > 0 && phase_ == TRAIN && current_prob > apply_prob)
+		ops |= AUG_MIN_SIDE;
 	caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
-	const bool do_affine = affine_min_scale > 0 && affine_max_scale > affine_min_scale && phase_ == TRAIN && current_prob > apply_prob;
+	if (affine_min_scale > 0 && affine_max_scale > affine_min_scale && phase_ == TRAIN && current_prob > apply_prob)
+		ops |= AUG_AFFINE;
 	caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
-	const bool do_random_erasing = param_.random_erasing_ratio() > 0 && param_.random_erasing_high() > param_.random_erasing_low()
-		&& param_.random_erasing_low() > 0 && phase_ == TRAIN && current_prob > apply_prob;
+	if (param_.random_erasing_ratio() > 0 && param_.random_erasing_high() > param_.random_erasing_low()
+		&& param_.random_erasing_low() > 0 && phase_ == TRAIN && current_prob > apply_prob)
+		ops |= AUG_RANDOM_ERASING;
+	// drawn only when configured, so that the other draws stay as they were
+	if (max_hue_rotation > 0 && phase_ == TRAIN)
+	{
+		caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
+		if (current_prob > apply_prob)
+			ops |= AUG_HUE;
+	}
+	if (max_saturation > min_saturation && min_saturation >= 0 && phase_ == TRAIN)
+	{
+		caffe_rng_uniform(1, 0.f, 1.f, &current_prob);
+		if (current_prob > apply_prob)
+			ops |= AUG_SATURATION;
+	}
+	// every image, without a draw, as torchvision's RandomResizedCrop
+	if (param_.resized_crop_min_area() > 0 && phase_ == TRAIN)
+	{
+		ops |= AUG_RESIZED_CROP;
+	}
+	if (trace_)
+	{
+		// CVMatTransform fills the record, start afresh in case it is skipped
+		trace_record_ = AugmentationRecord();
+	}
+	return ops;
+}
+template<typename Dtype>
+void DataTransformer<Dtype>::CVMatTransform(cv::Mat& cv_img)
+{
+	CVMatTransform(cv_img, DrawAugmentations());
+}
+template<typename Dtype>
+void DataTransformer<Dtype>::CVMatTransform(cv::Mat& in_out_cv_img, int ops)
+{
+	const float max_smooth = param_.max_smooth();
+	const int rotation_angle = param_.max_rotation_angle();
+	const float min_contrast = param_.min_contrast();
+	const float max_contrast = param_.max_contrast();
+	const int max_brightness_shift = param_.max_brightness_shift();
+	const int max_color_shift = param_.max_color_shift();
+	const int max_hue_rotation = param_.max_hue_rotation();
+	const float min_saturation = param_.min_saturation();
+	const float max_saturation = param_.max_saturation();
+	const int min_side_min = param_.min_side_min();
+	const int min_side_max = param_.min_side_max();
+	const int min_side = param_.min_side();
+	const float random_erasing_low = param_.random_erasing_low();
+	const float random_erasing_high = param_.random_erasing_high();
+	const float random_erasing_ratio = param_.random_erasing_ratio();
+	const bool debug_params = param_.debug_params();
+
+	float current_prob = 0.f;
+	const bool do_smooth = (ops & AUG_SMOOTH) != 0;
+	const bool do_rotation = (ops & AUG_ROTATION) != 0;
+	const bool do_brightness = (ops & AUG_BRIGHTNESS) != 0;
+	const bool do_color_shift = (ops & AUG_COLOR_SHIFT) != 0;
+	const bool do_hue = (ops & AUG_HUE) != 0;
+	const bool do_saturation = (ops & AUG_SATURATION) != 0;
+	const bool do_resize_to_min_side_min_max = (ops & AUG_MIN_SIDE_MIN_MAX) != 0;
+	const bool do_resize_to_min_side = (ops & AUG_MIN_SIDE) != 0;
+	const bool do_affine = (ops & AUG_AFFINE) != 0;
+	const bool do_random_erasing = (ops & AUG_RANDOM_ERASING) != 0;
+	const bool do_resized_crop = (ops & AUG_RESIZED_CROP) != 0;
 
 	cv::Mat cv_img = in_out_cv_img;
+	/* 随机缩放裁剪, 之后的增强都在crop_size大小的图上做 */
+	if (do_resized_crop)
+	{
+		resized_crop(cv_img);
+	}
 	/* 随机擦除Random-Erasing */
-	cv::Scalar erase_mean = cv::mean(cv_img);
 	cv::Rect erase_rect;
 	if (do_random_erasing)
 	{
+		cv::Scalar erase_mean = cv::mean(cv_img);
 		int area = cv_img.cols * cv_img.rows;
 		caffe_rng_uniform(1, random_erasing_low, random_erasing_high, &current_prob);
 		float target_area = current_prob * area;
@@ -952,7 +1705,7 @@ void DataTransformer<Dtype>::CVMatTransform(cv::Mat& in_out_cv_img)
 			caffe_rng_uniform(1, 0.f, 1.f * (cv_img.cols - erase_weight), &erase_x);
 			caffe_rng_uniform(1, 0.f, 1.f * (cv_img.rows - erase_height), &erase_y);
 			erase_rect = cv::Rect(erase_x, erase_y, erase_weight, erase_height);
-			if (3 == cv_img.channels())
+			if (3 == cv_img.channels() && cv_img.depth() == CV_8U)
 			{
 				cv::Mat_<cv::Vec3b> img_test = cv_img;
 				for (size_t i = erase_x; i < erase_x + erase_weight; i++)
@@ -965,38 +1718,71 @@ void DataTransformer<Dtype>::CVMatTransform(cv::Mat& in_out_cv_img)
 			}
 			else
 			{
-				cv_img(erase_rect) = erase_mean.val[0];
+				cv_img(erase_rect).setTo(erase_mean);
 			}
 		}
 	}
 
+	// hue and saturation go with the color shift and contrast/brightness
+	// into a single fixed-point color matrix pass, see color_transform
+	const bool fuse_color = (do_hue || do_saturation) && cv_img.channels() == 3;
+	// color shift and brightness are given for 8 bit pixels
+	const double pixel_scale = pixel_range_scale(cv_img.depth(), param_.float_range());
+
 	// apply color shift
+	int color_shift[3] = {0, 0, 0};
 	if (do_color_shift)
 	{
 		int b = Rand(max_color_shift + 1);
 		int g = Rand(max_color_shift + 1);
 		int r = Rand(max_color_shift + 1);
 		int sign = Rand(2);
-		cv::Mat shiftArr = cv_img.clone();
-		shiftArr.setTo(cv::Scalar(b, g, r));
-		if (sign == 1)
-		{
-			cv_img -= shiftArr;
-		}
-		else
+		color_shift[0] = sign == 1 ? -b : b;
+		color_shift[1] = sign == 1 ? -g : g;
+		color_shift[2] = sign == 1 ? -r : r;
+		if (!fuse_color)
 		{
-			cv_img += shiftArr;
+			cv::Mat shiftArr = cv_img.clone();
+			shiftArr.setTo(cv::Scalar(b, g, r) * pixel_scale);
+			if (sign == 1)
+			{
+				cv_img -= shiftArr;
+			}
+			else
+			{
+				cv_img += shiftArr;
+			}
 		}
 	}
 
 	// set contrast and brightness
-	float alpha;
-	int beta;
+	float alpha = 1.f;
+	int beta = 0;
 	if (do_brightness)
 	{
 		caffe_rng_uniform(1, min_contrast, max_contrast, &alpha);
 		beta = Rand(max_brightness_shift * 2 + 1) - max_brightness_shift;
-		cv_img.convertTo(cv_img, -1, alpha, beta);
+		if (!fuse_color)
+		{
+			cv_img.convertTo(cv_img, -1, alpha, beta * pixel_scale);
+		}
+	}
+
+	/* 色调旋转、饱和度缩放 */
+	int hue = 0;
+	float saturation = 1.f;
+	if (fuse_color)
+	{
+		if (do_hue)
+		{
+			hue = Rand(max_hue_rotation * 2 + 1) - max_hue_rotation;
+		}
+		if (do_saturation)
+		{
+			caffe_rng_uniform(1, min_saturation, max_saturation, &saturation);
+		}
+		const cv::Scalar shift(color_shift[0], color_shift[1], color_shift[2]);
+		color_transform(cv_img, color_matrix(shift * pixel_scale, alpha, beta * pixel_scale, hue, saturation));
 	}
 
 	// set smoothness
@@ -1015,7 +1801,7 @@ void DataTransformer<Dtype>::CVMatTransform(cv::Mat& in_out_cv_img)
 			cv::blur(cv_img, cv_img, cv::Size(smooth_param, smooth_param));
 			break;
 		case 2:
-			cv::medianBlur(cv_img, cv_img, smooth_param);
+			cv::medianBlur(cv_img, cv_img, cv_img.depth() == CV_8U ? smooth_param : std::min(smooth_param, 5));
 			break;
 		case 3:
 			cv::boxFilter(cv_img, cv_img, -1, cv::Size(smooth_param * 2, smooth_param * 2));
@@ -1028,31 +1814,27 @@ void DataTransformer<Dtype>::CVMatTransform(cv::Mat& in_out_cv_img)
 	const int img_height = cv_img.rows;
 	const int img_width = cv_img.cols;
 
-	CHECK(cv_img.depth() == CV_8U) << "Image data type must be unsigned byte";
+	CHECK(cv_img.depth() == CV_8U || cv_img.depth() == CV_16U || cv_img.depth() == CV_32F)
+		<< "Image data type must be 8 or 16 bit unsigned, or float";
 
 	// resizing and crop according to min side, preserving aspect ratio
+	cv::Rect side_crop;
 	if (do_resize_to_min_side)
 	{
-		random_crop(cv_img, min_side);
+		side_crop = random_crop(cv_img, min_side);
 	}
 	if (do_resize_to_min_side_min_max)
 	{
 		int min_side_length = min_side_min + Rand(min_side_max - min_side_min + 1);
 		resize(cv_img, min_side_max);
-		random_crop(cv_img, min_side_length);
+		side_crop = random_crop(cv_img, min_side_length);
 	}
 	/* 仿射变换 */
 	float affine_angle = 0.f;
 	float affine_scale = 0.f;
 	if (do_affine)
 	{
-		cv::Point2f affine_center = cv::Point2f(cv_img.rows / 2, cv_img.cols / 2);
-		affine_angle = 1.0 * Rand(rotation_angle * 2 + 1) - rotation_angle;
-		affine_scale = affine_min_scale + Rand((affine_max_scale - affine_min_scale) * 10) / 10.f;
-		cv::Mat affine_matrix = cv::getRotationMatrix2D(affine_center, affine_angle, affine_scale);
-		cv::Size dize = cv::Size(cv_img.rows * (affine_min_scale + Rand((affine_max_scale - affine_min_scale) * 10) / 10.f),
-			cv_img.cols * (affine_min_scale + Rand((affine_max_scale - affine_min_scale) * 10) / 10.f));
-		cv::warpAffine(cv_img, cv_img, affine_matrix, dize);
+		random_affine(cv_img, rotation_angle, affine_angle, affine_scale);
 	}
 	/* 旋转操作 */
 	int current_angle = 0;
@@ -1061,7 +1843,74 @@ void DataTransformer<Dtype>::CVMatTransform(cv::Mat& in_out_cv_img)
 		current_angle = Rand(rotation_angle * 2 + 1) - rotation_angle;
 		if (current_angle)
 		{
-			rotate(cv_img, current_angle);
+			warp_rotate(cv_img, current_angle);
+		}
+	}
+
+	/* 记录本样本所用的增强参数, crop与mirror确定后写入trace */
+	if (trace_)
+	{
+		AugmentationRecord& record = trace_record_;
+		record = AugmentationRecord();
+		if (do_smooth)
+		{
+			record.ops |= AUG_SMOOTH;
+			record.smooth_type = smooth_type;
+			record.smooth_kernel = smooth_param;
+		}
+		if (do_rotation && !do_affine)
+		{
+			record.ops |= AUG_ROTATION;
+			record.angle = current_angle;
+		}
+		if (do_brightness)
+		{
+			record.ops |= AUG_BRIGHTNESS;
+			record.alpha = alpha;
+			record.beta = beta;
+		}
+		if (do_color_shift)
+		{
+			record.ops |= AUG_COLOR_SHIFT;
+			for (int c = 0; c < 3; ++c)
+			{
+				record.color_shift[c] = color_shift[c];
+			}
+		}
+		if (do_resize_to_min_side_min_max || do_resize_to_min_side)
+		{
+			record.ops |= do_resize_to_min_side ? AUG_MIN_SIDE : AUG_MIN_SIDE_MIN_MAX;
+			record.side_crop[0] = side_crop.x;
+			record.side_crop[1] = side_crop.y;
+			record.side_crop[2] = side_crop.width;
+		}
+		if (do_affine)
+		{
+			record.ops |= AUG_AFFINE;
+			record.angle = affine_angle;
+			record.affine_scale = affine_scale;
+		}
+		if (fuse_color)
+		{
+			record.ops |= (do_hue ? AUG_HUE : 0) | (do_saturation ? AUG_SATURATION : 0);
+			record.hue = hue;
+			record.saturation = saturation;
+		}
+		if (erase_rect.area() > 0)
+		{
+			record.ops |= AUG_RANDOM_ERASING;
+			record.erase[0] = erase_rect.x;
+			record.erase[1] = erase_rect.y;
+			record.erase[2] = erase_rect.width;
+			record.erase[3] = erase_rect.height;
+		}
+		if (do_resized_crop)
+		{
+			record.ops |= AUG_RESIZED_CROP;
+			record.resized_crop[0] = resized_crop_.x;
+			record.resized_crop[1] = resized_crop_.y;
+			record.resized_crop[2] = resized_crop_.width;
+			record.resized_crop[3] = resized_crop_.height;
 		}
 	}
 
@@ -1102,6 +1951,11 @@ void DataTransformer<Dtype>::CVMatTransform(cv::Mat& in_out_cv_img)
 			LOG(INFO) << "* parameter for affine transformation: ";
 			LOG(INFO) << "affine_angle: " << affine_angle << ", affine_scale: " << affine_scale;
 		}
+		if (fuse_color)
+		{
+			LOG(INFO) << "* parameter for hue and saturation: ";
+			LOG(INFO) << "  hue: " << hue << ", saturation: " << saturation;
+		}
 		if (do_random_erasing)
 		{
 			LOG(INFO) << "* parameter for random erasing: ";
@@ -1116,6 +1970,7 @@ void DataTransformer<Dtype>::CVMatTransform(cv::Mat& in_out_cv_img)
 		cv::resize(cv_img, cv_img, cv::Size(img_width, img_height));
 	}
 	in_out_cv_img = cv_img;
+	resized_crop_ = cv::Rect();
 }
 /* End Added by garylau, for lmdb data augmentation, 2017.12.11 */
 
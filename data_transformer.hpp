@@ -6,6 +6,8 @@
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/augmentation_trace.hpp"
+#include "caffe/util/remap_cache.hpp"
 
 namespace caffe {
 
@@ -24,6 +26,19 @@ class DataTransformer {
    *    transformation.
    */
   void InitRand();
+  /**
+   * @brief Reseeds the random number generation of the transformation on
+   *    the calling thread, the generator of the transformer and the Caffe
+   *    one caffe_rng_uniform draws from, so that what the next image gets
+   *    only depends on seed.
+   */
+  void SeedRand(unsigned int seed);
+  /**
+   * @brief Sets the input the next records of transform_param.trace_file
+   *    are for: the position of the datum in the DB for the Data layer, the
+   *    line of the image in the source list for the ImageData layer.
+   */
+  inline void set_trace_sample(uint64_t sample) { trace_sample_ = sample; }
 
   /**
    * @brief Applies the transformation defined in the data layer's
@@ -137,25 +152,169 @@ class DataTransformer {
    *    A uniformly random integer value from ({0, 1, ..., n-1}).
    */
   virtual int Rand(int n);
+  // Draws from Beta(alpha, alpha), for MixBatch.
+  float RandBeta(float alpha);
 
   void Transform(const Datum& datum, Dtype* transformed_data);
+  void Transform(const Datum& datum, const char* data, size_t data_size,
+                 Dtype* transformed_data);
   // Tranformation parameters
   TransformationParameter param_;
 
   /* Begin Added by garylau, for data augmentation, 2017.11.29 */
-  void random_crop(cv::Mat& cv_img, int crop_size);
+  cv::Rect random_crop(cv::Mat& cv_img, int crop_size);
   /* End Added by garylau, for data augmentation, 2017.11.29 */
+  // resized_crop_min_area: the region of a random resized crop, in source
+  // coordinates, and the crop itself unless DecodeResizedCrop did it.
+  cv::Rect draw_resized_crop(int img_height, int img_width);
+  void resized_crop(cv::Mat& cv_img);
+  // Rotation and affine warps, through remap_cache_ when it is enabled.
+  void warp_rotate(cv::Mat& cv_img, int angle);
+  void random_affine(cv::Mat& cv_img, int rotation_angle,
+      float& affine_angle, float& affine_scale);
 
   shared_ptr<Caffe::RNG> rng_;
   Phase phase_;
   Blob<Dtype> data_mean_;
   vector<Dtype> mean_values_;
+  // Set when transform_param.trace_file is, see augmentation_trace.hpp.
+  // The record is filled by CVMatTransform and pushed by MatToBlob.
+  shared_ptr<AugmentationTrace> trace_;
+  AugmentationRecord trace_record_;
+  uint64_t trace_sample_;
+  // Writes trace_record_ for trace_sample_.
+  void push_trace();
+  // Normalized image shared by the crops of MultiCropMatToBlob.
+  vector<Dtype> crop_buffer_;
+  // Set when transform_param.remap_cache_mb is, see remap_cache.hpp.
+  shared_ptr<RemapCache> remap_cache_;
+  // Output shape set by set_bucket, 0 x 0 when not bucketing.
+  int bucket_height_;
+  int bucket_width_;
+  // resize_schedule: the configured crop_size and min_side parameters, as a
+  // step, and the step in effect (-1 before the first).
+  TransformationParameter::ResizeStep resize_base_;
+  int resize_step_;
+  void apply_resize_step(const TransformationParameter::ResizeStep& step);
+  // Region of the random resized crop of the image being transformed, empty
+  // until it is drawn.
+  cv::Rect resized_crop_;
 
   /* Begin Added by garylau, for lmdb data augmentation, 2017.12.11 */
  public:
   void DatumToMat(const Datum* datum, cv::Mat& cv_img);
   void MatToDatum(const cv::Mat& cv_img, Datum* datum);
   void CVMatTransform(cv::Mat& cv_img);
+
+  /**
+   * @brief Draws which augmentations (apply_probability) the next image
+   *    gets, as a combination of AugmentationOp. CVMatTransform(cv::Mat&)
+   *    draws them itself; drawing them first lets callers skip the cv::Mat
+   *    round trip altogether when none fires.
+   */
+  int DrawAugmentations();
+  /**
+   * @brief CVMatTransform with the augmentations drawn by DrawAugmentations.
+   */
+  void CVMatTransform(cv::Mat& cv_img, int ops);
+  /**
+   * @brief Crops, mirrors, subtracts the mean and scales a raw (not encoded)
+   *    datum whose image bytes are passed separately, in one pass from
+   *    the bytes to transformed_blob; float_data datums are passed with no
+   *    bytes (data_size 0). The path for images no augmentation applies to.
+   */
+  void Transform(const Datum& datum, const char* data, size_t data_size,
+                 Blob<Dtype>* transformed_blob);
+
+  /**
+   * @brief Same as DatumToMat(const Datum*, cv::Mat&), with the image bytes
+   *    passed separately so that they can alias the DB value the datum was
+   *    read from (see DatumRecord). Encoded datums are decoded in place,
+   *    16 bit PNGs to CV_16U; float_data datums (size 0) become CV_32F.
+   */
+  void DatumToMat(const Datum& datum, const char* data, size_t size,
+                  cv::Mat& cv_img);
+  /**
+   * @brief Crops, mirrors, subtracts the mean and scales an augmented
+   *    image straight into transformed_blob, like Transform(const Datum&,
+   *    Blob<Dtype>*) would after MatToDatum, without the Datum round trip.
+   *    8 and 16 bit unsigned and float images are supported.
+   */
+  void MatToBlob(const cv::Mat& cv_img, Blob<Dtype>* transformed_blob);
+  /**
+   * @brief Infers the blob shape of a datum whose image bytes are passed
+   *    separately, see DatumToMat(const Datum&, const char*, size_t, cv::Mat&).
+   */
+  vector<int> InferBlobShape(const Datum& datum, const char* data,
+                             size_t size);
+  /**
+   * @brief Height and width of the image of a datum whose image bytes are
+   *    passed separately. JPEG and PNG sizes are read from their headers,
+   *    other encoded images are decoded.
+   */
+  void InferImageSize(const Datum& datum, const char* data, size_t size,
+                      int* height, int* width);
+  /**
+   * @brief Decodes the random resized crop (resized_crop_min_area) of an
+   *    encoded datum straight to crop_size x crop_size. The region is drawn
+   *    from the image size in the JPEG or PNG header, and only it is decoded
+   *    from JPEGs (see DecodeJpegRegion), the whole image otherwise. Pass the
+   *    result to CVMatTransform, which then does not crop it again.
+   */
+  void DecodeResizedCrop(const Datum& datum, const char* data, size_t size,
+                         cv::Mat& cv_img);
+  /**
+   * @brief Makes MatToBlob output height x width images instead of
+   *    crop_size ones, (0, 0) going back to crop_size; for the aspect ratio
+   *    buckets of DataLayer. Images are scaled to just cover the bucket and
+   *    then cropped, and the min_side crops take its aspect ratio.
+   */
+  inline void set_bucket(int height, int width) {
+    bucket_height_ = height;
+    bucket_width_ = width;
+  }
+  /**
+   * @brief Moves to the step of resize_schedule reached after batches
+   *    batches of batch_size images, in TRAIN phase. Returns whether the
+   *    crop_size and min_side parameters changed; callers reshape then.
+   */
+  bool SetResizeProgress(int64_t batches, int batch_size);
+  inline int resize_step() const { return resize_step_; }
+  // Step of resize_schedule SetResizeProgress moves to, -1 before the first.
+  int ResizeStepAt(int64_t batches, int batch_size) const;
+  // Largest crop_size of the resize_schedule, to size buffers up front.
+  int max_crop_size() const;
+  /**
+   * @brief Batch-level MixUp/CutMix (mixup_alpha, cutmix_alpha) in place on a
+   *    packed batch. Items are paired at random and both items of a pair are
+   *    blended in a single pass, so the batch is not copied. mix_label gets
+   *    per item the label of its partner and the weight of its own label, or
+   *    the mixed one-hot label when mix_num_classes is set. Outside of TRAIN
+   *    phase the batch is left as is and every item is its own partner.
+   */
+  void MixBatch(Blob<Dtype>* batch, const Dtype* labels,
+                Blob<Dtype>* mix_label);
+  inline bool mixes_batch() const {
+    return param_.mixup_alpha() > 0 || param_.cutmix_alpha() > 0;
+  }
+  // Shape of the mix_label blob of MixBatch.
+  vector<int> InferMixLabelShape(int num) const;
+  /**
+   * @brief Number of items Transform produces per image: test_crops in TEST
+   *    phase (see MultiCropMatToBlob), 1 otherwise.
+   */
+  inline int crops_per_image() const {
+    return phase_ == TEST ? param_.test_crops() : 1;
+  }
+  // The mean_file, empty without. MatToBlob needs images of its size.
+  inline const Blob<Dtype>& data_mean() const { return data_mean_; }
+  /**
+   * @brief Packs the crops_per_image() test crops of an image (center,
+   *    corners and their mirrors) into the consecutive items of
+   *    transformed_blob. The image is normalized once for all of them.
+   */
+  void MultiCropMatToBlob(const cv::Mat& cv_img,
+                          Blob<Dtype>* transformed_blob);
   /* End Added by garylau, for lmdb data augmentation, 2017.12.11 */
 };
 
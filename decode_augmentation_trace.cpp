@@ -0,0 +1,108 @@
+// This program decodes an augmentation trace written by DataTransformer
+// when transform_param.trace_file is set, one tab separated line per sample,
+// starting with the input it comes from (see AugmentationRecord::sample).
+// Usage:
+//    decode_augmentation_trace [FLAGS] TRACE_FILE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "caffe/util/augmentation_trace.hpp"
+
+using namespace caffe;  // NOLINT(build/namespaces)
+
+DEFINE_bool(summary, false,
+    "Only print how many samples each augmentation was applied to.");
+
+static const char* kOpNames[] = {"smooth", "rotation", "brightness",
+    "color_shift", "min_side_min_max", "min_side", "affine", "random_erasing",
+    "mirror", "hue", "saturation", "resized_crop"};
+static const int kNumOps = sizeof(kOpNames) / sizeof(kOpNames[0]);
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  // Print output to stderr (while still logging)
+  FLAGS_alsologtostderr = 1;
+
+#ifndef GFLAGS_GFLAGS_H_
+  namespace gflags = google;
+#endif
+
+  gflags::SetUsageMessage("Decode an augmentation trace written with "
+        "transform_param.trace_file\n"
+        "Usage:\n"
+        "    decode_augmentation_trace [FLAGS] TRACE_FILE\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (argc != 2) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0],
+        "tools/decode_augmentation_trace");
+    return 1;
+  }
+
+  FILE* file = fopen(argv[1], "rb");
+  CHECK(file) << "Failed to open " << argv[1];
+  AugmentationTraceHeader header;
+  CHECK_EQ(fread(&header, sizeof(header), 1, file), size_t(1))
+      << "Truncated trace header";
+  CHECK_EQ(memcmp(header.magic, kAugmentationTraceMagic,
+      sizeof(header.magic)), 0) << argv[1] << " is not an augmentation trace";
+  CHECK_EQ(header.version, kAugmentationTraceVersion)
+      << "Unsupported trace version";
+  CHECK_EQ(header.record_size,
+      static_cast<uint32_t>(sizeof(AugmentationRecord)))
+      << "Unexpected record size";
+
+  if (!FLAGS_summary) {
+    printf("sample\tops\tangle\tsmooth_type\tsmooth_kernel\talpha\tbeta"
+        "\tcolor_shift\taffine_scale\terase\tside_crop\tcrop\thue"
+        "\tsaturation\tresized_crop\ttest_crop\n");
+  }
+  uint64_t count = 0;
+  uint64_t op_count[kNumOps] = {0};
+  AugmentationRecord r;
+  while (fread(&r, sizeof(r), 1, file) == 1) {
+    ++count;
+    for (int i = 0; i < kNumOps; ++i) {
+      if (r.ops & (1 << i)) {
+        ++op_count[i];
+      }
+    }
+    if (FLAGS_summary) {
+      continue;
+    }
+    string ops;
+    for (int i = 0; i < kNumOps; ++i) {
+      if (r.ops & (1 << i)) {
+        ops += (ops.empty() ? "" : ",") + string(kOpNames[i]);
+      }
+    }
+    printf("%llu\t%s\t%d\t%d\t%d\t%g\t%d\t%d,%d,%d\t%g\t%d,%d,%d,%d"
+        "\t%d,%d,%d\t%d,%d\t%d\t%g\t%d,%d,%d,%d\t%d/%d\n",
+        static_cast<unsigned long long>(r.sample),  // NOLINT(runtime/int)
+        ops.empty() ? "-" : ops.c_str(), r.angle, r.smooth_type,
+        r.smooth_kernel, r.alpha, r.beta, r.color_shift[0], r.color_shift[1],
+        r.color_shift[2], r.affine_scale, r.erase[0], r.erase[1], r.erase[2],
+        r.erase[3], r.side_crop[0], r.side_crop[1], r.side_crop[2],
+        r.crop[0], r.crop[1], r.hue, r.saturation, r.resized_crop[0],
+        r.resized_crop[1], r.resized_crop[2], r.resized_crop[3],
+        r.crops ? r.crop_index : 0, r.crops ? r.crops : 1);
+  }
+  fclose(file);
+
+  LOG(INFO) << "Decoded " << count << " records";
+  if (FLAGS_summary) {
+    for (int i = 0; i < kNumOps; ++i) {
+      printf("%s\t%llu\t%.2f%%\n", kOpNames[i],
+          static_cast<unsigned long long>(op_count[i]),  // NOLINT(runtime/int)
+          count ? 100. * op_count[i] / count : 0.);
+    }
+  }
+  return 0;
+}
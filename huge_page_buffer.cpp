@@ -0,0 +1,60 @@
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#include "caffe/util/huge_page_buffer.hpp"
+
+namespace caffe {
+
+HugePageBuffer::HugePageBuffer(size_t bytes)
+    : data_(NULL),
+      size_((std::max<size_t>(bytes, 1) + kPageBytes - 1) / kPageBytes *
+          kPageBytes),
+      reserved_(false),
+      pinned_(false) {
+#ifdef MAP_HUGETLB
+  // Faulted in now: the pages are reserved anyway, and the first batch
+  // does not pay for it.
+  void* map = mmap(NULL, size_, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+  if (map != MAP_FAILED) {
+    data_ = map;
+    reserved_ = true;
+  }
+#endif  // MAP_HUGETLB
+  if (!reserved_) {
+    // Map a page more and trim it to a 2 MB boundary, transparent huge
+    // pages only back aligned 2 MB ranges.
+    char* map = static_cast<char*>(mmap(NULL, size_ + kPageBytes,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    PCHECK(map != MAP_FAILED) << "mmap " << size_ << " bytes";
+    const size_t head = (kPageBytes -
+        reinterpret_cast<uintptr_t>(map) % kPageBytes) % kPageBytes;
+    if (head) {
+      munmap(map, head);
+    }
+    munmap(map + head + size_, kPageBytes - head);
+    data_ = map + head;
+#ifdef MADV_HUGEPAGE
+    madvise(data_, size_, MADV_HUGEPAGE);
+#endif  // MADV_HUGEPAGE
+  }
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaHostRegister(data_, size_, cudaHostRegisterDefault));
+    pinned_ = true;
+  }
+#endif  // CPU_ONLY
+}
+
+HugePageBuffer::~HugePageBuffer() {
+#ifndef CPU_ONLY
+  if (pinned_) {
+    CUDA_CHECK(cudaHostUnregister(data_));
+  }
+#endif  // CPU_ONLY
+  munmap(data_, size_);
+}
+
+}  // namespace caffe
@@ -0,0 +1,45 @@
+#ifndef CAFFE_UTIL_HUGE_PAGE_BUFFER_HPP_
+#define CAFFE_UTIL_HUGE_PAGE_BUFFER_HPP_
+
+#include <stddef.h>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Anonymous memory on 2 MB pages, for large buffers written and read
+ * over and over such as the prefetched batches.
+ *
+ * Reserved huge pages (vm.nr_hugepages) are used when there are enough,
+ * otherwise the buffer is aligned on 2 MB and transparent huge pages are
+ * requested for it. Either way it starts on a 2 MB boundary, so it is
+ * cache line aligned, and its size is rounded up to whole 2 MB pages. In
+ * GPU mode the buffer is also page-locked, like the host memory Caffe
+ * allocates for blobs, so that copies to the device stay asynchronous.
+ */
+class HugePageBuffer {
+ public:
+  static const size_t kPageBytes = 2 << 20;
+
+  explicit HugePageBuffer(size_t bytes);
+  ~HugePageBuffer();
+
+  inline void* data() const { return data_; }
+  inline size_t size() const { return size_; }
+  // Whether the buffer is on reserved huge pages rather than transparent
+  // ones, which the kernel may not always provide.
+  inline bool reserved() const { return reserved_; }
+
+ protected:
+  void* data_;
+  size_t size_;
+  bool reserved_;
+  bool pinned_;
+
+DISABLE_COPY_AND_ASSIGN(HugePageBuffer);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_HUGE_PAGE_BUFFER_HPP_
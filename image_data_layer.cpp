@@ -0,0 +1,388 @@
+#ifdef USE_OPENCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <fstream>  // NOLINT(readability/streams)
+#include <iostream>  // NOLINT(readability/streams)
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/data_transformer.hpp"
+#include "caffe/layers/base_data_layer.hpp"
+#include "caffe/layers/image_data_layer.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/rng.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+ImageDataLayer<Dtype>::~ImageDataLayer<Dtype>() {
+  this->StopInternalThread();
+  // The reader walks lines_, stop it before they go.
+  file_reader_.reset();
+}
+
+template <typename Dtype>
+void ImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  const ImageDataParameter& image_data_param =
+      this->layer_param_.image_data_param();
+  const int new_height = image_data_param.new_height();
+  const int new_width  = image_data_param.new_width();
+  const bool is_color  = image_data_param.is_color();
+  string root_folder = image_data_param.root_folder();
+
+  CHECK((new_height == 0 && new_width == 0) ||
+      (new_height > 0 && new_width > 0)) << "Current implementation requires "
+      "new_height and new_width to be set at the same time.";
+  // Read the file with filenames and labels
+  const string& source = image_data_param.source();
+  LOG(INFO) << "Opening file " << source;
+  std::ifstream infile(source.c_str());
+  string filename;
+  int label;
+  while (infile >> filename >> label) {
+    lines_order_.push_back(lines_.size());
+    lines_.push_back(std::make_pair(filename, label));
+  }
+
+  if (image_data_param.shuffle()) {
+    // randomly shuffle data
+    LOG(INFO) << "Shuffling data";
+    const unsigned int prefetch_rng_seed = caffe_rng_rand();
+    prefetch_rng_.reset(new Caffe::RNG(prefetch_rng_seed));
+    ShuffleImages();
+  }
+  LOG(INFO) << "A total of " << lines_.size() << " images.";
+
+  lines_id_ = 0;
+  // Check if we would need to randomly skip a few data points
+  if (image_data_param.rand_skip()) {
+    unsigned int skip = caffe_rng_rand() % image_data_param.rand_skip();
+    LOG(INFO) << "Skipping first " << skip << " data points.";
+    CHECK_GT(lines_.size(), skip) << "Not enough points to skip";
+    lines_id_ = skip;
+  }
+  // Start at the first step of the resize_schedule, if it starts at 0.
+  const int batch_size = image_data_param.batch_size();
+  this->data_transformer_->SetResizeProgress(0, batch_size);
+  // Read an image, and use it to initialize the top blob.
+  const string& first = lines_[lines_order_[lines_id_]].first;
+  cv::Mat cv_img = ReadImageToCVMat(root_folder + first,
+                                    new_height, new_width, is_color);
+  CHECK(cv_img.data) << "Could not load " << first;
+  // Use data_transformer to infer the expected blob shape from a cv_image.
+  vector<int> top_shape = this->data_transformer_->InferBlobShape(cv_img);
+  this->transformed_data_.Reshape(top_shape);
+  // Reshape prefetch_data and top[0] according to the batch_size.
+  CHECK_GT(batch_size, 0) << "Positive batch size required";
+  top_shape[0] = batch_size;
+  // Sized for the largest crops of the resize_schedule, see DataLayer.
+  vector<int> max_shape = top_shape;
+  const int max_crop = this->data_transformer_->max_crop_size();
+  if (max_crop * max_crop > top_shape[2] * top_shape[3]) {
+    max_shape[2] = max_crop;
+    max_shape[3] = max_crop;
+  }
+  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
+    this->prefetch_[i].data_.Reshape(max_shape);
+    this->prefetch_[i].data_.Reshape(top_shape);
+  }
+  top[0]->Reshape(top_shape);
+
+  LOG(INFO) << "output data size: " << top[0]->num() << ","
+      << top[0]->channels() << "," << top[0]->height() << ","
+      << top[0]->width();
+  // label
+  vector<int> label_shape(1, batch_size);
+  top[1]->Reshape(label_shape);
+  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
+    this->prefetch_[i].label_.Reshape(label_shape);
+  }
+
+  if (image_data_param.async_io()) {
+    CHECK_GT(image_data_param.decode_threads(), 0)
+        << "decode_threads must be positive";
+    // From now on lines_ and lines_id_ belong to the reader thread.
+    file_reader_.reset(new AsyncFileReader(
+        boost::bind(&ImageDataLayer<Dtype>::next_file, this, _1, _2),
+        image_data_param.io_depth(),
+        static_cast<size_t>(image_data_param.prefetch_mb()) << 20,
+        image_data_param.io_threads()));
+  }
+}
+
+template <typename Dtype>
+void ImageDataLayer<Dtype>::ShuffleImages() {
+  caffe::rng_t* prefetch_rng =
+      static_cast<caffe::rng_t*>(prefetch_rng_->generator());
+  shuffle(lines_order_.begin(), lines_order_.end(), prefetch_rng);
+}
+
+// This function is called on the AsyncFileReader thread
+template <typename Dtype>
+void ImageDataLayer<Dtype>::next_file(string* path, int* line) {
+  const int lines_size = lines_.size();
+  CHECK_GT(lines_size, lines_id_);
+  *line = lines_order_[lines_id_];
+  *path = this->layer_param_.image_data_param().root_folder() +
+      lines_[*line].first;
+  // go to the next iter
+  lines_id_++;
+  if (lines_id_ >= lines_size) {
+    // We have reached the end. Restart from the first.
+    DLOG(INFO) << "Restarting data prefetching from start.";
+    lines_id_ = 0;
+    if (this->layer_param_.image_data_param().shuffle()) {
+      ShuffleImages();
+    }
+  }
+}
+
+template <typename Dtype>
+void ImageDataLayer<Dtype>::decode_files(int worker, int threads) {
+  const ImageDataParameter& image_data_param =
+      this->layer_param_.image_data_param();
+  const int new_height = image_data_param.new_height();
+  const int new_width = image_data_param.new_width();
+  const int cv_read_flag = (image_data_param.is_color() ?
+      CV_LOAD_IMAGE_COLOR : CV_LOAD_IMAGE_GRAYSCALE);
+  for (int i = worker; i < batch_files_.size(); i += threads) {
+    const vector<char>& data = batch_files_[i]->data;
+    if (data.empty()) {
+      continue;
+    }
+    cv::Mat encoded(1, data.size(), CV_8UC1,
+        const_cast<char*>(&data[0]));
+    cv::Mat cv_img = cv::imdecode(encoded, cv_read_flag);
+    if (cv_img.data && new_height > 0 && new_width > 0) {
+      cv::resize(cv_img, batch_imgs_[i], cv::Size(new_width, new_height));
+    } else {
+      batch_imgs_[i] = cv_img;
+    }
+  }
+}
+
+template <typename Dtype>
+void ImageDataLayer<Dtype>::InternalThreadEntry() {
+  if (!file_reader_) {
+    BasePrefetchingDataLayer<Dtype>::InternalThreadEntry();
+    return;
+  }
+  const ImageDataParameter& image_data_param =
+      this->layer_param_.image_data_param();
+  const int threads = std::min<int>(image_data_param.decode_threads(),
+      image_data_param.batch_size());
+  decode_generation_ = 0;
+  decode_busy_ = 0;
+  for (int i = 1; i < threads; ++i) {
+    decoders_.push_back(shared_ptr<boost::thread>(new boost::thread(
+        boost::bind(&ImageDataLayer<Dtype>::decoder_entry, this, i))));
+  }
+  BasePrefetchingDataLayer<Dtype>::InternalThreadEntry();
+  for (int i = 0; i < decoders_.size(); ++i) {
+    decoders_[i]->interrupt();
+  }
+  for (int i = 0; i < decoders_.size(); ++i) {
+    decoders_[i]->join();
+  }
+  decoders_.clear();
+}
+
+template <typename Dtype>
+void ImageDataLayer<Dtype>::decoder_entry(int worker) {
+  int64_t generation = 0;
+  try {
+    while (true) {
+      int threads;
+      {
+        boost::mutex::scoped_lock lock(decode_mutex_);
+        while (decode_generation_ == generation) {
+          decode_cond_.wait(lock);
+        }
+        generation = decode_generation_;
+        threads = decode_threads_;
+      }
+      decode_files(worker, threads);
+      boost::mutex::scoped_lock lock(decode_mutex_);
+      if (--decode_busy_ == 0) {
+        decode_done_cond_.notify_one();
+      }
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
+// This function is called on prefetch thread
+template <typename Dtype>
+void ImageDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
+  // The resize_schedule moves on between batches only.
+  if (this->data_transformer_->SetResizeProgress(this->batches_loaded_,
+      this->layer_param_.image_data_param().batch_size())) {
+    LOG(INFO) << this->layer_param_.name() << ": resize_schedule step "
+        << this->data_transformer_->resize_step() << " from batch "
+        << this->batches_loaded_;
+  }
+  if (file_reader_) {
+    load_batch_async(batch);
+    return;
+  }
+  CPUTimer batch_timer;
+  batch_timer.Start();
+  double read_time = 0;
+  double trans_time = 0;
+  CPUTimer timer;
+  CHECK(batch->data_.count());
+  CHECK(this->transformed_data_.count());
+  ImageDataParameter image_data_param = this->layer_param_.image_data_param();
+  const int batch_size = image_data_param.batch_size();
+  const int new_height = image_data_param.new_height();
+  const int new_width = image_data_param.new_width();
+  const bool is_color = image_data_param.is_color();
+  string root_folder = image_data_param.root_folder();
+
+  // Reshape according to the first image of each batch
+  // on single input batches allows for inputs of varying dimension.
+  const string& first = lines_[lines_order_[lines_id_]].first;
+  cv::Mat cv_img = ReadImageToCVMat(root_folder + first,
+      new_height, new_width, is_color);
+  CHECK(cv_img.data) << "Could not load " << first;
+  // Use data_transformer to infer the expected blob shape from a cv_img.
+  vector<int> top_shape = this->data_transformer_->InferBlobShape(cv_img);
+  this->transformed_data_.Reshape(top_shape);
+  // Reshape batch according to the batch_size.
+  top_shape[0] = batch_size;
+  this->reshape_batch(batch, top_shape);
+
+  Dtype* prefetch_data = batch->data_.mutable_cpu_data();
+  Dtype* prefetch_label = batch->label_.mutable_cpu_data();
+
+  // datum scales
+  const int lines_size = lines_.size();
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    // get a blob
+    timer.Start();
+    CHECK_GT(lines_size, lines_id_);
+    const int line = lines_order_[lines_id_];
+    cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_[line].first,
+        new_height, new_width, is_color);
+    CHECK(cv_img.data) << "Could not load " << lines_[line].first;
+    read_time += timer.MicroSeconds();
+    timer.Start();
+    // Apply transformations (mirror, crop...) to the image
+    int offset = batch->data_.offset(item_id);
+    this->transformed_data_.set_cpu_data(prefetch_data + offset);
+    this->data_transformer_->set_trace_sample(line);
+    this->data_transformer_->Transform(cv_img, &(this->transformed_data_));
+    trans_time += timer.MicroSeconds();
+
+    prefetch_label[item_id] = lines_[line].second;
+    // go to the next iter
+    lines_id_++;
+    if (lines_id_ >= lines_size) {
+      // We have reached the end. Restart from the first.
+      DLOG(INFO) << "Restarting data prefetching from start.";
+      lines_id_ = 0;
+      if (this->layer_param_.image_data_param().shuffle()) {
+        ShuffleImages();
+      }
+    }
+  }
+  batch_timer.Stop();
+  DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
+  DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
+  DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+}
+
+// This function is called on prefetch thread
+template <typename Dtype>
+void ImageDataLayer<Dtype>::load_batch_async(Batch<Dtype>* batch) {
+  CPUTimer batch_timer;
+  batch_timer.Start();
+  CPUTimer timer;
+  CHECK(batch->data_.count());
+  CHECK(this->transformed_data_.count());
+  const ImageDataParameter& image_data_param =
+      this->layer_param_.image_data_param();
+  const int batch_size = image_data_param.batch_size();
+  // Without the decode threads (load_batch called off the prefetch
+  // thread), the images are all decoded on this thread.
+  const int threads = decoders_.size() + 1;
+
+  // The files have been read ahead, this only waits if I/O falls behind.
+  // The decode threads are all idle between batches.
+  timer.Start();
+  vector<AsyncFileReader::File*>& files = batch_files_;
+  files.resize(batch_size);
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    files[item_id] = file_reader_->Next();
+  }
+  const double read_time = timer.MicroSeconds();
+
+  timer.Start();
+  vector<cv::Mat>& cv_imgs = batch_imgs_;
+  cv_imgs.assign(batch_size, cv::Mat());
+  if (threads > 1) {
+    boost::mutex::scoped_lock lock(decode_mutex_);
+    decode_threads_ = threads;
+    decode_busy_ = threads - 1;
+    ++decode_generation_;
+    decode_cond_.notify_all();
+  }
+  decode_files(0, threads);
+  {
+    // When interrupted, the decode threads are taken down with this
+    // thread, see InternalThreadEntry.
+    boost::mutex::scoped_lock lock(decode_mutex_);
+    while (decode_busy_ > 0) {
+      decode_done_cond_.wait(lock);
+    }
+  }
+  const double decode_time = timer.MicroSeconds();
+
+  // Reshape according to the first image of each batch
+  // on single input batches allows for inputs of varying dimension.
+  CHECK(cv_imgs[0].data) << "Could not load " << files[0]->path;
+  vector<int> top_shape = this->data_transformer_->InferBlobShape(cv_imgs[0]);
+  this->transformed_data_.Reshape(top_shape);
+  // Reshape batch according to the batch_size.
+  top_shape[0] = batch_size;
+  this->reshape_batch(batch, top_shape);
+
+  Dtype* prefetch_data = batch->data_.mutable_cpu_data();
+  Dtype* prefetch_label = batch->label_.mutable_cpu_data();
+
+  timer.Start();
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    CHECK(cv_imgs[item_id].data) << "Could not load " << files[item_id]->path;
+    // Apply transformations (mirror, crop...) to the image
+    int offset = batch->data_.offset(item_id);
+    this->transformed_data_.set_cpu_data(prefetch_data + offset);
+    this->data_transformer_->set_trace_sample(files[item_id]->tag);
+    this->data_transformer_->Transform(cv_imgs[item_id],
+        &(this->transformed_data_));
+    prefetch_label[item_id] = lines_[files[item_id]->tag].second;
+    file_reader_->Release(files[item_id]);
+  }
+  const double trans_time = timer.MicroSeconds();
+  batch_timer.Stop();
+  DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
+  DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
+  DLOG(INFO) << "   Decode time: " << decode_time / 1000 << " ms.";
+  DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+}
+
+INSTANTIATE_CLASS(ImageDataLayer);
+REGISTER_LAYER_CLASS(ImageData);
+
+}  // namespace caffe
+#endif  // USE_OPENCV
@@ -0,0 +1,91 @@
+#ifndef CAFFE_IMAGE_DATA_LAYER_HPP_
+#define CAFFE_IMAGE_DATA_LAYER_HPP_
+
+#ifdef USE_OPENCV
+#include <opencv2/core/core.hpp>
+#endif  // USE_OPENCV
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/data_transformer.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layers/base_data_layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/async_file_reader.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Provides data to the Net from image files.
+ *
+ * With image_data_param.async_io the files are read ahead by an
+ * AsyncFileReader and the images of a batch are decoded in parallel, by
+ * decode threads kept as long as the prefetch thread.
+ *
+ * TODO(dox): thorough documentation for Forward and proto params.
+ */
+template <typename Dtype>
+class ImageDataLayer : public BasePrefetchingDataLayer<Dtype> {
+ public:
+  explicit ImageDataLayer(const LayerParameter& param)
+      : BasePrefetchingDataLayer<Dtype>(param), decode_generation_(0),
+        decode_threads_(1), decode_busy_(0) {}
+  virtual ~ImageDataLayer();
+  virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "ImageData"; }
+  virtual inline int ExactNumBottomBlobs() const { return 0; }
+  virtual inline int ExactNumTopBlobs() const { return 2; }
+
+ protected:
+  shared_ptr<Caffe::RNG> prefetch_rng_;
+  virtual void ShuffleImages();
+  // async_io: runs the decode threads along with the prefetch loop.
+  virtual void InternalThreadEntry();
+  virtual void load_batch(Batch<Dtype>* batch);
+  // async_io: source of the AsyncFileReader, walks lines_ on its thread.
+  // Files are tagged with their line.
+  void next_file(string* path, int* line);
+  // async_io: decodes batch_files_[i] into batch_imgs_[i], for the i equal
+  // to worker modulo threads.
+  void decode_files(int worker, int threads);
+  // async_io: decode thread worker (from 1), decoding its share of every
+  // batch.
+  void decoder_entry(int worker);
+  void load_batch_async(Batch<Dtype>* batch);
+
+  vector<std::pair<std::string, int> > lines_;
+  // The lines in reading order: shuffled instead of lines_, so that every
+  // image keeps the line it comes from (see set_trace_sample).
+  vector<int> lines_order_;
+  int lines_id_;
+  shared_ptr<AsyncFileReader> file_reader_;
+  // async_io: the decode threads. Each batch bumps decode_generation_, the
+  // threads then decode their share of batch_files_ (decode_threads_ being
+  // the threads of the batch, the prefetch thread included) and the last
+  // one done wakes the prefetch thread up. The files and
+  // images are kept here, a decode thread may still be at work when the
+  // prefetch thread is interrupted.
+  vector<shared_ptr<boost::thread> > decoders_;
+  boost::mutex decode_mutex_;
+  boost::condition_variable decode_cond_;
+  boost::condition_variable decode_done_cond_;
+  int64_t decode_generation_;
+  int decode_threads_;
+  int decode_busy_;
+  vector<AsyncFileReader::File*> batch_files_;
+  vector<cv::Mat> batch_imgs_;
+};
+
+
+}  // namespace caffe
+
+#endif  // CAFFE_IMAGE_DATA_LAYER_HPP_
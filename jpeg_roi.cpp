@@ -0,0 +1,113 @@
+#ifdef USE_OPENCV
+#include <opencv2/core/core.hpp>
+#ifdef USE_LIBJPEG_TURBO
+#include <setjmp.h>
+#include <stdio.h>
+#include <jpeglib.h>
+#endif  // USE_LIBJPEG_TURBO
+
+#include <algorithm>
+
+#include "caffe/util/jpeg_roi.hpp"
+
+namespace caffe {
+
+#ifdef USE_LIBJPEG_TURBO
+namespace {
+
+// libjpeg reports errors through error_exit, which must not return.
+struct JpegErrorManager {
+  jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+void JpegErrorExit(j_common_ptr cinfo) {
+  longjmp(reinterpret_cast<JpegErrorManager*>(cinfo->err)->jump, 1);
+}
+
+// Corrupt data warnings, printed to stderr by default.
+void JpegOutputMessage(j_common_ptr cinfo) {
+  char buffer[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, buffer);
+  DLOG(WARNING) << buffer;
+}
+
+}  // namespace
+#endif  // USE_LIBJPEG_TURBO
+
+bool DecodeJpegRegion(const char* data, size_t size, const cv::Rect& roi,
+    const cv::Size& min_size, int channels, cv::Mat* out) {
+#ifdef USE_LIBJPEG_TURBO
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  if (size < 2 || bytes[0] != 0xFF || bytes[1] != 0xD8 || roi.area() <= 0) {
+    return false;
+  }
+  jpeg_decompress_struct cinfo;
+  JpegErrorManager error;
+  cinfo.err = jpeg_std_error(&error.pub);
+  error.pub.error_exit = JpegErrorExit;
+  error.pub.output_message = JpegOutputMessage;
+  jpeg_create_decompress(&cinfo);
+  // No object with a destructor may be created until the next setjmp, a
+  // longjmp would skip it.
+  if (setjmp(error.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  jpeg_mem_src(&cinfo, const_cast<unsigned char*>(bytes), size);
+  jpeg_read_header(&cinfo, TRUE);
+  if ((cinfo.num_components != 1 && cinfo.num_components != 3) ||
+      roi.x < 0 || roi.y < 0 ||
+      roi.x + roi.width > static_cast<int>(cinfo.image_width) ||
+      roi.y + roi.height > static_cast<int>(cinfo.image_height)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  const int out_channels = channels ? channels : cinfo.num_components;
+  cinfo.out_color_space = out_channels == 3 ? JCS_EXT_BGR : JCS_GRAYSCALE;
+  // The smallest scale keeping the region at least min_size.
+  int scale = 8;
+  while (scale > 1 && roi.width * (scale - 1) >= min_size.width * 8 &&
+      roi.height * (scale - 1) >= min_size.height * 8) {
+    --scale;
+  }
+  cinfo.scale_num = scale;
+  cinfo.scale_denom = 8;
+  jpeg_start_decompress(&cinfo);
+  // The region at that scale.
+  const int x0 = roi.x * scale / 8;
+  const int y0 = roi.y * scale / 8;
+  const int x1 = std::min<int>(cinfo.output_width,
+      ((roi.x + roi.width) * scale + 7) / 8);
+  const int y1 = std::min<int>(cinfo.output_height,
+      ((roi.y + roi.height) * scale + 7) / 8);
+  // Widened to whole MCU columns: x_offset moves left, width grows.
+  JDIMENSION x_offset = x0;
+  JDIMENSION width = x1 - x0;
+  jpeg_crop_scanline(&cinfo, &x_offset, &width);
+  {
+    cv::Mat decoded(y1 - y0, width, CV_8UC(out_channels));
+    if (setjmp(error.jump)) {
+      jpeg_destroy_decompress(&cinfo);
+      return false;
+    }
+    if (y0 > 0) {
+      jpeg_skip_scanlines(&cinfo, y0);
+    }
+    for (int y = 0; y < decoded.rows; ++y) {
+      JSAMPROW row = decoded.ptr<JSAMPLE>(y);
+      jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    // The rows below the region are left undecoded.
+    jpeg_abort_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    *out = decoded.colRange(x0 - x_offset, x1 - x_offset);
+  }
+  return true;
+#else
+  return false;
+#endif  // USE_LIBJPEG_TURBO
+}
+
+}  // namespace caffe
+#endif  // USE_OPENCV
@@ -0,0 +1,34 @@
+#ifndef CAFFE_UTIL_JPEG_ROI_HPP_
+#define CAFFE_UTIL_JPEG_ROI_HPP_
+
+#ifdef USE_OPENCV
+#include <opencv2/core/core.hpp>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Decodes only the region roi of a JPEG image, for crops of large
+ *    images.
+ *
+ * Rows below the region are never decoded, rows above it are only entropy
+ * decoded, and only the MCU columns it spans go through the inverse DCT and
+ * the color conversion (jpeg_skip_scanlines and jpeg_crop_scanline, from
+ * libjpeg-turbo 1.5). The region is further decoded at the smallest DCT
+ * scale M/8 which keeps it at least min_size, so a large source costs about
+ * as much as the output it is resampled to.
+ *
+ * *out gets the region at that scale, BGR if channels is 3, gray if it is 1,
+ * as stored if it is 0. Returns false, leaving *out alone, if data is not a
+ * JPEG libjpeg can convert (CMYK), if roi is not inside the image, on
+ * decoding errors, or when built without USE_LIBJPEG_TURBO: callers then
+ * decode the whole image.
+ */
+bool DecodeJpegRegion(const char* data, size_t size, const cv::Rect& roi,
+    const cv::Size& min_size, int channels, cv::Mat* out);
+
+}  // namespace caffe
+
+#endif  // USE_OPENCV
+#endif  // CAFFE_UTIL_JPEG_ROI_HPP_
@@ -0,0 +1,91 @@
+#ifdef USE_OPENCV
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <utility>
+
+#include "caffe/util/remap_cache.hpp"
+
+namespace caffe {
+
+RemapCache::Key::Key(int rows, int cols, int angle, int scale,
+    int width_scale, int height_scale) {
+  values[0] = rows;
+  values[1] = cols;
+  values[2] = angle;
+  values[3] = scale;
+  values[4] = width_scale;
+  values[5] = height_scale;
+}
+
+bool RemapCache::Key::operator<(const Key& other) const {
+  return std::lexicographical_compare(values, values + 6,
+      other.values, other.values + 6);
+}
+
+RemapCache::RemapCache(size_t capacity_bytes)
+    : capacity_bytes_(capacity_bytes),
+      bytes_(0),
+      hits_(0),
+      misses_(0) {
+}
+
+const RemapCache::Maps* RemapCache::Find(const Key& key) {
+  std::map<Key, Entries::iterator>::iterator it = index_.find(key);
+  if (it == index_.end()) {
+    ++misses_;
+    return NULL;
+  }
+  ++hits_;
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return &it->second->second;
+}
+
+const RemapCache::Maps* RemapCache::Insert(const Key& key,
+    const cv::Mat& matrix, const cv::Size& dsize) {
+  CHECK_EQ(matrix.rows, 2);
+  CHECK_EQ(matrix.cols, 3);
+  cv::Mat inverse;
+  cv::invertAffineTransform(matrix, inverse);
+  inverse.convertTo(inverse, CV_64F);
+  const double* m = inverse.ptr<double>(0);
+  const double* n = inverse.ptr<double>(1);
+  cv::Mat map_x(dsize, CV_32FC1);
+  cv::Mat map_y(dsize, CV_32FC1);
+  for (int y = 0; y < dsize.height; ++y) {
+    float* px = map_x.ptr<float>(y);
+    float* py = map_y.ptr<float>(y);
+    for (int x = 0; x < dsize.width; ++x) {
+      px[x] = static_cast<float>(m[0] * x + m[1] * y + m[2]);
+      py[x] = static_cast<float>(n[0] * x + n[1] * y + n[2]);
+    }
+  }
+
+  entries_.push_front(std::make_pair(key, Maps()));
+  Maps& maps = entries_.front().second;
+  cv::convertMaps(map_x, map_y, maps.map1, maps.map2, CV_16SC2);
+  index_[key] = entries_.begin();
+  bytes_ += maps.map1.total() * maps.map1.elemSize() +
+      maps.map2.total() * maps.map2.elemSize();
+
+  // Evict the least recently used maps, always keeping the new ones.
+  while (bytes_ > capacity_bytes_ && entries_.size() > 1) {
+    const Maps& old = entries_.back().second;
+    bytes_ -= old.map1.total() * old.map1.elemSize() +
+        old.map2.total() * old.map2.elemSize();
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+  return &maps;
+}
+
+void RemapCache::Remap(const Maps& maps, cv::Mat& cv_img) {
+  cv::Mat warped;
+  cv::remap(cv_img, warped, maps.map1, maps.map2, cv::INTER_LINEAR);
+  cv_img = warped;
+}
+
+}  // namespace caffe
+#endif  // USE_OPENCV
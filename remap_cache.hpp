@@ -0,0 +1,69 @@
+#ifndef CAFFE_UTIL_REMAP_CACHE_HPP_
+#define CAFFE_UTIL_REMAP_CACHE_HPP_
+
+#ifdef USE_OPENCV
+#include <opencv2/core/core.hpp>
+
+#include <list>
+#include <map>
+#include <utility>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Bounded LRU cache of fixed-point cv::remap maps.
+ *
+ * Rotation and affine augmentations draw their angle and scales from small
+ * discrete sets, so with fixed-size inputs the same warps come up over and
+ * over. Caching their maps turns a cv::warpAffine, which recomputes every
+ * source coordinate, into a cv::remap that only gathers pixels.
+ */
+class RemapCache {
+ public:
+  // Identifies a warp: source size, angle and, for affine warps, the scale
+  // steps drawn for the transformation and for the output size.
+  struct Key {
+    Key(int rows, int cols, int angle, int scale = -1, int width_scale = -1,
+        int height_scale = -1);
+    bool operator<(const Key& other) const;
+    int values[6];
+  };
+  // Maps as produced by cv::convertMaps, CV_16SC2 and CV_16UC1.
+  struct Maps {
+    cv::Mat map1, map2;
+  };
+
+  explicit RemapCache(size_t capacity_bytes);
+
+  // Returns the maps of key, or NULL if they are not cached.
+  const Maps* Find(const Key& key);
+  // Builds and caches the maps of the affine transformation matrix (2x3,
+  // source to destination, as passed to cv::warpAffine) and output size.
+  const Maps* Insert(const Key& key, const cv::Mat& matrix,
+      const cv::Size& dsize);
+  // Warps cv_img in place like cv::warpAffine with linear interpolation.
+  static void Remap(const Maps& maps, cv::Mat& cv_img);
+
+  inline size_t hits() const { return hits_; }
+  inline size_t misses() const { return misses_; }
+
+ protected:
+  typedef std::list<std::pair<Key, Maps> > Entries;
+
+  const size_t capacity_bytes_;
+  size_t bytes_;
+  size_t hits_;
+  size_t misses_;
+  // Most recently used first.
+  Entries entries_;
+  std::map<Key, Entries::iterator> index_;
+
+DISABLE_COPY_AND_ASSIGN(RemapCache);
+};
+
+}  // namespace caffe
+
+#endif  // USE_OPENCV
+#endif  // CAFFE_UTIL_REMAP_CACHE_HPP_
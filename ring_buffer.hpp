@@ -0,0 +1,381 @@
+#ifndef CAFFE_UTIL_RING_BUFFER_HPP_
+#define CAFFE_UTIL_RING_BUFFER_HPP_
+
+#include <boost/atomic.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif  // __SSE2__
+
+#include <string>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Bounded lock-free multi-producer multi-consumer queue.
+ *
+ * Fixed capacity (rounded up to a power of two), no allocation after
+ * construction, and neither side ever takes a lock: each cell carries a
+ * sequence number telling producers and consumers whose turn it is.
+ * try_push fails instead of waiting when the ring is full, try_pop when it
+ * is empty. The batch versions move up to n items with a single atomic
+ * update of the shared position, and return how many they moved.
+ */
+template <typename T>
+class RingBuffer {
+ public:
+  explicit RingBuffer(size_t capacity);
+  ~RingBuffer();
+
+  bool try_push(const T& t);
+  bool try_pop(T* t);
+  size_t try_push(const T* items, size_t n);
+  size_t try_pop(T* items, size_t n);
+  // Copies the next item without popping it. Only meaningful while there is
+  // a single consumer.
+  bool try_peek(T* t) const;
+
+  inline size_t capacity() const { return mask_ + 1; }
+  // Approximate when other threads are pushing or popping.
+  size_t size() const;
+
+ protected:
+  struct Cell {
+    boost::atomic<size_t> sequence;
+    T value;
+  };
+  // Keep the producer and consumer positions on separate cache lines.
+  static const int kCacheLine = 64;
+  static size_t round_capacity(size_t capacity);
+
+  Cell* cells_;
+  const size_t mask_;
+  char pad0_[kCacheLine];
+  boost::atomic<size_t> enqueue_pos_;
+  char pad1_[kCacheLine];
+  boost::atomic<size_t> dequeue_pos_;
+  char pad2_[kCacheLine];
+
+DISABLE_COPY_AND_ASSIGN(RingBuffer);
+};
+
+template <typename T>
+size_t RingBuffer<T>::round_capacity(size_t capacity) {
+  size_t n = 2;
+  while (n < capacity) {
+    n <<= 1;
+  }
+  return n;
+}
+
+template <typename T>
+RingBuffer<T>::RingBuffer(size_t capacity)
+    : mask_(round_capacity(capacity) - 1) {
+  cells_ = new Cell[mask_ + 1];
+  for (size_t i = 0; i <= mask_; ++i) {
+    cells_[i].sequence.store(i, boost::memory_order_relaxed);
+  }
+  enqueue_pos_.store(0, boost::memory_order_relaxed);
+  dequeue_pos_.store(0, boost::memory_order_relaxed);
+}
+
+template <typename T>
+RingBuffer<T>::~RingBuffer() {
+  delete[] cells_;
+}
+
+template <typename T>
+bool RingBuffer<T>::try_push(const T& t) {
+  Cell* cell;
+  size_t pos = enqueue_pos_.load(boost::memory_order_relaxed);
+  while (true) {
+    cell = &cells_[pos & mask_];
+    const size_t seq = cell->sequence.load(boost::memory_order_acquire);
+    const intptr_t dif = static_cast<intptr_t>(seq) -
+        static_cast<intptr_t>(pos);
+    if (dif == 0) {
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+          boost::memory_order_relaxed)) {
+        break;
+      }
+    } else if (dif < 0) {
+      return false;
+    } else {
+      pos = enqueue_pos_.load(boost::memory_order_relaxed);
+    }
+  }
+  cell->value = t;
+  cell->sequence.store(pos + 1, boost::memory_order_release);
+  return true;
+}
+
+template <typename T>
+bool RingBuffer<T>::try_pop(T* t) {
+  Cell* cell;
+  size_t pos = dequeue_pos_.load(boost::memory_order_relaxed);
+  while (true) {
+    cell = &cells_[pos & mask_];
+    const size_t seq = cell->sequence.load(boost::memory_order_acquire);
+    const intptr_t dif = static_cast<intptr_t>(seq) -
+        static_cast<intptr_t>(pos + 1);
+    if (dif == 0) {
+      if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+          boost::memory_order_relaxed)) {
+        break;
+      }
+    } else if (dif < 0) {
+      return false;
+    } else {
+      pos = dequeue_pos_.load(boost::memory_order_relaxed);
+    }
+  }
+  *t = cell->value;
+  cell->sequence.store(pos + mask_ + 1, boost::memory_order_release);
+  return true;
+}
+
+template <typename T>
+size_t RingBuffer<T>::try_push(const T* items, size_t n) {
+  size_t pos = enqueue_pos_.load(boost::memory_order_relaxed);
+  size_t count;
+  while (true) {
+    // The free cells from pos on, up to n of them.
+    count = 0;
+    while (count < n && cells_[(pos + count) & mask_].sequence.load(
+        boost::memory_order_acquire) == pos + count) {
+      ++count;
+    }
+    if (count > 0) {
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + count,
+          boost::memory_order_relaxed)) {
+        break;
+      }
+    } else if (static_cast<intptr_t>(cells_[pos & mask_].sequence.load(
+        boost::memory_order_acquire)) - static_cast<intptr_t>(pos) < 0) {
+      return 0;
+    } else {
+      pos = enqueue_pos_.load(boost::memory_order_relaxed);
+    }
+  }
+  for (size_t i = 0; i < count; ++i) {
+    Cell* cell = &cells_[(pos + i) & mask_];
+    cell->value = items[i];
+    cell->sequence.store(pos + i + 1, boost::memory_order_release);
+  }
+  return count;
+}
+
+template <typename T>
+size_t RingBuffer<T>::try_pop(T* items, size_t n) {
+  size_t pos = dequeue_pos_.load(boost::memory_order_relaxed);
+  size_t count;
+  while (true) {
+    // The filled cells from pos on, up to n of them.
+    count = 0;
+    while (count < n && cells_[(pos + count) & mask_].sequence.load(
+        boost::memory_order_acquire) == pos + count + 1) {
+      ++count;
+    }
+    if (count > 0) {
+      if (dequeue_pos_.compare_exchange_weak(pos, pos + count,
+          boost::memory_order_relaxed)) {
+        break;
+      }
+    } else if (static_cast<intptr_t>(cells_[pos & mask_].sequence.load(
+        boost::memory_order_acquire)) - static_cast<intptr_t>(pos + 1) < 0) {
+      return 0;
+    } else {
+      pos = dequeue_pos_.load(boost::memory_order_relaxed);
+    }
+  }
+  for (size_t i = 0; i < count; ++i) {
+    Cell* cell = &cells_[(pos + i) & mask_];
+    items[i] = cell->value;
+    cell->sequence.store(pos + i + mask_ + 1, boost::memory_order_release);
+  }
+  return count;
+}
+
+template <typename T>
+bool RingBuffer<T>::try_peek(T* t) const {
+  const size_t pos = dequeue_pos_.load(boost::memory_order_relaxed);
+  const Cell& cell = cells_[pos & mask_];
+  if (cell.sequence.load(boost::memory_order_acquire) != pos + 1) {
+    return false;
+  }
+  *t = cell.value;
+  return true;
+}
+
+template <typename T>
+size_t RingBuffer<T>::size() const {
+  const size_t enqueued = enqueue_pos_.load(boost::memory_order_relaxed);
+  const size_t dequeued = dequeue_pos_.load(boost::memory_order_relaxed);
+  return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+/**
+ * @brief Blocking queue on a RingBuffer, for the hand-offs BlockingQueue
+ *    makes contended, e.g. the records of DataReader.
+ *
+ * Waits first spin on the ring for a while, so that threads which keep up
+ * with each other never take a lock, then park on a condition variable.
+ * The mutex is only taken by a thread going to sleep, and by the other side
+ * when it sees sleepers to wake. Like those of BlockingQueue, parked waits
+ * are interruption points.
+ */
+template <typename T>
+class RingQueue {
+ public:
+  explicit RingQueue(size_t capacity);
+
+  void push(const T& t);
+  // Pushes the n items, waiting for room as needed.
+  void push(const T* items, size_t n);
+  bool try_pop(T* t);
+  // Logs log_on_wait, every 1000 parked waits, when there is nothing to pop.
+  T pop(const string& log_on_wait = "");
+  // Pops between 1 and max items, returns how many.
+  size_t pop(T* items, size_t max, const string& log_on_wait = "");
+  // Waits for an item and returns it without popping it. Only meaningful
+  // while there is a single consumer.
+  T peek();
+
+  inline size_t capacity() const { return ring_.capacity(); }
+  // Approximate when other threads are pushing or popping.
+  inline size_t size() const { return ring_.size(); }
+
+ protected:
+  // Pauses of a wait before it parks.
+  static const int kSpins = 1000;
+  static inline void relax() {
+#ifdef __SSE2__
+    _mm_pause();
+#endif  // __SSE2__
+  }
+  // Counts a parked thread for as long as it is in scope.
+  struct Sleeper {
+    explicit Sleeper(boost::atomic<int>* sleepers) : sleepers_(sleepers) {
+      ++*sleepers_;
+      // Pairs with the fence of wake: either the waker sees this sleeper,
+      // or the sleeper sees what was pushed or popped before the wake.
+      boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    }
+    ~Sleeper() { --*sleepers_; }
+    boost::atomic<int>* sleepers_;
+  };
+  // Wakes the parked threads, if any, after a push or a pop.
+  void wake();
+
+  RingBuffer<T> ring_;
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+  boost::atomic<int> sleepers_;
+
+DISABLE_COPY_AND_ASSIGN(RingQueue);
+};
+
+template <typename T>
+RingQueue<T>::RingQueue(size_t capacity)
+    : ring_(capacity), sleepers_(0) {
+}
+
+template <typename T>
+void RingQueue<T>::wake() {
+  boost::atomic_thread_fence(boost::memory_order_seq_cst);
+  if (sleepers_.load(boost::memory_order_relaxed) > 0) {
+    boost::mutex::scoped_lock lock(mutex_);
+    condition_.notify_all();
+  }
+}
+
+template <typename T>
+void RingQueue<T>::push(const T& t) {
+  push(&t, 1);
+}
+
+template <typename T>
+void RingQueue<T>::push(const T* items, size_t n) {
+  int spin = 0;
+  while (n > 0) {
+    size_t pushed = ring_.try_push(items, n);
+    if (!pushed && ++spin >= kSpins) {
+      boost::mutex::scoped_lock lock(mutex_);
+      Sleeper sleeper(&sleepers_);
+      while (!(pushed = ring_.try_push(items, n))) {
+        condition_.wait(lock);
+      }
+    }
+    if (pushed) {
+      items += pushed;
+      n -= pushed;
+      spin = 0;
+      wake();
+    } else {
+      relax();
+    }
+  }
+}
+
+template <typename T>
+bool RingQueue<T>::try_pop(T* t) {
+  if (!ring_.try_pop(t)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+template <typename T>
+T RingQueue<T>::pop(const string& log_on_wait) {
+  T t;
+  pop(&t, 1, log_on_wait);
+  return t;
+}
+
+template <typename T>
+size_t RingQueue<T>::pop(T* items, size_t max, const string& log_on_wait) {
+  size_t popped = 0;
+  for (int spin = 0; spin < kSpins && !popped; ++spin) {
+    if (!(popped = ring_.try_pop(items, max))) {
+      relax();
+    }
+  }
+  if (!popped) {
+    boost::mutex::scoped_lock lock(mutex_);
+    Sleeper sleeper(&sleepers_);
+    while (!(popped = ring_.try_pop(items, max))) {
+      if (!log_on_wait.empty()) {
+        LOG_EVERY_N(INFO, 1000) << log_on_wait;
+      }
+      condition_.wait(lock);
+    }
+  }
+  wake();
+  return popped;
+}
+
+template <typename T>
+T RingQueue<T>::peek() {
+  T t;
+  for (int spin = 0; spin < kSpins; ++spin) {
+    if (ring_.try_peek(&t)) {
+      return t;
+    }
+    relax();
+  }
+  boost::mutex::scoped_lock lock(mutex_);
+  Sleeper sleeper(&sleepers_);
+  while (!ring_.try_peek(&t)) {
+    condition_.wait(lock);
+  }
+  return t;
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_RING_BUFFER_HPP_
@@ -0,0 +1,236 @@
+#include <boost/thread.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "caffe/util/shm_batch_ring.hpp"
+
+namespace caffe {
+
+static const uint32_t kShmBatchRingMagic = 0x53425231;  // "SBR1"
+
+const int ShmBatchRing::kMaxBlobs;
+const int ShmBatchRing::kMaxAxes;
+const int ShmBatchRing::kMaxReaders;
+
+struct ShmBatchRing::Header {
+  // Stored last by the writer, once the rest is set.
+  boost::atomic<uint32_t> magic;
+  int32_t elem_size;
+  int32_t slots;
+  int32_t num_blobs;
+  int32_t num_axes[kMaxBlobs];
+  int32_t shape[kMaxBlobs][kMaxAxes];
+  // Number of batches published.
+  boost::atomic<uint64_t> published;
+  Reader readers[kMaxReaders];
+};
+
+static size_t AlignUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+ShmBatchRing::ShmBatchRing(const string& name,
+    const vector<vector<int> >& shapes, int elem_size, int slots)
+    : name_(name),
+      writer_(true),
+      fd_(-1),
+      header_(NULL),
+      data_(NULL),
+      shapes_(shapes),
+      elem_size_(elem_size),
+      slots_(slots),
+      reader_(NULL),
+      read_(0) {
+  CHECK_GT(slots_, 0);
+  CHECK_GT(elem_size_, 0);
+  CHECK_GT(num_blobs(), 0);
+  CHECK_LE(num_blobs(), kMaxBlobs);
+  Layout();
+  shm_unlink(name_.c_str());
+  fd_ = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+  PCHECK(fd_ >= 0) << "shm_open " << name_;
+  header_bytes_ = AlignUp(sizeof(Header), sysconf(_SC_PAGESIZE));
+  data_bytes_ = slot_bytes_ * slots_;
+  PCHECK(ftruncate(fd_, header_bytes_ + data_bytes_) == 0)
+      << "ftruncate " << name_;
+  void* map = mmap(NULL, header_bytes_ + data_bytes_, PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd_, 0);
+  PCHECK(map != MAP_FAILED) << "mmap " << name_;
+  header_ = new (map) Header();
+  data_ = static_cast<char*>(map) + header_bytes_;
+  CHECK(header_->published.is_lock_free())
+      << "64 bits atomics are not lock free on this platform";
+  header_->elem_size = elem_size_;
+  header_->slots = slots_;
+  header_->num_blobs = num_blobs();
+  for (int i = 0; i < num_blobs(); ++i) {
+    header_->num_axes[i] = shapes_[i].size();
+    std::copy(shapes_[i].begin(), shapes_[i].end(), header_->shape[i]);
+  }
+  header_->published.store(0);
+  for (int i = 0; i < kMaxReaders; ++i) {
+    header_->readers[i].pid.store(0);
+    header_->readers[i].next.store(0);
+  }
+  header_->magic.store(kShmBatchRingMagic);
+  LOG(INFO) << "Created " << name_ << ": " << slots_ << " slots of "
+      << slot_bytes_ / 1024 << " KB";
+}
+
+ShmBatchRing::ShmBatchRing(const string& name)
+    : name_(name),
+      writer_(false),
+      fd_(-1),
+      header_(NULL),
+      data_(NULL),
+      elem_size_(0),
+      slots_(0),
+      reader_(NULL),
+      read_(0) {
+  header_bytes_ = AlignUp(sizeof(Header), sysconf(_SC_PAGESIZE));
+  // The writer may not have started yet, or be setting the ring up.
+  struct stat st;
+  bool waited = false;
+  while ((fd_ = shm_open(name_.c_str(), O_RDWR, 0)) < 0 ||
+      fstat(fd_, &st) < 0 ||
+      static_cast<size_t>(st.st_size) < header_bytes_) {
+    PCHECK(fd_ >= 0 || errno == ENOENT) << "shm_open " << name_;
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+    LOG_IF(INFO, !waited) << "Waiting for " << name_
+        << ", is augmentation_server running?";
+    waited = true;
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  }
+  void* map = mmap(NULL, header_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED,
+      fd_, 0);
+  PCHECK(map != MAP_FAILED) << "mmap " << name_;
+  header_ = static_cast<Header*>(map);
+  while (header_->magic.load() != kShmBatchRingMagic) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  elem_size_ = header_->elem_size;
+  slots_ = header_->slots;
+  for (int i = 0; i < header_->num_blobs; ++i) {
+    shapes_.push_back(vector<int>(header_->shape[i],
+        header_->shape[i] + header_->num_axes[i]));
+  }
+  Layout();
+  data_bytes_ = slot_bytes_ * slots_;
+  PCHECK(fstat(fd_, &st) == 0) << "fstat " << name_;
+  CHECK_EQ(static_cast<size_t>(st.st_size), header_bytes_ + data_bytes_)
+      << name_ << " does not match its header";
+  map = mmap(NULL, data_bytes_, PROT_READ, MAP_SHARED, fd_, header_bytes_);
+  PCHECK(map != MAP_FAILED) << "mmap " << name_;
+  data_ = static_cast<char*>(map);
+
+  const int32_t pid = getpid();
+  for (int i = 0; i < kMaxReaders && !reader_; ++i) {
+    int32_t free_pid = 0;
+    if (header_->readers[i].pid.compare_exchange_strong(free_pid, pid)) {
+      reader_ = &header_->readers[i];
+    }
+  }
+  CHECK(reader_) << "Too many readers attached to " << name_;
+  // Until now the entry held an older cursor, which could only hold the
+  // writer back.
+  read_ = header_->published.load();
+  reader_->next.store(read_);
+  LOG(INFO) << "Attached to " << name_ << " at batch " << read_;
+}
+
+ShmBatchRing::~ShmBatchRing() {
+  if (reader_) {
+    reader_->pid.store(0);
+  }
+  if (writer_) {
+    munmap(header_, header_bytes_ + data_bytes_);
+    shm_unlink(name_.c_str());
+  } else {
+    munmap(data_, data_bytes_);
+    munmap(header_, header_bytes_);
+  }
+  close(fd_);
+}
+
+void ShmBatchRing::Layout() {
+  offsets_.clear();
+  slot_bytes_ = 0;
+  for (int i = 0; i < num_blobs(); ++i) {
+    CHECK_LE(static_cast<int>(shapes_[i].size()), kMaxAxes);
+    size_t count = 1;
+    for (int j = 0; j < shapes_[i].size(); ++j) {
+      count *= shapes_[i][j];
+    }
+    offsets_.push_back(slot_bytes_);
+    // Cache line aligned blobs.
+    slot_bytes_ += AlignUp(count * elem_size_, 64);
+  }
+}
+
+bool ShmBatchRing::HasRoom(uint64_t n) const {
+  bool attached = false;
+  uint64_t oldest = n;
+  for (int i = 0; i < kMaxReaders; ++i) {
+    if (header_->readers[i].pid.load()) {
+      attached = true;
+      oldest = std::min(oldest, header_->readers[i].next.load());
+    }
+  }
+  return attached && n < oldest + slots_;
+}
+
+void ShmBatchRing::ReclaimReaders() {
+  for (int i = 0; i < kMaxReaders; ++i) {
+    int32_t pid = header_->readers[i].pid.load();
+    if (pid && kill(pid, 0) != 0 && errno == ESRCH) {
+      LOG(INFO) << "Reader " << pid << " of " << name_ << " is gone";
+      header_->readers[i].pid.compare_exchange_strong(pid, 0);
+    }
+  }
+}
+
+char* ShmBatchRing::WriteSlot() {
+  CHECK(writer_);
+  const uint64_t n = header_->published.load();
+  if (!HasRoom(n)) {
+    ReclaimReaders();
+    if (!HasRoom(n)) {
+      return NULL;
+    }
+  }
+  return data_ + (n % slots_) * slot_bytes_;
+}
+
+void ShmBatchRing::Publish() {
+  CHECK(writer_);
+  header_->published.fetch_add(1);
+}
+
+const char* ShmBatchRing::ReadSlot(uint64_t* index) {
+  CHECK(reader_);
+  while (header_->published.load() <= read_) {
+    boost::this_thread::sleep(boost::posix_time::microseconds(100));
+  }
+  *index = read_++;
+  return data_ + (*index % slots_) * slot_bytes_;
+}
+
+void ShmBatchRing::Release(uint64_t index) {
+  CHECK(reader_);
+  if (reader_->next.load() <= index) {
+    reader_->next.store(index + 1);
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,96 @@
+#ifndef CAFFE_UTIL_SHM_BATCH_RING_HPP_
+#define CAFFE_UTIL_SHM_BATCH_RING_HPP_
+
+#include <boost/atomic.hpp>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Batches in POSIX shared memory, written by one process and read by
+ * every local process attached to it.
+ *
+ * The ring has a fixed number of slots, each holding the blobs of a batch
+ * back to back, with shapes fixed by the writer. Batch n goes to slot
+ * n % slots and is published by bumping a counter, readers use it in place
+ * and release it by moving their cursor past it. Nothing is locked: the
+ * writer only waits for the slowest live reader to release the slot it
+ * overwrites, and readers only wait for new batches. Every reader sees
+ * every batch published after it attached. Readers map the batches read
+ * only, so a net writing to its data top in place faults instead of
+ * corrupting the batches of the other readers.
+ */
+class ShmBatchRing {
+ public:
+  static const int kMaxBlobs = 8;
+  static const int kMaxAxes = 8;
+  static const int kMaxReaders = 64;
+
+  // Writer: creates the ring, replacing any ring of the same name.
+  ShmBatchRing(const string& name, const vector<vector<int> >& shapes,
+      int elem_size, int slots);
+  // Reader: attaches to the ring, waiting for the writer to create it.
+  explicit ShmBatchRing(const string& name);
+  ~ShmBatchRing();
+
+  int slots() const { return slots_; }
+  int num_blobs() const { return shapes_.size(); }
+  const vector<int>& shape(int i) const { return shapes_[i]; }
+  int elem_size() const { return elem_size_; }
+  // Offset of blob i in a slot.
+  size_t offset(int i) const { return offsets_[i]; }
+
+  // Writer: returns the slot of the next batch, or NULL if a reader still
+  // uses it or no reader is attached. Fill it, then Publish.
+  char* WriteSlot();
+  void Publish();
+
+  // Reader: waits for the next batch, an interruption point. Pass index to
+  // Release once done with the batch, which releases the batches read before
+  // it as well.
+  const char* ReadSlot(uint64_t* index);
+  void Release(uint64_t index);
+
+ protected:
+  struct Reader {
+    // Process id of the reader, 0 when the entry is free.
+    boost::atomic<int32_t> pid;
+    // First batch the reader still uses.
+    boost::atomic<uint64_t> next;
+  };
+  struct Header;
+
+  // Lays the blobs out in a slot, from shapes_ and elem_size_.
+  void Layout();
+  // Writer: whether batch n can go to its slot.
+  bool HasRoom(uint64_t n) const;
+  // Frees the entries of readers which died without detaching.
+  void ReclaimReaders();
+
+  const string name_;
+  const bool writer_;
+  int fd_;
+  Header* header_;
+  size_t header_bytes_;
+  char* data_;
+  size_t data_bytes_;
+  vector<vector<int> > shapes_;
+  vector<size_t> offsets_;
+  int elem_size_;
+  int slots_;
+  size_t slot_bytes_;
+  // Reader: own entry of the header, and next batch to read.
+  Reader* reader_;
+  uint64_t read_;
+
+DISABLE_COPY_AND_ASSIGN(ShmBatchRing);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_SHM_BATCH_RING_HPP_
@@ -0,0 +1,75 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "caffe/util/transformed_cache.hpp"
+
+namespace caffe {
+
+TransformedCache::TransformedCache(size_t entry_bytes, size_t budget_bytes,
+    const string& spill_file)
+    : entry_bytes_(entry_bytes),
+      budget_bytes_(budget_bytes),
+      spill_file_(spill_file),
+      memory_chunks_(0),
+      memory_entries_(0),
+      size_(0),
+      fd_(-1),
+      spill_bytes_(0) {
+  CHECK_GT(entry_bytes_, 0);
+  chunk_entries_ = std::max<int64_t>(1, kChunkBytes / entry_bytes_);
+  // Spilled chunks are mapped at multiples of chunk_bytes_ in the file.
+  const size_t page = sysconf(_SC_PAGESIZE);
+  chunk_bytes_ = (chunk_entries_ * entry_bytes_ + page - 1) / page * page;
+}
+
+TransformedCache::~TransformedCache() {
+  for (int i = 0; i < chunks_.size(); ++i) {
+    if (i < memory_chunks_) {
+      delete[] chunks_[i];
+    } else {
+      munmap(chunks_[i], chunk_bytes_);
+    }
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+char* TransformedCache::Allocate() {
+  const int64_t spilled_chunks = chunks_.size() - memory_chunks_;
+  if (size_ == memory_entries_ + spilled_chunks * chunk_entries_) {
+    if (fd_ < 0 && memory_bytes() + entry_bytes_ <= budget_bytes_) {
+      // The last chunk in memory takes what is left of the budget.
+      const int64_t entries = std::min<int64_t>(chunk_entries_,
+          (budget_bytes_ - memory_bytes()) / entry_bytes_);
+      chunks_.push_back(new char[entries * entry_bytes_]);
+      ++memory_chunks_;
+      memory_entries_ += entries;
+    } else if (!spill_file_.empty()) {
+      if (fd_ < 0) {
+        fd_ = open(spill_file_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        PCHECK(fd_ >= 0) << "open " << spill_file_;
+        PCHECK(unlink(spill_file_.c_str()) == 0) << "unlink " << spill_file_;
+        LOG(INFO) << "Spilling past " << (memory_bytes() >> 20)
+            << " MB to " << spill_file_;
+      }
+      PCHECK(ftruncate(fd_, spill_bytes_ + chunk_bytes_) == 0)
+          << "ftruncate " << spill_file_;
+      void* map = mmap(NULL, chunk_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED,
+          fd_, spill_bytes_);
+      PCHECK(map != MAP_FAILED) << "mmap " << spill_file_;
+      chunks_.push_back(static_cast<char*>(map));
+      spill_bytes_ += chunk_bytes_;
+    } else {
+      return NULL;
+    }
+  }
+  return entry(size_++);
+}
+
+}  // namespace caffe
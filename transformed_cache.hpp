@@ -0,0 +1,73 @@
+#ifndef CAFFE_UTIL_TRANSFORMED_CACHE_HPP_
+#define CAFFE_UTIL_TRANSFORMED_CACHE_HPP_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Append-only store of fixed-size entries, in memory up to a budget
+ * and past it in a spill file.
+ *
+ * Entries are allocated in chunks of about kChunkBytes. Chunks are held in
+ * memory until budget_bytes is reached, the last of them sized to what is
+ * left of it, then mapped from the spill file, grown as needed. The file is
+ * unlinked as soon as it is opened, so it goes away with the process.
+ * Entries never move: pointers returned by Allocate stay valid for the
+ * lifetime of the store.
+ *
+ * Not thread safe, callers serialize Allocate. entry() may be called
+ * concurrently once no entry is allocated any more.
+ */
+class TransformedCache {
+ public:
+  static const size_t kChunkBytes = 64 << 20;
+
+  // No spill file if spill_file is empty.
+  TransformedCache(size_t entry_bytes, size_t budget_bytes,
+      const string& spill_file);
+  ~TransformedCache();
+
+  // Returns a new entry, or NULL if the budget is used up and there is no
+  // spill file.
+  char* Allocate();
+  char* entry(int64_t i) const {
+    if (i < memory_entries_) {
+      return chunks_[i / chunk_entries_] + (i % chunk_entries_) * entry_bytes_;
+    }
+    i -= memory_entries_;
+    return chunks_[memory_chunks_ + i / chunk_entries_] +
+        (i % chunk_entries_) * entry_bytes_;
+  }
+  int64_t size() const { return size_; }
+  size_t entry_bytes() const { return entry_bytes_; }
+  // Bytes in memory and in the spill file.
+  size_t memory_bytes() const { return memory_entries_ * entry_bytes_; }
+  size_t spilled_bytes() const { return spill_bytes_; }
+
+ protected:
+  const size_t entry_bytes_;
+  const size_t budget_bytes_;
+  const string spill_file_;
+  int64_t chunk_entries_;
+  size_t chunk_bytes_;
+  vector<char*> chunks_;
+  // The chunks in memory come first, all of chunk_entries_ but the last.
+  int memory_chunks_;
+  int64_t memory_entries_;
+  int64_t size_;
+  // Spill file, -1 until the first chunk goes to it.
+  int fd_;
+  size_t spill_bytes_;
+
+DISABLE_COPY_AND_ASSIGN(TransformedCache);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_TRANSFORMED_CACHE_HPP_
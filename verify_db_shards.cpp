@@ -0,0 +1,176 @@
+// This program checks the sharding of a DB read with data_param.num_shards:
+// every epoch, the shards must be disjoint and together cover the DB. It
+// deals the ranges out as DataReader does, then runs a DataReader for every
+// shard and checks it reads exactly the entries of its ranges.
+// Usage:
+//    verify_db_shards [FLAGS] DB_PATH
+// Prints one tab separated line per shard and epoch: the entries of the
+// shard and a hash of their keys (FNV-1a in reading order), to compare with
+// other runs or machines. Exits with 1 if a check fails.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "boost/scoped_ptr.hpp"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "caffe/common.hpp"
+#include "caffe/data_reader.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db.hpp"
+#include "caffe/util/format.hpp"
+
+using namespace caffe;  // NOLINT(build/namespaces)
+using boost::scoped_ptr;
+using std::string;
+using std::vector;
+
+DEFINE_string(backend, "lmdb", "The backend {lmdb, leveldb} of the DB.");
+DEFINE_int32(num_shards, 2, "data_param.num_shards");
+DEFINE_int32(shard_range, 1024, "data_param.shard_range");
+DEFINE_int32(shard_seed, 1701, "data_param.shard_seed");
+DEFINE_int32(epochs, 2, "Epochs to check, every epoch is dealt anew.");
+DEFINE_bool(check_reader, true,
+    "Also run a DataReader for every shard and check what it reads.");
+DEFINE_string(dump_keys, "",
+    "Write the keys of every shard to this prefix followed by the shard id, "
+    "one per line in reading order.");
+
+static uint64_t HashKey(uint64_t hash, const string& key) {
+  for (int i = 0; i < key.size(); ++i) {
+    hash = (hash ^ static_cast<unsigned char>(key[i])) * 0x100000001b3ULL;
+  }
+  // Keys of different lengths must not run into each other.
+  return (hash ^ 0xff) * 0x100000001b3ULL;
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  // Print output to stderr (while still logging), stdout gets the hashes
+  FLAGS_alsologtostderr = 1;
+
+#ifndef GFLAGS_GFLAGS_H_
+  namespace gflags = google;
+#endif
+
+  gflags::SetUsageMessage("Check that the shards of a DB are disjoint and "
+        "cover it\n"
+        "Usage:\n"
+        "    verify_db_shards [FLAGS] DB_PATH\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (argc != 2) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "tools/verify_db_shards");
+    return 1;
+  }
+  CHECK_GT(FLAGS_num_shards, 1) << "num_shards must be more than 1";
+  CHECK_GT(FLAGS_shard_range, 0) << "shard_range must be positive";
+  CHECK_GT(FLAGS_epochs, 0) << "epochs must be positive";
+  const string source = argv[1];
+  const int num_shards = FLAGS_num_shards;
+
+  LayerParameter param;
+  param.set_phase(TRAIN);
+  DataParameter* data_param = param.mutable_data_param();
+  data_param->set_source(source);
+  data_param->set_backend(FLAGS_backend == "leveldb" ?
+      DataParameter_DB_LEVELDB : DataParameter_DB_LMDB);
+  data_param->set_batch_size(1);
+  data_param->set_num_shards(num_shards);
+  data_param->set_shard_range(FLAGS_shard_range);
+  data_param->set_shard_seed(FLAGS_shard_seed);
+
+  // The keys of the DB, in order.
+  vector<string> keys;
+  {
+    scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
+    db->Open(source, db::READ);
+    scoped_ptr<db::Cursor> cursor(db->NewCursor());
+    for (cursor->SeekToFirst(); cursor->valid(); cursor->Next()) {
+      keys.push_back(cursor->key());
+    }
+  }
+  const int entries = keys.size();
+  LOG(INFO) << source << ": " << entries << " entries";
+
+  vector<FILE*> dumps;
+  for (int shard = 0; !FLAGS_dump_keys.empty() && shard < num_shards;
+      ++shard) {
+    const string path = FLAGS_dump_keys + format_int(shard);
+    dumps.push_back(fopen(path.c_str(), "w"));
+    CHECK(dumps.back()) << "Failed to open " << path;
+  }
+  bool ok = true;
+  // The positions every shard is to read, epoch after epoch.
+  vector<vector<int> > expected(num_shards);
+  printf("epoch\tshard\tentries\tkey_hash\n");
+  for (int epoch = 0; epoch < FLAGS_epochs; ++epoch) {
+    vector<int> readers(entries, 0);
+    for (int shard = 0; shard < num_shards; ++shard) {
+      data_param->set_shard_id(shard);
+      vector<bool> owned;
+      DataReader::DealRanges(*data_param, entries, epoch, &owned);
+      uint64_t hash = 0xcbf29ce484222325ULL;
+      int count = 0;
+      for (int position = 0; position < entries; ++position) {
+        if (!owned[position / FLAGS_shard_range]) {
+          continue;
+        }
+        ++readers[position];
+        expected[shard].push_back(position);
+        hash = HashKey(hash, keys[position]);
+        ++count;
+        if (!dumps.empty()) {
+          fprintf(dumps[shard], "%s\n", keys[position].c_str());
+        }
+      }
+      printf("%d\t%d\t%d\t%016llx\n", epoch, shard, count,
+          static_cast<unsigned long long>(hash));  // NOLINT(runtime/int)
+    }
+    int missing = 0;
+    int shared = 0;
+    for (int position = 0; position < entries; ++position) {
+      missing += readers[position] == 0;
+      shared += readers[position] > 1;
+    }
+    if (missing || shared) {
+      LOG(ERROR) << "Epoch " << epoch << ": " << missing
+          << " entries in no shard, " << shared << " in several";
+      ok = false;
+    }
+  }
+  for (int i = 0; i < dumps.size(); ++i) {
+    fclose(dumps[i]);
+  }
+
+  // One reader at a time, each under its own name so that they do not
+  // share a body.
+  for (int shard = 0; FLAGS_check_reader && shard < num_shards; ++shard) {
+    param.set_name("shard_" + format_int(shard));
+    data_param->set_shard_id(shard);
+    DataReader reader(param);
+    const vector<int>& positions = expected[shard];
+    for (int i = 0; i < positions.size(); ++i) {
+      DatumRecord* record = reader.full().pop();
+      const int position = record->position();
+      reader.free().push(record);
+      if (position != positions[i]) {
+        LOG(ERROR) << "Shard " << shard << " read entry " << position
+            << " (" << keys[position] << ") as its record " << i
+            << ", expected entry " << positions[i] << " ("
+            << keys[positions[i]] << ")";
+        ok = false;
+        break;
+      }
+    }
+    LOG(INFO) << "Shard " << shard << ": read " << positions.size()
+        << " records";
+  }
+  LOG(INFO) << (ok ? "Shards are disjoint and cover the DB" :
+      "Sharding check failed");
+  return ok ? 0 : 1;
+}